@@ -293,6 +293,8 @@ typedef enum amqp_sasl_method_enum_ {
 /* Opaque struct. */
 typedef struct amqp_connection_state_t_ *amqp_connection_state_t;
 
+struct timeval;
+
 AMQP_PUBLIC_FUNCTION
 char const *
 AMQP_CALL amqp_version(void);
@@ -320,6 +322,9 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL empty_amqp_pool(amqp_pool_t *pool);
 
+/*
+ * The memory returned is not initialised.
+ */
 AMQP_PUBLIC_FUNCTION
 void *
 AMQP_CALL amqp_pool_alloc(amqp_pool_t *pool, size_t amount);
@@ -377,6 +382,29 @@ AMQP_CALL amqp_handle_input(amqp_connection_state_t state,
 		        amqp_bytes_t received_data,
 		        amqp_frame_t *decoded_frame);
 
+/*
+ * With lazy set, content header frames are returned with their
+ * properties still encoded (payload.properties.decoded is NULL and
+ * payload.properties.raw holds the bytes), and deliveries read with
+ * amqp_consume_message have a NULL properties pointer. The properties
+ * are then only decoded if amqp_decode_frame_properties or
+ * amqp_envelope_properties is called.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_lazy_properties(amqp_connection_state_t state,
+			       amqp_boolean_t lazy);
+
+/*
+ * Decode the properties of a content header frame, if that hasn't
+ * been done already. They stay valid until the buffers are next
+ * released.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_frame_properties(amqp_connection_state_t state,
+			           amqp_frame_t *frame);
+
 AMQP_PUBLIC_FUNCTION
 amqp_boolean_t
 AMQP_CALL amqp_release_buffers_ok(amqp_connection_state_t state);
@@ -401,6 +429,21 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_open_socket(char const *hostname, int portnumber);
 
+/*
+ * Like amqp_open_socket, but gives up with AMQP_ERROR_TIMEOUT if no
+ * connection has been made within the given time. A NULL timeout
+ * waits as long as connect() does.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_open_socket_timeout(char const *hostname, int portnumber,
+			       struct timeval *timeout);
+
+/*
+ * Sends the protocol header, returning the number of bytes sent (8),
+ * or a negative error code. On a non-blocking connection the header
+ * may only have been queued; amqp_flush pushes it out.
+ */
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_send_header(amqp_connection_state_t state);
@@ -414,6 +457,29 @@ int
 AMQP_CALL amqp_simple_wait_frame(amqp_connection_state_t state,
 		       amqp_frame_t *decoded_frame);
 
+/*
+ * Like amqp_simple_wait_frame, but waits no longer than the given
+ * time for a frame to arrive, then fails with AMQP_ERROR_TIMEOUT. A NULL
+ * timeout waits indefinitely.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frame_timeout(amqp_connection_state_t state,
+				     amqp_frame_t *decoded_frame,
+				     struct timeval *timeout);
+
+/*
+ * Wait for the next frame on the given channel. Frames for other
+ * channels that arrive in the meantime are kept, in order, for later
+ * calls to amqp_simple_wait_frame or this function. Heartbeats are
+ * skipped. This waits even if the connection is non-blocking.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
+					amqp_channel_t channel,
+					amqp_frame_t *decoded_frame);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_simple_wait_method(amqp_connection_state_t state,
@@ -444,6 +510,44 @@ AMQP_CALL amqp_simple_rpc_decoded(amqp_connection_state_t state,
 			      amqp_method_number_t reply_id,
 			      void *decoded_request_method);
 
+/*
+ * Pipelined RPCs. amqp_simple_rpc_send sends a request, like
+ * amqp_simple_rpc, but returns without waiting for the reply; the
+ * request joins the outbound batch, so many requests can go out
+ * together. amqp_simple_rpc_collect then waits for the reply to the
+ * oldest request not yet collected, and returns it just as
+ * amqp_simple_rpc would have. Replies to later requests that arrive
+ * first are kept until they are collected.
+ *
+ * If the broker answers a request by closing its channel, the requests
+ * sent after it on that channel will not be answered; collecting them
+ * fails straight away with AMQP_ERROR_CHANNEL_CLOSED. Likewise, once a
+ * request is answered with connection.close, every later request fails
+ * with AMQP_ERROR_CONNECTION_CLOSED.
+ *
+ * At most three expected reply ids may be given per request. Replies
+ * should all be collected before other synchronous methods are used.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_rpc_send(amqp_connection_state_t state,
+			   amqp_channel_t channel,
+			   amqp_method_number_t request_id,
+			   amqp_method_number_t *expected_reply_ids,
+			   void *decoded_request_method);
+
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_simple_rpc_collect(amqp_connection_state_t state);
+
+/*
+ * The number of requests sent with amqp_simple_rpc_send whose replies
+ * have not been collected.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_rpc_outstanding(amqp_connection_state_t state);
+
 /*
  * The API methods corresponding to most synchronous AMQP methods
  * return a pointer to the decoded method result.  Upon error, they
@@ -461,6 +565,25 @@ AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_get_rpc_reply(amqp_connection_state_t state);
 
+/*
+ * Limit how long synchronous operations (amqp_login, as a whole, and
+ * amqp_simple_rpc and the API methods built on it) wait for the
+ * broker. When the limit is hit they fail with a library exception
+ * whose error is AMQP_ERROR_TIMEOUT; the connection should then be
+ * considered unusable, as the reply may still arrive later. A NULL
+ * timeout, the default, waits indefinitely.
+ *
+ * The same limit applies to every send on a blocking connection,
+ * including publishes and the output flushed by the waits above: a
+ * send fails with -AMQP_ERROR_TIMEOUT once the socket has taken
+ * nothing for that long, leaving the connection unusable too. (A
+ * send that keeps making slow progress isn't cut short.)
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_rpc_timeout(amqp_connection_state_t state,
+			   struct timeval *timeout);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_login(amqp_connection_state_t state, char const *vhost,
@@ -477,6 +600,77 @@ AMQP_CALL amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t chann
 		        struct amqp_basic_properties_t_ const *properties,
 		        amqp_bytes_t body);
 
+/*
+ * Like amqp_basic_publish, but the frames are appended to the
+ * connection's outbound batch instead of being written straight
+ * away. The batch goes out when it reaches the limits set with
+ * amqp_set_batch_limits, when amqp_flush is called, or before the
+ * library next blocks reading from the socket.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_batch(amqp_connection_state_t state, amqp_channel_t channel,
+            amqp_bytes_t exchange, amqp_bytes_t routing_key,
+		        amqp_boolean_t mandatory, amqp_boolean_t immediate,
+		        struct amqp_basic_properties_t_ const *properties,
+		        amqp_bytes_t body);
+
+/*
+ * A publish template holds the method and content header frames for
+ * a given channel, exchange, routing key, flags and properties,
+ * encoded once so that repeated publishes only have to fill in the
+ * body size. It may only be used with the connection it was created
+ * for.
+ */
+typedef struct amqp_publish_template_t_ *amqp_publish_template_t;
+
+/*
+ * Returns NULL if out of memory, or if the frames cannot be encoded
+ * within the connection's frame_max (e.g. an overlong routing key).
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_publish_template_t
+AMQP_CALL amqp_new_publish_template(amqp_connection_state_t state,
+            amqp_channel_t channel,
+            amqp_bytes_t exchange, amqp_bytes_t routing_key,
+		        amqp_boolean_t mandatory, amqp_boolean_t immediate,
+		        struct amqp_basic_properties_t_ const *properties);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_publish_template(amqp_publish_template_t t);
+
+/*
+ * Equivalent to amqp_basic_publish, and amqp_basic_publish_batch,
+ * with the arguments the template was created with.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_template(amqp_connection_state_t state,
+            amqp_publish_template_t t, amqp_bytes_t body);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_template_batch(amqp_connection_state_t state,
+            amqp_publish_template_t t, amqp_bytes_t body);
+
+/*
+ * Write out any frames waiting in the outbound batch.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_flush(amqp_connection_state_t state);
+
+/*
+ * Set the size, in bytes, and the number of frames at which the
+ * outbound batch is flushed automatically. Zero disables the
+ * corresponding limit.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_batch_limits(amqp_connection_state_t state,
+			    size_t max_bytes, int max_frames);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_channel_close(amqp_connection_state_t state, amqp_channel_t channel,
@@ -501,6 +695,130 @@ int
 AMQP_CALL amqp_basic_reject(amqp_connection_state_t state, amqp_channel_t channel,
 		        uint64_t delivery_tag, amqp_boolean_t requeue);
 
+/*
+ * Coalesce the acknowledgements made on a channel. Once enabled,
+ * amqp_basic_ack with multiple unset only records the delivery tag;
+ * the recorded acks are sent when max_pending of them have built up,
+ * when the oldest is max_delay milliseconds old (0 for no limit),
+ * before the library next reads from the connection, at the end of
+ * each amqp_event_loop_run_once pass, or when amqp_flush_acks is
+ * called. Between those, the max_delay timer runs off
+ * amqp_heartbeat_tick (see below). An unbroken run of acknowledged
+ * tags goes out as a single basic.ack with multiple set; tags past a
+ * delivery that is still unacknowledged are acked one by one.
+ *
+ * Enable it before consuming on the channel, and acknowledge or reject
+ * every delivery on it. A max_pending of 0 sends whatever is held back
+ * and turns coalescing off again.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_coalesce_acks(amqp_connection_state_t state, amqp_channel_t channel,
+			 int max_pending, int max_delay);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_flush_acks(amqp_connection_state_t state, amqp_channel_t channel);
+
+/*
+ * A complete message delivered to a consumer, as returned by
+ * amqp_consume_message.
+ */
+typedef struct amqp_envelope_t_ {
+  amqp_channel_t channel;
+  amqp_bytes_t consumer_tag;
+  uint64_t delivery_tag;
+  amqp_boolean_t redelivered;
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  struct amqp_basic_properties_t_ *properties;
+  /* the encoded form of properties */
+  amqp_bytes_t raw_properties;
+  amqp_bytes_t body;
+} amqp_envelope_t;
+
+/*
+ * Wait for the next basic.deliver and read it together with its
+ * content header and body. A body that arrives in a single frame is
+ * returned in place; a longer one is gathered into one buffer. Either
+ * way the envelope stays valid until the buffers are next released
+ * (see amqp_maybe_release_buffers). A NULL timeout waits indefinitely.
+ *
+ * If the next frame is something other than a delivery, it is left
+ * to be read by amqp_simple_wait_frame and -AMQP_ERROR_UNEXPECTED_FRAME
+ * is returned.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_consume_message(amqp_connection_state_t state,
+			   amqp_envelope_t *envelope,
+			   struct timeval *timeout);
+
+/*
+ * Decode the envelope's properties, if that hasn't been done already
+ * (see amqp_set_lazy_properties).
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_envelope_properties(amqp_connection_state_t state,
+			       amqp_envelope_t *envelope);
+
+/*
+ * Publisher confirms. amqp_enable_confirms puts a channel into
+ * confirm mode (confirm.select). From then on each publish on the
+ * channel is numbered, starting at 1, and the broker's basic.ack and
+ * basic.nack replies are handled by the library as they arrive: they
+ * are not returned by amqp_simple_wait_frame, but passed to the
+ * callback, if any, once for each publish they settle. The callback
+ * runs while the library is reading from the connection, so it must
+ * not use the connection itself.
+ *
+ * At most max_in_flight publishes may be awaiting confirmation; a
+ * publish beyond that first waits for the oldest to be settled. A
+ * max_in_flight of 0 selects a default of 1024.
+ */
+typedef void (AMQP_CALL *amqp_confirm_callback_t)(amqp_connection_state_t state,
+						 amqp_channel_t channel,
+						 uint64_t delivery_tag,
+						 amqp_boolean_t acked,
+						 void *data);
+
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_enable_confirms(amqp_connection_state_t state,
+			   amqp_channel_t channel,
+			   int max_in_flight,
+			   amqp_confirm_callback_t callback,
+			   void *data);
+
+/*
+ * The delivery tag the broker will use to confirm the next publish on
+ * the channel, or 0 if the channel isn't in confirm mode.
+ */
+AMQP_PUBLIC_FUNCTION
+uint64_t
+AMQP_CALL amqp_confirm_next_tag(amqp_connection_state_t state,
+			    amqp_channel_t channel);
+
+/*
+ * The number of publishes on the channel still awaiting confirmation.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirms_outstanding(amqp_connection_state_t state,
+				amqp_channel_t channel);
+
+/*
+ * Wait until every publish on the channel has been confirmed. Fails
+ * with AMQP_ERROR_PUBLISH_NACKED if any publish has been nacked
+ * since the last call. A NULL timeout waits indefinitely.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_wait_for_confirms(amqp_connection_state_t state,
+			     amqp_channel_t channel,
+			     struct timeval *timeout);
+
 /*
  * Can be used to see if there is data still in the buffer, if so
  * calling amqp_simple_wait_frame will not immediately enter a
@@ -512,6 +830,286 @@ AMQP_PUBLIC_FUNCTION
 amqp_boolean_t
 AMQP_CALL amqp_data_in_buffer(amqp_connection_state_t state);
 
+/*
+ * Put the connection's socket into (or take it out of) non-blocking
+ * mode. In non-blocking mode, amqp_simple_wait_frame returns 0 with a
+ * frame_type of 0 when no complete frame can be read yet, and output
+ * that the socket won't accept straight away is kept queued until
+ * amqp_flush is called again. Synchronous operations such as
+ * amqp_login and amqp_simple_rpc still wait for their replies.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_nonblocking(amqp_connection_state_t state,
+			   amqp_boolean_t nonblocking);
+
+/*
+ * True if the next frame can only come from new data on the socket,
+ * i.e. the caller should wait for the socket to become readable
+ * before calling amqp_simple_wait_frame.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_wants_read(amqp_connection_state_t state);
+
+/*
+ * True if output is queued waiting to be written. The caller should
+ * call amqp_flush when the socket becomes writable.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_wants_write(amqp_connection_state_t state);
+
+/*
+ * Once heartbeats have been negotiated (see amqp_login), the library
+ * sends them whenever the connection has been idle for the heartbeat
+ * interval while it waits for frames, and fails the wait if nothing
+ * has been heard from the broker for two intervals.
+ *
+ * Code that runs its own event loop should wake up after at most
+ * amqp_heartbeat_timeout milliseconds (-1 if there is nothing to wait
+ * for) and call amqp_heartbeat_tick, which sends a heartbeat if one is
+ * due, sends acks held back by amqp_coalesce_acks for longer than
+ * their max_delay, and fails if the broker has gone quiet.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_heartbeat_timeout(amqp_connection_state_t state);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_heartbeat_tick(amqp_connection_state_t state);
+
+/*
+ * Send and receive through io_uring rather than plain socket calls,
+ * where the library was built with io_uring support. This applies to
+ * blocking mode only; it lets the flush of pending output and the
+ * wait for the broker's reply share one system call. Fails with
+ * AMQP_ERROR_NOT_SUPPORTED if io_uring isn't available.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_use_io_uring(amqp_connection_state_t state);
+
+/*
+ * An event loop drives any number of connections from one thread.
+ * Each connection added to it is put into non-blocking mode; every
+ * frame that arrives on it is passed to its callback, with a status
+ * of 0. The frame, and anything it points to, is only valid until
+ * the callback returns.
+ *
+ * If reading from or writing to a connection fails, the connection
+ * is removed from the loop, and its callback is invoked one last
+ * time with a NULL frame and the (negative) error code as status.
+ *
+ * A connection must be removed from the loop before it is destroyed;
+ * it's fine to do both from within its callback.
+ */
+typedef struct amqp_event_loop_t_ *amqp_event_loop_t;
+
+typedef void (AMQP_CALL *amqp_frame_callback_t)(amqp_connection_state_t state,
+					       amqp_frame_t const *frame,
+					       int status,
+					       void *data);
+
+AMQP_PUBLIC_FUNCTION
+amqp_event_loop_t
+AMQP_CALL amqp_new_event_loop(void);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_event_loop(amqp_event_loop_t loop);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_event_loop_add(amqp_event_loop_t loop,
+			  amqp_connection_state_t state,
+			  amqp_frame_callback_t callback,
+			  void *data);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_event_loop_remove(amqp_event_loop_t loop,
+			     amqp_connection_state_t state);
+
+/*
+ * Wait up to timeout milliseconds (forever if negative) for activity
+ * on any of the loop's connections, and handle it. Returns the number
+ * of frames dispatched.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_event_loop_run_once(amqp_event_loop_t loop, int timeout);
+
+/*
+ * Handle activity until amqp_event_loop_stop is called, or no
+ * connections are left.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_event_loop_run(amqp_event_loop_t loop);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_event_loop_stop(amqp_event_loop_t loop);
+
+/*
+ * A dispatcher sorts the frames of one connection by channel. Each
+ * channel assembles its own deliveries, so messages interleaved across
+ * channels come out whole, and each goes to the handler registered
+ * for its consumer tag or, failing that, for its channel. Methods
+ * other than basic.deliver go to the channel's on_method handler
+ * (connection-level methods to channel 0's); the content following a
+ * basic.return is skipped.
+ *
+ * The envelope and method passed to a handler are only valid until it
+ * returns. The dispatcher releases the connection's buffers whenever
+ * no message is partly assembled, so pointers obtained from other
+ * calls on the connection shouldn't be kept across dispatches. A
+ * dispatcher must be destroyed before its connection.
+ */
+typedef struct amqp_dispatcher_t_ *amqp_dispatcher_t;
+
+typedef void (AMQP_CALL *amqp_message_callback_t)(amqp_connection_state_t state,
+						 amqp_envelope_t const *envelope,
+						 void *data);
+
+typedef void (AMQP_CALL *amqp_method_callback_t)(amqp_connection_state_t state,
+						amqp_channel_t channel,
+						amqp_method_t const *method,
+						void *data);
+
+AMQP_PUBLIC_FUNCTION
+amqp_dispatcher_t
+AMQP_CALL amqp_new_dispatcher(amqp_connection_state_t state);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_dispatcher(amqp_dispatcher_t d);
+
+/*
+ * Set the handlers for a channel; either may be NULL.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_dispatcher_on_channel(amqp_dispatcher_t d,
+				 amqp_channel_t channel,
+				 amqp_message_callback_t on_message,
+				 amqp_method_callback_t on_method,
+				 void *data);
+
+/*
+ * Set the handler for messages to one consumer, taking precedence
+ * over the channel's. A NULL on_message removes it.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_dispatcher_on_consumer(amqp_dispatcher_t d,
+				  amqp_channel_t channel,
+				  amqp_bytes_t consumer_tag,
+				  amqp_message_callback_t on_message,
+				  void *data);
+
+/*
+ * Feed a frame read from the connection by other means, such as an
+ * event loop callback, to the dispatcher. While any message is partly
+ * assembled, the dispatcher keeps the connection's buffers from being
+ * released (amqp_maybe_release_buffers does nothing), since the
+ * message refers to frames already read.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_dispatch_frame(amqp_dispatcher_t d, amqp_frame_t const *frame);
+
+/*
+ * Read and dispatch frames until at least one handler has been run,
+ * or, on a non-blocking connection, until no more frames are to be
+ * had. A NULL timeout waits indefinitely.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_dispatch(amqp_dispatcher_t d, struct timeval *timeout);
+
+/*
+ * A publisher lets many threads publish on one connection at once.
+ * amqp_start_publisher puts the connection into non-blocking mode and
+ * hands it to an I/O thread of its own; from then until
+ * amqp_stop_publisher returns, the connection belongs to that thread
+ * and must not be used in any other way. amqp_start_publisher returns
+ * NULL if it runs out of resources, or if the library was built
+ * without thread support.
+ *
+ * amqp_publisher_publish may be called from any number of threads.
+ * It encodes the message on the calling thread and queues it without
+ * taking a lock; the I/O thread writes out everything queued so far
+ * in one go. A return of 0 means the message was queued, not that it
+ * was sent. Incoming frames are read and dropped, apart from publisher
+ * confirms, which are settled as usual (callbacks run on the I/O
+ * thread); messages sent through a publisher are not tracked by
+ * confirms, though, so channels used with it shouldn't be in confirm
+ * mode. Once the connection fails, or the broker closes a channel or
+ * the connection, publishing fails with the error.
+ *
+ * amqp_stop_publisher waits for the queued messages to be written,
+ * stops the thread, returns the connection to its previous mode and
+ * frees the publisher. It must not be called while other threads may
+ * still be publishing. It returns the first error encountered, if any.
+ *
+ * If the broker stops reading (e.g. while the connection is blocked),
+ * amqp_stop_publisher waits for it indefinitely. amqp_stop_publisher_timeout
+ * gives up once the timeout has passed and returns AMQP_ERROR_TIMEOUT
+ * (a NULL timeout waits indefinitely). Messages still queued are then
+ * dropped. Output the I/O thread had already passed to the connection
+ * stays in its outbound buffer, possibly part written, and goes out
+ * with the connection's next write.
+ */
+typedef struct amqp_publisher_t_ *amqp_publisher_t;
+
+AMQP_PUBLIC_FUNCTION
+amqp_publisher_t
+AMQP_CALL amqp_start_publisher(amqp_connection_state_t state);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publisher_publish(amqp_publisher_t p,
+			     amqp_channel_t channel,
+			     amqp_bytes_t exchange,
+			     amqp_bytes_t routing_key,
+			     amqp_boolean_t mandatory,
+			     amqp_boolean_t immediate,
+			     struct amqp_basic_properties_t_ const *properties,
+			     amqp_bytes_t body);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_stop_publisher(amqp_publisher_t p);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_stop_publisher_timeout(amqp_publisher_t p,
+				  struct timeval *timeout);
+
+/*
+ * Error codes. Functions that return an int fail with one of these
+ * negated, or with a negated operating system error; either can be
+ * described by passing the code (not negated) to amqp_error_string.
+ * In an amqp_rpc_reply_t, library_error holds the code itself.
+ */
+#define AMQP_ERROR_NO_MEMORY 1
+#define AMQP_ERROR_BAD_AMQP_DATA 2
+#define AMQP_ERROR_UNKNOWN_CLASS 3
+#define AMQP_ERROR_UNKNOWN_METHOD 4
+#define AMQP_ERROR_GETHOSTBYNAME_FAILED 5
+#define AMQP_ERROR_INCOMPATIBLE_AMQP_VERSION 6
+#define AMQP_ERROR_CONNECTION_CLOSED 7
+#define AMQP_ERROR_BAD_AMQP_URL 8
+#define AMQP_ERROR_NOT_SUPPORTED 9
+#define AMQP_ERROR_TIMEOUT 10
+#define AMQP_ERROR_HEARTBEAT_TIMEOUT 11
+#define AMQP_ERROR_UNEXPECTED_FRAME 12
+#define AMQP_ERROR_PUBLISH_NACKED 13
+#define AMQP_ERROR_CHANNEL_CLOSED 14
+
 /*
  * Get the error string for the given error code.
  *
@@ -531,6 +1129,118 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_encode_table(amqp_bytes_t encoded, amqp_table_t *input, size_t *offset);
 
+/*
+ * Look up a key in a table by scanning its entries, returning the
+ * value of the first entry with that key, or NULL if there is none.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_field_value_t *
+AMQP_CALL amqp_table_get(amqp_table_t const *table, amqp_bytes_t key);
+
+/*
+ * For tables with many entries that are looked up repeatedly,
+ * amqp_index_table builds a hash index of the keys in the given pool
+ * (typically the one the table was decoded into), and
+ * amqp_table_index_get looks keys up through it. The index refers to
+ * the table, which must not be changed or freed while the index is
+ * in use. amqp_index_table returns NULL if out of memory.
+ */
+typedef struct amqp_table_index_t_ amqp_table_index_t;
+
+AMQP_PUBLIC_FUNCTION
+amqp_table_index_t *
+AMQP_CALL amqp_index_table(amqp_pool_t *pool, amqp_table_t const *table);
+
+AMQP_PUBLIC_FUNCTION
+amqp_field_value_t *
+AMQP_CALL amqp_table_index_get(amqp_table_index_t const *index,
+			   amqp_bytes_t key);
+
+/*
+ * A table writer encodes a table straight into a caller-supplied
+ * buffer, one entry at a time, without building amqp_table_entry_t
+ * arrays first. Tables and arrays can be nested by bracketing their
+ * contents with amqp_table_begin_table or amqp_table_begin_array and
+ * amqp_table_end; inside an array the keys are ignored.
+ *
+ * Errors (AMQP_ERROR_BAD_AMQP_DATA for running out of buffer or a key
+ * over 255 bytes, AMQP_ERROR_NOT_SUPPORTED for nesting too deep)
+ * stick: once one has happened the other calls do nothing and return
+ * it, so the return values can be left unchecked until
+ * amqp_table_writer_finish.
+ *
+ * amqp_table_writer_finish fills in a table that refers to the
+ * encoded bytes in the buffer and to the writer itself, and can be
+ * passed wherever a table is encoded (method arguments, the headers
+ * property), where it is copied as it is. It is only valid for as
+ * long as the buffer and the writer are, and only for encoding: its
+ * num_entries is AMQP_ENCODED_TABLE rather than a count, so code
+ * that loops over the entries of a table must check for it.
+ * amqp_table_get finds nothing in it, and amqp_index_table returns
+ * NULL. Nothing can be added to a writer once it has finished.
+ */
+#define AMQP_TABLE_WRITER_MAX_DEPTH 8
+
+/* num_entries of a table that has been encoded already */
+#define AMQP_ENCODED_TABLE (-1)
+
+typedef struct amqp_table_writer_t_ {
+  amqp_bytes_t buffer;
+  size_t offset;
+  int error;
+  int depth;
+  /* where the size of each open table or array goes */
+  size_t starts[AMQP_TABLE_WRITER_MAX_DEPTH];
+  amqp_boolean_t in_array[AMQP_TABLE_WRITER_MAX_DEPTH];
+  /* key holds the encoded table, once finished */
+  amqp_table_entry_t encoded;
+} amqp_table_writer_t;
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_table_writer_init(amqp_table_writer_t *w, amqp_bytes_t buffer);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_add(amqp_table_writer_t *w, amqp_bytes_t key,
+		     amqp_field_value_t const *value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_add_utf8(amqp_table_writer_t *w, amqp_bytes_t key,
+			  amqp_bytes_t value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_add_i32(amqp_table_writer_t *w, amqp_bytes_t key,
+			 int32_t value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_add_i64(amqp_table_writer_t *w, amqp_bytes_t key,
+			 int64_t value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_add_boolean(amqp_table_writer_t *w, amqp_bytes_t key,
+			     amqp_boolean_t value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_begin_table(amqp_table_writer_t *w, amqp_bytes_t key);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_begin_array(amqp_table_writer_t *w, amqp_bytes_t key);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_end(amqp_table_writer_t *w);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_writer_finish(amqp_table_writer_t *w, amqp_table_t *table);
+
 struct amqp_connection_info {
   char *user;
   char *password;
@@ -547,6 +1257,62 @@ AMQP_PUBLIC_FUNCTION
 int 
 AMQP_CALL amqp_parse_url(char *url, struct amqp_connection_info *parsed);
 
+/*
+ * A connection pool lends logged-in connections to threads, so that
+ * short-lived work needn't pay for a handshake each time. Connections
+ * are opened as they are first needed, up to max_connections, and each
+ * comes with a channel already open.
+ *
+ * A lease gives the holder sole use of the connection until it is
+ * released; leasing waits while all of the connections are lent out.
+ * Release a connection as reusable only if it is in the state it was
+ * leased in: blocking, with the leased channel still open and no
+ * replies outstanding. Otherwise it is closed, and replaced with a
+ * fresh one when next needed.
+ *
+ * Each connection logs in with the given channel_max, frame_max and
+ * heartbeat, as amqp_login takes them, and opens the given channel.
+ * With heartbeats on, a connection that has sat idle for two heartbeat
+ * intervals is replaced rather than lent out, since the broker will
+ * have given up on it.
+ *
+ * amqp_new_connection_pool copies the connection details, and returns
+ * NULL if out of memory, if channel is 0, or if the library was built
+ * without thread support. A pool must only be destroyed once every
+ * lease has been released.
+ */
+typedef struct amqp_connection_pool_t_ *amqp_connection_pool_t;
+
+typedef struct amqp_lease_t_ {
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+  void *slot; /* private to the pool */
+} amqp_lease_t;
+
+AMQP_PUBLIC_FUNCTION
+amqp_connection_pool_t
+AMQP_CALL amqp_new_connection_pool(struct amqp_connection_info const *info,
+			       int max_connections,
+			       int channel_max,
+			       int frame_max,
+			       int heartbeat,
+			       amqp_channel_t channel);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_connection_pool(amqp_connection_pool_t pool);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_connection_pool_lease(amqp_connection_pool_t pool,
+				 amqp_lease_t *lease);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_connection_pool_release(amqp_connection_pool_t pool,
+				   amqp_lease_t *lease,
+				   amqp_boolean_t reusable);
+
 AMQP_END_DECLS
 
 #include <amqp_framing.h>
@@ -51,6 +51,12 @@ static const char *client_error_strings[ERROR_MAX] = {
   "incompatible AMQP version", /* ERROR_INCOMPATIBLE_AMQP_VERSION */
   "connection closed unexpectedly", /* ERROR_CONNECTION_CLOSED */
   "could not parse AMQP URL", /* ERROR_BAD_AMQP_URL */
+  "operation not supported", /* ERROR_NOT_SUPPORTED */
+  "operation timed out", /* ERROR_TIMEOUT */
+  "missed heartbeats from the broker", /* ERROR_HEARTBEAT_TIMEOUT */
+  "unexpected frame", /* ERROR_UNEXPECTED_FRAME */
+  "message rejected by the broker", /* ERROR_PUBLISH_NACKED */
+  "channel closed by the broker", /* ERROR_CHANNEL_CLOSED */
 };
 
 char *amqp_error_string(int err)
@@ -96,6 +102,327 @@ const amqp_array_t amqp_empty_array = { 0, NULL };
    ? (replytype *) state->most_recent_api_result.reply.decoded		\
    : NULL)
 
+static const uint8_t frame_end_byte = AMQP_FRAME_END;
+
+/* Sends the given number of frames already encoded in head, followed
+   by the body frames for body. */
+static int send_content(amqp_connection_state_t state,
+			amqp_channel_t channel,
+			void *head,
+			size_t head_len,
+			int head_frames,
+			amqp_bytes_t body,
+			amqp_boolean_t buffered)
+{
+  size_t body_offset;
+  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  int res;
+
+  /* Each body frame takes two iovecs: one for the previous frame's
+     footer together with this frame's header, and one for the body
+     fragment itself. */
+  struct iovec iov[AMQP_SEND_IOV_MAX];
+  uint8_t glue[AMQP_SEND_IOV_MAX / 2][FOOTER_SIZE + HEADER_SIZE];
+  int iovcnt, gluecnt, frames;
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = head_len;
+  iovcnt = 1;
+  gluecnt = 0;
+  frames = head_frames;
+
+  body_offset = 0;
+  while (body_offset < body.len) {
+    size_t remaining = body.len - body_offset;
+    size_t fragment_len;
+    uint8_t *frame_glue = glue[gluecnt++];
+    size_t glue_len = 0;
+
+    if (remaining >= usable_body_payload_size) {
+      fragment_len = usable_body_payload_size;
+    } else {
+      fragment_len = remaining;
+    }
+
+    if (body_offset != 0) {
+      amqp_e8(frame_glue, 0, AMQP_FRAME_END);
+      glue_len = FOOTER_SIZE;
+    }
+
+    amqp_e8(frame_glue, glue_len, AMQP_FRAME_BODY);
+    amqp_e16(frame_glue, glue_len + 1, channel);
+    amqp_e32(frame_glue, glue_len + 3, fragment_len);
+    glue_len += HEADER_SIZE;
+
+    iov[iovcnt].iov_base = frame_glue;
+    iov[iovcnt].iov_len = glue_len;
+    iovcnt++;
+    iov[iovcnt].iov_base = amqp_offset(body.bytes, body_offset);
+    iov[iovcnt].iov_len = fragment_len;
+    iovcnt++;
+    frames++;
+
+    body_offset += fragment_len;
+
+    /* leave room for another body frame and the final footer */
+    if (iovcnt + 3 > AMQP_SEND_IOV_MAX) {
+      res = amqp_send_iov(state, iov, iovcnt, frames, buffered);
+      if (res < 0)
+	return res;
+
+      iovcnt = 0;
+      gluecnt = 0;
+      frames = 0;
+    }
+  }
+
+  if (body.len > 0) {
+    iov[iovcnt].iov_base = (void *) &frame_end_byte;
+    iov[iovcnt].iov_len = FOOTER_SIZE;
+    iovcnt++;
+  }
+
+  return amqp_send_iov(state, iov, iovcnt, frames, buffered);
+}
+
+/* A basic.publish frame with the longest exchange and routing key */
+#define MAX_PUBLISH_FRAME_SIZE (HEADER_SIZE + 4 + 2 + 2 * 256 + 1 + FOOTER_SIZE)
+
+static int send_publish(amqp_connection_state_t state,
+			 amqp_channel_t channel,
+			 amqp_bytes_t exchange,
+			 amqp_bytes_t routing_key,
+			 amqp_boolean_t mandatory,
+			 amqp_boolean_t immediate,
+			 amqp_basic_properties_t const *properties,
+			 amqp_bytes_t body,
+			 amqp_boolean_t buffered)
+{
+  size_t header_offset, out_len;
+  struct iovec iov[1];
+  int res;
+
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t default_properties;
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  /* Encode the method and content header frames back to back, so that
+     the whole message can go out in one writev */
+  out_len = 0;
+  res = amqp_encode_basic_publish_frame(state->outbound_buffer, &out_len,
+					channel, &m);
+  if (res < 0)
+    return res;
+
+  header_offset = out_len;
+  res = amqp_encode_basic_header_frame(state->outbound_buffer, &out_len,
+				       channel, body.len, properties);
+  if (res < 0) {
+    /* The two frames don't fit in the outbound buffer together, so the
+       method frame goes on its own. Keep it aside until the header has
+       been encoded, so that nothing is sent if the header can't be. */
+    uint8_t method_frame[MAX_PUBLISH_FRAME_SIZE];
+
+    memcpy(method_frame, state->outbound_buffer.bytes, header_offset);
+    out_len = 0;
+    res = amqp_encode_basic_header_frame(state->outbound_buffer, &out_len,
+					 channel, body.len, properties);
+    if (res < 0)
+      return res;
+
+    iov[0].iov_base = method_frame;
+    iov[0].iov_len = header_offset;
+    res = amqp_send_iov(state, iov, 1, 1, buffered);
+    if (res < 0)
+      return res;
+
+    header_offset = 0;
+  }
+
+  return send_content(state, channel, state->outbound_buffer.bytes, out_len,
+		      (header_offset == 0) ? 1 : 2, body, buffered);
+}
+
+#define DEFAULT_CONFIRM_WINDOW 1024
+
+amqp_confirm_t *amqp_find_confirm(amqp_connection_state_t state,
+				  amqp_channel_t channel)
+{
+  amqp_confirm_t *confirm;
+
+  for (confirm = state->confirms; confirm != NULL; confirm = confirm->next)
+    if (confirm->channel == channel)
+      return confirm;
+
+  return NULL;
+}
+
+static void drop_confirm(amqp_connection_state_t state,
+			 amqp_channel_t channel)
+{
+  amqp_confirm_t **link;
+
+  for (link = &state->confirms; *link != NULL; link = &(*link)->next) {
+    if ((*link)->channel == channel) {
+      amqp_confirm_t *confirm = *link;
+      *link = confirm->next;
+      free(confirm);
+      return;
+    }
+  }
+}
+
+static uint32_t *pending_word(amqp_confirm_t *confirm, uint64_t tag,
+			      uint32_t *bit)
+{
+  size_t slot = (size_t)(tag % (uint64_t)confirm->window);
+  *bit = (uint32_t)1 << (slot % 32);
+  return &confirm->pending[slot / 32];
+}
+
+static int confirm_pending(amqp_confirm_t *confirm, uint64_t tag)
+{
+  uint32_t bit;
+  return (*pending_word(confirm, tag, &bit) & bit) != 0;
+}
+
+static void settle_confirm(amqp_connection_state_t state,
+			   amqp_confirm_t *confirm,
+			   uint64_t tag,
+			   amqp_boolean_t acked)
+{
+  uint32_t bit;
+  uint32_t *word = pending_word(confirm, tag, &bit);
+
+  *word &= ~bit;
+  confirm->outstanding--;
+  if (!acked)
+    confirm->nacked = 1;
+
+  if (confirm->callback != NULL)
+    confirm->callback(state, confirm->channel, tag, acked,
+		      confirm->callback_data);
+}
+
+int amqp_handle_confirm(amqp_connection_state_t state,
+			amqp_frame_t const *frame)
+{
+  amqp_confirm_t *confirm;
+  uint64_t tag;
+  amqp_boolean_t multiple, acked;
+
+  if (state->confirms == NULL || frame->frame_type != AMQP_FRAME_METHOD)
+    return 0;
+
+  switch (frame->payload.method.id) {
+  case AMQP_BASIC_ACK_METHOD: {
+    amqp_basic_ack_t *m = frame->payload.method.decoded;
+    tag = m->delivery_tag;
+    multiple = m->multiple;
+    acked = 1;
+    break;
+  }
+  case AMQP_BASIC_NACK_METHOD: {
+    amqp_basic_nack_t *m = frame->payload.method.decoded;
+    tag = m->delivery_tag;
+    multiple = m->multiple;
+    acked = 0;
+    break;
+  }
+  default:
+    return 0;
+  }
+
+  confirm = amqp_find_confirm(state, frame->channel);
+  if (confirm == NULL)
+    return 0;
+
+  /* With multiple set, a tag of 0 covers everything published so far */
+  if (multiple && tag == 0)
+    tag = confirm->next_tag - 1;
+
+  if (tag >= confirm->next_tag || tag == 0)
+    return -ERROR_BAD_AMQP_DATA;
+
+  if (multiple) {
+    uint64_t t;
+    for (t = confirm->oldest_tag; t <= tag; t++)
+      if (confirm_pending(confirm, t))
+	settle_confirm(state, confirm, t, acked);
+  } else if (tag >= confirm->oldest_tag && confirm_pending(confirm, tag)) {
+    settle_confirm(state, confirm, tag, acked);
+  }
+
+  while (confirm->oldest_tag < confirm->next_tag
+	 && !confirm_pending(confirm, confirm->oldest_tag))
+    confirm->oldest_tag++;
+
+  return 1;
+}
+
+/* Makes sure there is a free slot in the confirm ring for the next
+   publish on the channel, if it is in confirm mode */
+static int reserve_confirm(amqp_connection_state_t state,
+			   amqp_confirm_t *confirm)
+{
+  if (confirm != NULL
+      && confirm->next_tag - confirm->oldest_tag >= (uint64_t)confirm->window) {
+    /* The ring is full: the oldest publish has to be settled before
+       its slot can be reused */
+    return amqp_wait_confirms(state, confirm, confirm->window - 1);
+  }
+
+  return 0;
+}
+
+static void record_confirm(amqp_confirm_t *confirm)
+{
+  uint32_t bit;
+
+  if (confirm == NULL)
+    return;
+
+  *pending_word(confirm, confirm->next_tag, &bit) |= bit;
+  confirm->next_tag++;
+  confirm->outstanding++;
+}
+
+static int basic_publish(amqp_connection_state_t state,
+			 amqp_channel_t channel,
+			 amqp_bytes_t exchange,
+			 amqp_bytes_t routing_key,
+			 amqp_boolean_t mandatory,
+			 amqp_boolean_t immediate,
+			 amqp_basic_properties_t const *properties,
+			 amqp_bytes_t body,
+			 amqp_boolean_t buffered)
+{
+  amqp_confirm_t *confirm = amqp_find_confirm(state, channel);
+  int res;
+
+  res = reserve_confirm(state, confirm);
+  if (res < 0)
+    return res;
+
+  res = send_publish(state, channel, exchange, routing_key, mandatory,
+		     immediate, properties, body, buffered);
+  if (res < 0)
+    return res;
+
+  record_confirm(confirm);
+  return 0;
+}
+
 int amqp_basic_publish(amqp_connection_state_t state,
 		       amqp_channel_t channel,
 		       amqp_bytes_t exchange,
@@ -105,13 +432,46 @@ int amqp_basic_publish(amqp_connection_state_t state,
 		       amqp_basic_properties_t const *properties,
 		       amqp_bytes_t body)
 {
-  amqp_frame_t f;
-  size_t body_offset;
-  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
-  int res;
+  return basic_publish(state, channel, exchange, routing_key,
+		       mandatory, immediate, properties, body, 0);
+}
+
+int amqp_basic_publish_batch(amqp_connection_state_t state,
+			     amqp_channel_t channel,
+			     amqp_bytes_t exchange,
+			     amqp_bytes_t routing_key,
+			     amqp_boolean_t mandatory,
+			     amqp_boolean_t immediate,
+			     amqp_basic_properties_t const *properties,
+			     amqp_bytes_t body)
+{
+  return basic_publish(state, channel, exchange, routing_key,
+		       mandatory, immediate, properties, body, 1);
+}
 
+struct amqp_publish_template_t_ {
+  amqp_channel_t channel;
+  size_t header_offset;
+  size_t len;
+  /* the encoded method and content header frames follow */
+};
+
+#define TEMPLATE_INITIAL_ROOM 512
+
+amqp_publish_template_t amqp_new_publish_template(amqp_connection_state_t state,
+						  amqp_channel_t channel,
+						  amqp_bytes_t exchange,
+						  amqp_bytes_t routing_key,
+						  amqp_boolean_t mandatory,
+						  amqp_boolean_t immediate,
+						  amqp_basic_properties_t const *properties)
+{
+  amqp_publish_template_t t;
   amqp_basic_publish_t m;
   amqp_basic_properties_t default_properties;
+  amqp_bytes_t encoded;
+  size_t room, len, header_offset;
+  int res;
 
   m.exchange = exchange;
   m.routing_key = routing_key;
@@ -119,50 +479,351 @@ int amqp_basic_publish(amqp_connection_state_t state,
   m.immediate = immediate;
   m.ticket = 0;
 
-  res = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
-  if (res < 0)
-    return res;
-
   if (properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
     properties = &default_properties;
   }
 
-  f.frame_type = AMQP_FRAME_HEADER;
-  f.channel = channel;
-  f.payload.properties.class_id = AMQP_BASIC_CLASS;
-  f.payload.properties.body_size = body.len;
-  f.payload.properties.decoded = (void *) properties;
+  for (room = TEMPLATE_INITIAL_ROOM;; room *= 4) {
+    t = malloc(sizeof(*t) + room);
+    if (t == NULL)
+      return NULL;
+
+    encoded.bytes = t + 1;
+    encoded.len = room;
+    len = 0;
+    res = amqp_encode_basic_publish_frame(encoded, &len, channel, &m);
+    header_offset = len;
+    if (res == 0)
+      res = amqp_encode_basic_header_frame(encoded, &len, channel, 0,
+					   properties);
+    if (res == 0)
+      break;
+
+    free(t);
+    if (res != -ERROR_BAD_AMQP_DATA || room >= 2 * (size_t)state->frame_max)
+      return NULL;
+  }
+
+  /* Each frame has to be acceptable to the broker on its own */
+  if (header_offset > (size_t)state->frame_max
+      || len - header_offset > (size_t)state->frame_max) {
+    free(t);
+    return NULL;
+  }
+
+  t->channel = channel;
+  t->header_offset = header_offset;
+  t->len = len;
+  return t;
+}
+
+void amqp_destroy_publish_template(amqp_publish_template_t t)
+{
+  free(t);
+}
+
+static int publish_template(amqp_connection_state_t state,
+			    amqp_publish_template_t t,
+			    amqp_bytes_t body,
+			    amqp_boolean_t buffered)
+{
+  amqp_confirm_t *confirm = amqp_find_confirm(state, t->channel);
+  int res;
 
-  res = amqp_send_frame(state, &f);
+  res = reserve_confirm(state, confirm);
   if (res < 0)
     return res;
 
-  body_offset = 0;
-  while (body_offset < body.len) {
-    size_t remaining = body.len - body_offset;
+  /* The body size is the only part of the message that changes
+     between publishes; it follows the class id and weight in the
+     content header */
+  amqp_e64(t + 1, t->header_offset + HEADER_SIZE + 4, body.len);
 
-    if (remaining == 0)
-      break;
+  res = send_content(state, t->channel, t + 1, t->len, 2, body, buffered);
+  if (res < 0)
+    return res;
 
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-    } else {
-      f.payload.body_fragment.len = remaining;
+  record_confirm(confirm);
+  return 0;
+}
+
+int amqp_basic_publish_template(amqp_connection_state_t state,
+				amqp_publish_template_t t,
+				amqp_bytes_t body)
+{
+  return publish_template(state, t, body, 0);
+}
+
+int amqp_basic_publish_template_batch(amqp_connection_state_t state,
+				      amqp_publish_template_t t,
+				      amqp_bytes_t body)
+{
+  return publish_template(state, t, body, 1);
+}
+
+static amqp_ack_batch_t *find_ack_batch(amqp_connection_state_t state,
+					amqp_channel_t channel)
+{
+  amqp_ack_batch_t *batch;
+
+  for (batch = state->ack_batches; batch != NULL; batch = batch->next)
+    if (batch->channel == channel)
+      return batch;
+
+  return NULL;
+}
+
+static void drop_ack_batch(amqp_connection_state_t state,
+			   amqp_channel_t channel)
+{
+  amqp_ack_batch_t **link;
+
+  for (link = &state->ack_batches; *link != NULL; link = &(*link)->next) {
+    if ((*link)->channel == channel) {
+      amqp_ack_batch_t *batch = *link;
+      *link = batch->next;
+      free(batch);
+      return;
+    }
+  }
+}
+
+static uint32_t *ack_word(uint32_t *ring, uint64_t tag, uint32_t *bit)
+{
+  size_t slot = (size_t)(tag % AMQP_ACK_WINDOW);
+  *bit = (uint32_t)1 << (slot % 32);
+  return &ring[slot / 32];
+}
+
+static int ack_bit(uint32_t *ring, uint64_t tag)
+{
+  uint32_t bit;
+  return (*ack_word(ring, tag, &bit) & bit) != 0;
+}
+
+static void set_ack_bit(uint32_t *ring, uint64_t tag)
+{
+  uint32_t bit;
+  *ack_word(ring, tag, &bit) |= bit;
+}
+
+static int send_ack(amqp_connection_state_t state,
+		    amqp_channel_t channel,
+		    uint64_t delivery_tag,
+		    amqp_boolean_t multiple)
+{
+  amqp_frame_t frame;
+  amqp_basic_ack_t m;
+
+  m.delivery_tag = delivery_tag;
+  m.multiple = multiple;
+
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = channel;
+  frame.payload.method.id = AMQP_BASIC_ACK_METHOD;
+  frame.payload.method.decoded = &m;
+  return amqp_send_frame_batch(state, &frame);
+}
+
+/* Marks every tag up to tag as settled with the broker */
+static void settle_acks(amqp_ack_batch_t *batch, uint64_t tag)
+{
+  uint64_t t;
+
+  if (tag - batch->base >= AMQP_ACK_WINDOW) {
+    memset(batch->acked, 0, AMQP_ACK_WINDOW / 8);
+    memset(batch->sent, 0, AMQP_ACK_WINDOW / 8);
+  } else {
+    for (t = batch->base + 1; t <= tag; t++) {
+      uint32_t bit;
+      *ack_word(batch->acked, t, &bit) &= ~bit;
+      *ack_word(batch->sent, t, &bit) &= ~bit;
+    }
+  }
+
+  batch->base = tag;
+  if (batch->highest < tag)
+    batch->highest = tag;
+}
+
+static int flush_ack_batch(amqp_connection_state_t state,
+			   amqp_ack_batch_t *batch)
+{
+  uint64_t tag = batch->base;
+  uint64_t multiple_tag = 0;
+  int res;
+
+  if (batch->pending == 0)
+    return 0;
+
+  /* The unbroken run of acknowledged tags goes out as one ack with
+     multiple set, naming the last of them not already acknowledged on
+     its own (the broker rejects a tag it no longer has outstanding). */
+  while (tag < batch->highest && ack_bit(batch->acked, tag + 1)) {
+    tag++;
+    if (!ack_bit(batch->sent, tag))
+      multiple_tag = tag;
+  }
+
+  if (multiple_tag != 0) {
+    res = send_ack(state, batch->channel, multiple_tag, 1);
+    if (res < 0)
+      return res;
+  }
+
+  settle_acks(batch, tag);
+
+  /* Past the first gap, they go out one by one. Everything below
+     unsent was dealt with by an earlier flush. */
+  tag = batch->unsent > batch->base ? batch->unsent : batch->base + 1;
+  for (; batch->unsent != 0 && tag <= batch->highest; tag++) {
+    if (ack_bit(batch->acked, tag) && !ack_bit(batch->sent, tag)) {
+      res = send_ack(state, batch->channel, tag, 0);
+      if (res < 0)
+	return res;
+      set_ack_bit(batch->sent, tag);
+    }
+  }
+
+  batch->unsent = 0;
+  batch->pending = 0;
+  return 0;
+}
+
+int amqp_flush_coalesced_acks(amqp_connection_state_t state)
+{
+  amqp_ack_batch_t *batch;
+  int res;
+
+  for (batch = state->ack_batches; batch != NULL; batch = batch->next) {
+    res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return res;
+  }
+
+  return 0;
+}
+
+/* When the batch's oldest held-back ack has waited max_delay */
+static uint64_t ack_batch_deadline(amqp_ack_batch_t const *batch)
+{
+  return batch->since + (uint64_t)batch->max_delay;
+}
+
+int amqp_coalesced_acks_timeout(amqp_connection_state_t state)
+{
+  amqp_ack_batch_t *batch;
+  uint64_t now = 0;
+  int timeout = -1;
+
+  for (batch = state->ack_batches; batch != NULL; batch = batch->next) {
+    uint64_t deadline;
+    int wait;
+
+    if (batch->pending == 0 || batch->max_delay == 0)
+      continue;
+
+    if (now == 0)
+      now = amqp_get_monotonic_ms();
+
+    deadline = ack_batch_deadline(batch);
+    wait = now >= deadline ? 0 : (int)(deadline - now);
+    if (timeout < 0 || wait < timeout)
+      timeout = wait;
+  }
+
+  return timeout;
+}
+
+int amqp_flush_due_acks(amqp_connection_state_t state)
+{
+  amqp_ack_batch_t *batch;
+  uint64_t now = 0;
+  int flushed = 0;
+  int res;
+
+  for (batch = state->ack_batches; batch != NULL; batch = batch->next) {
+    if (batch->pending == 0 || batch->max_delay == 0)
+      continue;
+
+    if (now == 0)
+      now = amqp_get_monotonic_ms();
+
+    if (now >= ack_batch_deadline(batch)) {
+      res = flush_ack_batch(state, batch);
+      if (res < 0)
+	return res;
+      flushed = 1;
     }
+  }
+
+  return flushed ? amqp_flush(state) : 0;
+}
 
-    body_offset += f.payload.body_fragment.len;
-    res = amqp_send_frame(state, &f);
+/* Holds back an ack, sending the batch once it is due */
+static int coalesce_ack(amqp_connection_state_t state,
+			amqp_ack_batch_t *batch,
+			uint64_t delivery_tag)
+{
+  int res;
+
+  /* Settling the run that follows base may bring the tag into the
+     window */
+  if (delivery_tag - batch->base > AMQP_ACK_WINDOW
+      && ack_bit(batch->acked, batch->base + 1)) {
+    res = flush_ack_batch(state, batch);
     if (res < 0)
       return res;
   }
 
+  if (delivery_tag <= batch->base
+      || (delivery_tag - batch->base <= AMQP_ACK_WINDOW
+	  && ack_bit(batch->acked, delivery_tag)))
+    /* Already settled; let the broker decide what to make of it */
+    return send_ack(state, batch->channel, delivery_tag, 0);
+
+  if (delivery_tag - batch->base > AMQP_ACK_WINDOW) {
+    /* Too far past an older delivery that is still unacknowledged to
+       be recorded. It is queued on its own, and goes out along with
+       the rest of the batch. */
+    res = send_ack(state, batch->channel, delivery_tag, 0);
+    if (res < 0)
+      return res;
+  } else {
+    set_ack_bit(batch->acked, delivery_tag);
+    if (batch->highest < delivery_tag)
+      batch->highest = delivery_tag;
+    if (batch->unsent == 0 || delivery_tag < batch->unsent)
+      batch->unsent = delivery_tag;
+  }
+
+  if (batch->pending++ == 0 && batch->max_delay > 0)
+    batch->since = amqp_get_monotonic_ms();
+
+  if (batch->pending >= batch->max_pending
+      || (batch->max_delay > 0
+	  && amqp_get_monotonic_ms() >= ack_batch_deadline(batch))) {
+    res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return res;
+
+    return amqp_flush(state);
+  }
+
   return 0;
 }
 
+static amqp_rpc_reply_t library_error_reply(int status)
+{
+  amqp_rpc_reply_t result;
+
+  memset(&result, 0, sizeof(result));
+  result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+  result.library_error = -status;
+  return result;
+}
+
 amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
 				    amqp_channel_t channel,
 				    int code)
@@ -170,6 +831,8 @@ amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
   char codestr[13];
   amqp_method_number_t replies[2] = { AMQP_CHANNEL_CLOSE_OK_METHOD, 0};
   amqp_channel_close_t req;
+  amqp_rpc_reply_t result;
+  amqp_ack_batch_t *batch;
 
   req.reply_code = code;
   req.reply_text.bytes = codestr;
@@ -177,8 +840,23 @@ amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
   req.class_id = 0;
   req.method_id = 0;
 
-  return amqp_simple_rpc(state, channel, AMQP_CHANNEL_CLOSE_METHOD,
-			 replies, &req);
+  /* Acknowledgements held back have to go out before the channel
+     closes, or the messages would be redelivered */
+  batch = find_ack_batch(state, channel);
+  if (batch != NULL) {
+    int res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return library_error_reply(res);
+  }
+
+  result = amqp_simple_rpc(state, channel, AMQP_CHANNEL_CLOSE_METHOD,
+			   replies, &req);
+
+  /* Confirms still on their way are of no more use */
+  drop_confirm(state, channel);
+  drop_ack_batch(state, channel);
+
+  return result;
 }
 
 amqp_rpc_reply_t amqp_connection_close(amqp_connection_state_t state,
@@ -187,6 +865,7 @@ amqp_rpc_reply_t amqp_connection_close(amqp_connection_state_t state,
   char codestr[13];
   amqp_method_number_t replies[2] = { AMQP_CONNECTION_CLOSE_OK_METHOD, 0};
   amqp_channel_close_t req;
+  int res;
 
   req.reply_code = code;
   req.reply_text.bytes = codestr;
@@ -194,6 +873,10 @@ amqp_rpc_reply_t amqp_connection_close(amqp_connection_state_t state,
   req.class_id = 0;
   req.method_id = 0;
 
+  res = amqp_flush_coalesced_acks(state);
+  if (res < 0)
+    return library_error_reply(res);
+
   return amqp_simple_rpc(state, 0, AMQP_CONNECTION_CLOSE_METHOD,
 			 replies, &req);
 }
@@ -203,7 +886,24 @@ int amqp_basic_ack(amqp_connection_state_t state,
 		   uint64_t delivery_tag,
 		   amqp_boolean_t multiple)
 {
+  amqp_ack_batch_t *batch = find_ack_batch(state, channel);
   amqp_basic_ack_t m;
+  int res;
+
+  if (batch != NULL) {
+    if (!multiple)
+      return coalesce_ack(state, batch, delivery_tag);
+
+    res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return res;
+
+    if (delivery_tag == 0)
+      settle_acks(batch, batch->highest);
+    else if (delivery_tag > batch->base)
+      settle_acks(batch, delivery_tag);
+  }
+
   m.delivery_tag = delivery_tag;
   m.multiple = multiple;
   return amqp_send_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
@@ -233,8 +933,137 @@ int amqp_basic_reject(amqp_connection_state_t state,
 		      uint64_t delivery_tag,
 		      amqp_boolean_t requeue)
 {
+  amqp_ack_batch_t *batch = find_ack_batch(state, channel);
   amqp_basic_reject_t req;
+
+  /* A rejected tag is settled too, so the run of acknowledged tags
+     can carry on past it */
+  if (batch != NULL && delivery_tag > batch->base
+      && delivery_tag - batch->base <= AMQP_ACK_WINDOW) {
+    set_ack_bit(batch->acked, delivery_tag);
+    set_ack_bit(batch->sent, delivery_tag);
+    if (batch->highest < delivery_tag)
+      batch->highest = delivery_tag;
+  }
+
   req.delivery_tag = delivery_tag;
   req.requeue = requeue;
   return amqp_send_method(state, channel, AMQP_BASIC_REJECT_METHOD, &req);
 }
+
+int amqp_coalesce_acks(amqp_connection_state_t state,
+		       amqp_channel_t channel,
+		       int max_pending,
+		       int max_delay)
+{
+  amqp_ack_batch_t *batch = find_ack_batch(state, channel);
+  int res;
+
+  if (batch != NULL) {
+    res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return res;
+
+    if (max_pending <= 0) {
+      drop_ack_batch(state, channel);
+      return amqp_flush(state);
+    }
+
+    batch->max_pending = max_pending;
+    batch->max_delay = max_delay;
+    return amqp_flush(state);
+  }
+
+  if (max_pending <= 0)
+    return 0;
+
+  batch = calloc(1, sizeof(amqp_ack_batch_t) + 2 * (AMQP_ACK_WINDOW / 8));
+  if (batch == NULL)
+    return -ERROR_NO_MEMORY;
+
+  batch->channel = channel;
+  batch->max_pending = max_pending;
+  batch->max_delay = max_delay;
+  batch->acked = (uint32_t *)(batch + 1);
+  batch->sent = batch->acked + AMQP_ACK_WINDOW / 32;
+
+  batch->next = state->ack_batches;
+  state->ack_batches = batch;
+  return 0;
+}
+
+int amqp_flush_acks(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_ack_batch_t *batch = find_ack_batch(state, channel);
+  int res;
+
+  if (batch != NULL) {
+    res = flush_ack_batch(state, batch);
+    if (res < 0)
+      return res;
+  }
+
+  return amqp_flush(state);
+}
+
+amqp_rpc_reply_t amqp_enable_confirms(amqp_connection_state_t state,
+				      amqp_channel_t channel,
+				      int max_in_flight,
+				      amqp_confirm_callback_t callback,
+				      void *data)
+{
+  amqp_method_number_t replies[2] = { AMQP_CONFIRM_SELECT_OK_METHOD, 0 };
+  amqp_confirm_select_t req;
+  amqp_confirm_t *confirm;
+  size_t words;
+
+  if (max_in_flight <= 0)
+    max_in_flight = DEFAULT_CONFIRM_WINDOW;
+
+  words = ((size_t)max_in_flight + 31) / 32;
+  confirm = calloc(1, sizeof(amqp_confirm_t) + words * sizeof(uint32_t));
+  if (confirm == NULL) {
+    memset(&state->most_recent_api_result, 0,
+	   sizeof(state->most_recent_api_result));
+    state->most_recent_api_result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    state->most_recent_api_result.library_error = ERROR_NO_MEMORY;
+    return state->most_recent_api_result;
+  }
+
+  confirm->channel = channel;
+  confirm->next_tag = 1;
+  confirm->oldest_tag = 1;
+  confirm->window = max_in_flight;
+  confirm->callback = callback;
+  confirm->callback_data = data;
+  confirm->pending = (uint32_t *)(confirm + 1);
+
+  req.nowait = 0;
+  state->most_recent_api_result = amqp_simple_rpc(state, channel,
+						  AMQP_CONFIRM_SELECT_METHOD,
+						  replies, &req);
+  if (state->most_recent_api_result.reply_type != AMQP_RESPONSE_NORMAL) {
+    free(confirm);
+    return state->most_recent_api_result;
+  }
+
+  drop_confirm(state, channel);
+  confirm->next = state->confirms;
+  state->confirms = confirm;
+
+  return state->most_recent_api_result;
+}
+
+uint64_t amqp_confirm_next_tag(amqp_connection_state_t state,
+			       amqp_channel_t channel)
+{
+  amqp_confirm_t *confirm = amqp_find_confirm(state, channel);
+  return confirm == NULL ? 0 : confirm->next_tag;
+}
+
+int amqp_confirms_outstanding(amqp_connection_state_t state,
+			      amqp_channel_t channel)
+{
+  amqp_confirm_t *confirm = amqp_find_confirm(state, channel);
+  return confirm == NULL ? 0 : confirm->outstanding;
+}
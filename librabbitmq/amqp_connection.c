@@ -36,14 +36,20 @@
 
 #include "amqp_private.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
 #define INITIAL_FRAME_POOL_PAGE_SIZE 65536
 #define INITIAL_DECODING_POOL_PAGE_SIZE 131072
 #define INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
+#define DEFAULT_BATCH_MAX_BYTES 65536
 
 #define ENFORCE_STATE(statevec, statenum)                               \
   {                                                                     \
@@ -72,9 +78,7 @@ amqp_connection_state_t amqp_new_connection(void) {
   else if (0 != res)
     goto out_nomem;
 
-  state->inbound_buffer.bytes = amqp_pool_alloc(&state->frame_pool, state->inbound_buffer.len);
-  if (state->inbound_buffer.bytes == NULL)
-    goto out_nomem;
+  state->inbound_buffer.bytes = state->header_buffer;
 
   state->state = CONNECTION_STATE_INITIAL;
   /* the server protocol version response is 8 bytes, which conveniently
@@ -86,6 +90,10 @@ amqp_connection_state_t amqp_new_connection(void) {
   state->sock_inbound_buffer.bytes = malloc(INITIAL_INBOUND_SOCK_BUFFER_SIZE);
   if (state->sock_inbound_buffer.bytes == NULL)
     goto out_nomem;
+  state->sock_inbound_primary = state->sock_inbound_buffer.bytes;
+
+  state->batch_max_bytes = DEFAULT_BATCH_MAX_BYTES;
+  state->rpc_timeout = -1;
 
   return state;
 
@@ -105,6 +113,28 @@ void amqp_set_sockfd(amqp_connection_state_t state,
 		     int sockfd)
 {
   state->sockfd = sockfd;
+
+  if (state->rpc_timeout >= 0)
+    amqp_socket_set_send_timeout(sockfd, state->rpc_timeout);
+}
+
+/* Moves any not-yet-processed input back to the start of the
+   connection's own inbound buffer, so that the frame_pool can be
+   recycled underneath it. */
+static void reset_sock_inbound_buffer(amqp_connection_state_t state)
+{
+  size_t remaining = state->sock_inbound_limit - state->sock_inbound_offset;
+
+  if (remaining > 0)
+    memmove(state->sock_inbound_primary,
+	    amqp_offset(state->sock_inbound_buffer.bytes,
+			state->sock_inbound_offset),
+	    remaining);
+
+  state->sock_inbound_buffer.bytes = state->sock_inbound_primary;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = remaining;
+  state->sock_inbound_pinned = 0;
 }
 
 int amqp_tune_connection(amqp_connection_state_t state,
@@ -119,7 +149,9 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->channel_max = channel_max;
   state->frame_max = frame_max;
   state->heartbeat = heartbeat;
+  state->last_send = state->last_recv = amqp_get_monotonic_ms();
 
+  reset_sock_inbound_buffer(state);
   empty_amqp_pool(&state->frame_pool);
   init_amqp_pool(&state->frame_pool, frame_max);
 
@@ -142,10 +174,28 @@ int amqp_get_channel_max(amqp_connection_state_t state) {
 int amqp_destroy_connection(amqp_connection_state_t state) {
   int s = state->sockfd;
 
+  free(state->pending_rpcs);
+  free(state->channel_queues);
+  while (state->confirms != NULL) {
+    amqp_confirm_t *confirm = state->confirms;
+    state->confirms = confirm->next;
+    free(confirm);
+  }
+  while (state->ack_batches != NULL) {
+    amqp_ack_batch_t *batch = state->ack_batches;
+    state->ack_batches = batch->next;
+    free(batch);
+  }
+
+#ifdef HAVE_IO_URING
+  /* before the buffers it may still be using go */
+  amqp_uring_destroy(state->uring);
+#endif
   empty_amqp_pool(&state->frame_pool);
   empty_amqp_pool(&state->decoding_pool);
   free(state->outbound_buffer.bytes);
-  free(state->sock_inbound_buffer.bytes);
+  free(state->sock_outbound_buffer.bytes);
+  free(state->sock_inbound_primary);
   free(state);
 
   if (s >= 0 && amqp_socket_close(s) < 0)
@@ -178,6 +228,133 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
+/* Decodes a complete frame of frame_size bytes starting at
+   raw_frame. Any bytes referenced by decoded_frame point into
+   raw_frame, which must therefore outlive the decoded frame. */
+/* Reads the payload length from a frame header, and works out the
+   size of the whole frame. The length comes straight off the wire, so
+   it is checked against the negotiated frame_max, and against the
+   least a frame of that type has to carry, before anything is
+   allocated or decoded on the strength of it. */
+static int frame_size_from_header(amqp_connection_state_t state,
+				  void *raw_frame,
+				  size_t *frame_size)
+{
+  size_t payload_size = amqp_d32(raw_frame, 3);
+  size_t min_payload_size;
+
+  switch (amqp_d8(raw_frame, 0)) {
+  case AMQP_FRAME_METHOD:
+    /* the class and method ids */
+    min_payload_size = 4;
+    break;
+
+  case AMQP_FRAME_HEADER:
+    /* the class id, weight and body size */
+    min_payload_size = 12;
+    break;
+
+  default:
+    min_payload_size = 0;
+    break;
+  }
+
+  if (payload_size < min_payload_size
+      || payload_size > (size_t)state->frame_max - (HEADER_SIZE + FOOTER_SIZE))
+    return -ERROR_BAD_AMQP_DATA;
+
+  *frame_size = payload_size + HEADER_SIZE + FOOTER_SIZE;
+  return 0;
+}
+
+static int decode_frame(amqp_connection_state_t state,
+			void *raw_frame,
+			size_t frame_size,
+			amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t encoded;
+  int res;
+
+  /* Check frame end marker (footer) */
+  if (amqp_d8(raw_frame, frame_size - 1) != AMQP_FRAME_END)
+    return -ERROR_BAD_AMQP_DATA;
+
+  decoded_frame->frame_type = amqp_d8(raw_frame, 0);
+  decoded_frame->channel = amqp_d16(raw_frame, 1);
+
+  switch (decoded_frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
+    encoded.len = frame_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_decode_method(decoded_frame->payload.method.id,
+			     &state->decoding_pool, encoded,
+			     &decoded_frame->payload.method.decoded);
+    if (res < 0)
+      return res;
+
+    break;
+
+  case AMQP_FRAME_HEADER:
+    decoded_frame->payload.properties.class_id
+                                        = amqp_d16(raw_frame, HEADER_SIZE);
+    /* unused 2-byte weight field goes here */
+    decoded_frame->payload.properties.body_size
+                                    = amqp_d64(raw_frame, HEADER_SIZE + 4);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
+    encoded.len = frame_size - HEADER_SIZE - 12 - FOOTER_SIZE;
+    decoded_frame->payload.properties.raw = encoded;
+    decoded_frame->payload.properties.decoded = NULL;
+
+    if (!state->lazy_properties) {
+      res = amqp_decode_frame_properties(state, decoded_frame);
+      if (res < 0)
+	return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_BODY:
+    decoded_frame->payload.body_fragment.len
+                                    = frame_size - HEADER_SIZE - FOOTER_SIZE;
+    decoded_frame->payload.body_fragment.bytes
+                                     = amqp_offset(raw_frame, HEADER_SIZE);
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    break;
+
+  default:
+    /* Ignore the frame */
+    decoded_frame->frame_type = 0;
+    break;
+  }
+
+  return 0;
+}
+
+void amqp_set_lazy_properties(amqp_connection_state_t state,
+			      amqp_boolean_t lazy)
+{
+  state->lazy_properties = lazy;
+}
+
+int amqp_decode_frame_properties(amqp_connection_state_t state,
+				 amqp_frame_t *frame)
+{
+  if (frame->frame_type != AMQP_FRAME_HEADER)
+    return -ERROR_UNEXPECTED_FRAME;
+
+  if (frame->payload.properties.decoded != NULL)
+    return 0;
+
+  return amqp_decode_properties(frame->payload.properties.class_id,
+				&state->decoding_pool,
+				frame->payload.properties.raw,
+				&frame->payload.properties.decoded);
+}
+
 int amqp_handle_input(amqp_connection_state_t state,
 		      amqp_bytes_t received_data,
 		      amqp_frame_t *decoded_frame)
@@ -193,14 +370,7 @@ int amqp_handle_input(amqp_connection_state_t state,
     return 0;
 
   if (state->state == CONNECTION_STATE_IDLE) {
-    state->inbound_buffer.bytes = amqp_pool_alloc(&state->frame_pool,
-						  state->inbound_buffer.len);
-    if (state->inbound_buffer.bytes == NULL)
-      /* state->inbound_buffer.len is always nonzero, because it
-	 corresponds to frame_max, which is not permitted to be less
-	 than AMQP_FRAME_MIN_SIZE (currently 4096 bytes). */
-      return -ERROR_NO_MEMORY;
-
+    state->inbound_buffer.bytes = state->header_buffer;
     state->state = CONNECTION_STATE_HEADER;
   }
 
@@ -236,10 +406,20 @@ int amqp_handle_input(amqp_connection_state_t state,
     /* it's not a protocol header; fall through to process it as a
        regular frame header */
 
-  case CONNECTION_STATE_HEADER:
+  case CONNECTION_STATE_HEADER: {
     /* frame length is 3 bytes in */
-    state->target_size
-           = amqp_d32(raw_frame, 3) + HEADER_SIZE + FOOTER_SIZE;
+    int res = frame_size_from_header(state, raw_frame, &state->target_size);
+    if (res < 0)
+      return res;
+
+    /* now that we know how big the frame is, move what we have so far
+       out of the header_buffer into a block of just the right size */
+    raw_frame = amqp_pool_alloc(&state->frame_pool, state->target_size);
+    if (raw_frame == NULL)
+      return -ERROR_NO_MEMORY;
+
+    memcpy(raw_frame, state->header_buffer, state->inbound_offset);
+    state->inbound_buffer.bytes = raw_frame;
     state->state = CONNECTION_STATE_BODY;
 
     bytes_consumed += consume_data(state, &received_data);
@@ -250,78 +430,73 @@ int amqp_handle_input(amqp_connection_state_t state,
       return bytes_consumed;
 
     /* fall through to process body */
+  }
 
   case CONNECTION_STATE_BODY: {
-    amqp_bytes_t encoded;
-    int res;
+    int res = decode_frame(state, raw_frame, state->target_size,
+			   decoded_frame);
+    if (res < 0)
+      return res;
 
-    /* Check frame end marker (footer) */
-    if (amqp_d8(raw_frame, state->target_size - 1) != AMQP_FRAME_END)
-      return -ERROR_BAD_AMQP_DATA;
+    return_to_idle(state);
+    return bytes_consumed;
+  }
 
-    decoded_frame->frame_type = amqp_d8(raw_frame, 0);
-    decoded_frame->channel = amqp_d16(raw_frame, 1);
+  default:
+    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
+    return bytes_consumed;
+  }
+}
 
-    switch (decoded_frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
-      encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+/*
+ * Processes the unconsumed part of sock_inbound_buffer. A frame that
+ * lies wholly within the buffer is decoded where it sits, with no
+ * copy into the frame_pool; only frames straddling a recv() boundary
+ * go through amqp_handle_input's reassembly path. Since decoded
+ * frames may then point into sock_inbound_buffer, it is pinned until
+ * the buffers are next released.
+ */
+int amqp_handle_sock_input(amqp_connection_state_t state,
+			   amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t buffer;
+  int res;
 
-      res = amqp_decode_method(decoded_frame->payload.method.id,
-			       &state->decoding_pool, encoded,
-			       &decoded_frame->payload.method.decoded);
-      if (res < 0)
-	return res;
+  buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
+  buffer.bytes = amqp_offset(state->sock_inbound_buffer.bytes,
+			     state->sock_inbound_offset);
 
-      break;
-
-    case AMQP_FRAME_HEADER:
-      decoded_frame->payload.properties.class_id
-                                          = amqp_d16(raw_frame, HEADER_SIZE);
-      /* unused 2-byte weight field goes here */
-      decoded_frame->payload.properties.body_size
-                                      = amqp_d64(raw_frame, HEADER_SIZE + 4);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
-      encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
-      decoded_frame->payload.properties.raw = encoded;
-
-      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
-                                   &state->decoding_pool, encoded,
-                                   &decoded_frame->payload.properties.decoded);
-      if (res < 0)
-        return res;
+  if (state->state == CONNECTION_STATE_IDLE && buffer.len >= HEADER_SIZE) {
+    size_t frame_size;
 
-      break;
+    res = frame_size_from_header(state, buffer.bytes, &frame_size);
+    if (res < 0)
+      return res;
 
-    case AMQP_FRAME_BODY:
-      decoded_frame->payload.body_fragment.len
-                            = state->target_size - HEADER_SIZE - FOOTER_SIZE;
-      decoded_frame->payload.body_fragment.bytes
-                                       = amqp_offset(raw_frame, HEADER_SIZE);
-      break;
+    if (frame_size <= buffer.len) {
+      res = decode_frame(state, buffer.bytes, frame_size, decoded_frame);
+      if (res < 0)
+	return res;
 
-    case AMQP_FRAME_HEARTBEAT:
-      break;
+      state->sock_inbound_offset += frame_size;
+      if (decoded_frame->frame_type != 0)
+	state->sock_inbound_pinned = 1;
 
-    default:
-      /* Ignore the frame */
-      decoded_frame->frame_type = 0;
-      break;
+      return 0;
     }
-
-    return_to_idle(state);
-    return bytes_consumed;
   }
 
-  default:
-    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
-    return bytes_consumed;
-  }
+  res = amqp_handle_input(state, buffer, decoded_frame);
+  if (res < 0)
+    return res;
+
+  state->sock_inbound_offset += res;
+  return 0;
 }
 
 amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state) {
-  return (state->state == CONNECTION_STATE_IDLE) && (state->first_queued_frame == NULL);
+  return (state->state == CONNECTION_STATE_IDLE) && (state->first_queued_frame == NULL)
+    && (state->buffer_holds == 0);
 }
 
 void amqp_release_buffers(amqp_connection_state_t state) {
@@ -330,6 +505,10 @@ void amqp_release_buffers(amqp_connection_state_t state) {
   if (state->first_queued_frame)
     amqp_abort("Programming error: attempt to amqp_release_buffers while waiting events enqueued");
 
+  if (state->buffer_holds)
+    amqp_abort("Programming error: attempt to amqp_release_buffers while a message is being assembled");
+
+  reset_sock_inbound_buffer(state);
   recycle_amqp_pool(&state->frame_pool);
   recycle_amqp_pool(&state->decoding_pool);
 }
@@ -340,84 +519,439 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state) {
   }
 }
 
-int amqp_send_frame(amqp_connection_state_t state,
-		    const amqp_frame_t *frame)
+int amqp_encode_frame(amqp_bytes_t encoded,
+		      amqp_frame_t const *frame,
+		      size_t *offset)
 {
-  void *out_frame = state->outbound_buffer.bytes;
+  size_t start = *offset;
+  void *out_frame;
+  amqp_bytes_t payload;
+  size_t payload_len;
   int res;
 
+  if (start > encoded.len
+      || encoded.len - start < HEADER_SIZE + FOOTER_SIZE)
+    return -ERROR_BAD_AMQP_DATA;
+
+  out_frame = amqp_offset(encoded.bytes, start);
+  payload.bytes = amqp_offset(out_frame, HEADER_SIZE);
+  payload.len = encoded.len - start - HEADER_SIZE - FOOTER_SIZE;
+
   amqp_e8(out_frame, 0, frame->frame_type);
   amqp_e16(out_frame, 1, frame->channel);
 
-  if (frame->frame_type == AMQP_FRAME_BODY) {
-    /* For a body frame, rather than copying data around, we use
-       writev to compose the frame */
-    struct iovec iov[3];
-    uint8_t frame_end_byte = AMQP_FRAME_END;
-    const amqp_bytes_t *body = &frame->payload.body_fragment;
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD: {
+    amqp_bytes_t method_encoded;
 
-    amqp_e32(out_frame, 3, body->len);
+    if (payload.len < 4)
+      return -ERROR_BAD_AMQP_DATA;
 
-    iov[0].iov_base = out_frame;
-    iov[0].iov_len = HEADER_SIZE;
-    iov[1].iov_base = body->bytes;
-    iov[1].iov_len = body->len;
-    iov[2].iov_base = &frame_end_byte;
-    iov[2].iov_len = FOOTER_SIZE;
+    amqp_e32(payload.bytes, 0, frame->payload.method.id);
+
+    method_encoded.bytes = amqp_offset(payload.bytes, 4);
+    method_encoded.len = payload.len - 4;
+
+    res = amqp_encode_method(frame->payload.method.id,
+                             frame->payload.method.decoded, method_encoded);
+    if (res < 0)
+      return res;
 
-    res = amqp_socket_writev(state->sockfd, iov, 3);
+    payload_len = res + 4;
+    break;
   }
-  else {
-    size_t out_frame_len;
-    amqp_bytes_t encoded;
 
-    switch (frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+  case AMQP_FRAME_HEADER: {
+    amqp_bytes_t properties_encoded;
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+    if (payload.len < 12)
+      return -ERROR_BAD_AMQP_DATA;
 
-      res = amqp_encode_method(frame->payload.method.id,
-                               frame->payload.method.decoded, encoded);
-      if (res < 0)
-        return res;
+    amqp_e16(payload.bytes, 0, frame->payload.properties.class_id);
+    amqp_e16(payload.bytes, 2, 0); /* "weight" */
+    amqp_e64(payload.bytes, 4, frame->payload.properties.body_size);
 
-      out_frame_len = res + 4;
-      break;
+    properties_encoded.bytes = amqp_offset(payload.bytes, 12);
+    properties_encoded.len = payload.len - 12;
 
-    case AMQP_FRAME_HEADER:
-      amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+    if (frame->payload.properties.decoded == NULL) {
+      /* Never decoded, so pass the encoded form on as it is */
+      amqp_bytes_t raw = frame->payload.properties.raw;
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+      if (raw.len > properties_encoded.len)
+	return -ERROR_BAD_AMQP_DATA;
 
+      memcpy(properties_encoded.bytes, raw.bytes, raw.len);
+      res = (int)raw.len;
+    } else {
       res = amqp_encode_properties(frame->payload.properties.class_id,
-                                   frame->payload.properties.decoded, encoded);
+				   frame->payload.properties.decoded,
+				   properties_encoded);
       if (res < 0)
-        return res;
+	return res;
+    }
+
+    payload_len = res + 12;
+    break;
+  }
+
+  case AMQP_FRAME_BODY:
+    payload_len = frame->payload.body_fragment.len;
+    if (payload_len > payload.len)
+      return -ERROR_BAD_AMQP_DATA;
+
+    memcpy(payload.bytes, frame->payload.body_fragment.bytes, payload_len);
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    payload_len = 0;
+    break;
+
+  default:
+    abort();
+  }
+
+  amqp_e32(out_frame, 3, payload_len);
+  amqp_e8(out_frame, HEADER_SIZE + payload_len, AMQP_FRAME_END);
+  *offset = start + HEADER_SIZE + payload_len + FOOTER_SIZE;
+  return 0;
+}
+
+/* Writes as much of the iovecs as the socket will take. That is all
+   of them for a blocking socket, unless the RPC timeout passes with
+   the socket taking nothing; a non-blocking socket may stop short.
+   *written says how far it got either way. */
+static int write_iov(amqp_connection_state_t state,
+		     struct iovec *iov,
+		     int iovcnt,
+		     size_t *written)
+{
+  *written = 0;
+
+  while (iovcnt > 0) {
+    int res;
+
+#ifdef HAVE_IO_URING
+    /* The ring's sends aren't bounded by the socket's send timeout */
+    if (state->uring != NULL && !state->nonblocking && state->rpc_timeout < 0)
+      res = amqp_uring_writev(state, iov, iovcnt);
+    else
+#endif
+      res = amqp_socket_writev(state->sockfd, iov, iovcnt);
 
-      out_frame_len = res + 12;
-      break;
+    if (res < 0) {
+      if (state->nonblocking && amqp_socket_would_block())
+	return 0;
 
-    case AMQP_FRAME_HEARTBEAT:
-      out_frame_len = 0;
-      break;
+      if (!state->nonblocking && state->rpc_timeout >= 0
+	  && amqp_socket_send_timed_out())
+	return -ERROR_TIMEOUT;
 
-    default:
-      abort();
+      return -amqp_socket_error();
     }
 
-    amqp_e32(out_frame, 3, out_frame_len);
-    amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
-    res = send(state->sockfd, out_frame,
-               out_frame_len + HEADER_SIZE + FOOTER_SIZE, MSG_NOSIGNAL);
+    *written += res;
+    if (state->heartbeat > 0 && res > 0)
+      state->last_send = amqp_get_monotonic_ms();
+
+    /* skip past whatever was written, in case it wasn't everything */
+    while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = amqp_offset(iov->iov_base, res);
+      iov->iov_len -= res;
+    }
+  }
+
+  return 0;
+}
+
+/* io_uring may still be sending the pending output after a read has
+   returned; that has to finish before the output is changed. */
+static int finish_uring_send(amqp_connection_state_t state)
+{
+#ifdef HAVE_IO_URING
+  if (state->uring != NULL && amqp_uring_finish_send(state) < 0)
+    return -amqp_socket_error();
+#else
+  (void) state;
+#endif
+  return 0;
+}
+
+/* Appends the iovecs, less the first skip bytes, to the pending
+   outbound buffer. */
+static int queue_iov(amqp_connection_state_t state,
+		     struct iovec *iov,
+		     int iovcnt,
+		     size_t skip)
+{
+  size_t pending = state->sock_outbound_limit - state->sock_outbound_offset;
+  size_t needed = pending;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    needed += iov[i].iov_len;
+  needed -= skip;
+
+  if (state->sock_outbound_offset != 0) {
+    memmove(state->sock_outbound_buffer.bytes,
+	    amqp_offset(state->sock_outbound_buffer.bytes,
+			state->sock_outbound_offset),
+	    pending);
+    state->sock_outbound_offset = 0;
+    state->sock_outbound_limit = pending;
   }
 
+  if (needed > state->sock_outbound_buffer.len) {
+    size_t newlen = state->sock_outbound_buffer.len * 2;
+    void *newbuf;
+
+    if (newlen < needed)
+      newlen = needed;
+
+    newbuf = realloc(state->sock_outbound_buffer.bytes, newlen);
+    if (newbuf == NULL)
+      return -ERROR_NO_MEMORY;
+
+    state->sock_outbound_buffer.bytes = newbuf;
+    state->sock_outbound_buffer.len = newlen;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    size_t len = iov[i].iov_len;
+
+    if (skip >= len) {
+      skip -= len;
+      continue;
+    }
+
+    memcpy(amqp_offset(state->sock_outbound_buffer.bytes,
+		       state->sock_outbound_limit),
+	   amqp_offset(iov[i].iov_base, skip), len - skip);
+    state->sock_outbound_limit += len - skip;
+    skip = 0;
+  }
+
+  return 0;
+}
+
+int amqp_send_iov(amqp_connection_state_t state,
+		  struct iovec *iov,
+		  int iovcnt,
+		  int frames,
+		  amqp_boolean_t buffered)
+{
+  int res;
+
+  res = finish_uring_send(state);
+  if (res < 0)
+    return res;
+
+  if (!buffered && state->sock_outbound_limit == state->sock_outbound_offset) {
+    struct iovec copy[AMQP_SEND_IOV_MAX];
+    size_t written;
+    int i;
+
+    if (!state->nonblocking)
+      return write_iov(state, iov, iovcnt, &written);
+
+    /* write_iov advances the iovecs it's given; keep the originals so
+       that whatever the socket didn't take can be queued. */
+    if (iovcnt > AMQP_SEND_IOV_MAX)
+      amqp_abort("Too many iovecs in amqp_send_iov: %d", iovcnt);
+
+    for (i = 0; i < iovcnt; i++)
+      copy[i] = iov[i];
+
+    res = write_iov(state, copy, iovcnt, &written);
+    if (res < 0)
+      return res;
+
+    res = queue_iov(state, iov, iovcnt, written);
+    if (res < 0)
+      return res;
+
+    if (state->sock_outbound_limit != 0)
+      state->sock_outbound_frames += frames;
+
+    return 0;
+  }
+
+  res = queue_iov(state, iov, iovcnt, 0);
   if (res < 0)
+    return res;
+
+  state->sock_outbound_frames += frames;
+
+  /* An unbuffered send that had to queue behind a pending batch to
+     keep the frames in order still goes out now. */
+  if (!buffered
+      || (state->batch_max_bytes != 0
+       && state->sock_outbound_limit - state->sock_outbound_offset
+          >= state->batch_max_bytes)
+      || (state->batch_max_frames != 0
+	  && state->sock_outbound_frames >= state->batch_max_frames))
+    return amqp_flush(state);
+
+  return 0;
+}
+
+int amqp_flush(amqp_connection_state_t state)
+{
+  struct iovec iov;
+  size_t written;
+  int res;
+
+  res = finish_uring_send(state);
+  if (res < 0)
+    return res;
+
+  if (state->sock_outbound_limit == state->sock_outbound_offset)
+    return 0;
+
+  iov.iov_base = amqp_offset(state->sock_outbound_buffer.bytes,
+			     state->sock_outbound_offset);
+  iov.iov_len = state->sock_outbound_limit - state->sock_outbound_offset;
+
+  res = write_iov(state, &iov, 1, &written);
+  if (res < 0)
+    return res;
+
+  amqp_outbound_written(state, written);
+  return 0;
+}
+
+void amqp_outbound_written(amqp_connection_state_t state, size_t written)
+{
+  if (state->heartbeat > 0 && written > 0)
+    state->last_send = amqp_get_monotonic_ms();
+
+  state->sock_outbound_offset += written;
+  if (state->sock_outbound_offset == state->sock_outbound_limit) {
+    state->sock_outbound_offset = 0;
+    state->sock_outbound_limit = 0;
+    state->sock_outbound_frames = 0;
+  }
+}
+
+int amqp_set_nonblocking(amqp_connection_state_t state,
+			 amqp_boolean_t nonblocking)
+{
+  int res = finish_uring_send(state);
+  if (res < 0)
+    return res;
+
+  if (amqp_socket_set_nonblocking(state->sockfd, nonblocking) < 0)
     return -amqp_socket_error();
-  else
+
+  state->nonblocking = nonblocking;
+  return 0;
+}
+
+void amqp_set_rpc_timeout(amqp_connection_state_t state,
+			  struct timeval *timeout)
+{
+  if (timeout == NULL) {
+    state->rpc_timeout = -1;
+  } else {
+    /* Rounded up to whole milliseconds, so that a timeout of less
+       than one doesn't expire at once (or turn the send timeout
+       off), and capped at what fits in an int */
+    uint64_t ms = (uint64_t)timeout->tv_sec * 1000
+      + (timeout->tv_usec + 999) / 1000;
+
+    state->rpc_timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+  }
+
+  /* Blocking sends are bounded by the same limit */
+  if (state->sockfd >= 0)
+    amqp_socket_set_send_timeout(state->sockfd, state->rpc_timeout);
+}
+
+int amqp_use_io_uring(amqp_connection_state_t state)
+{
+#ifdef HAVE_IO_URING
+  if (state->uring != NULL)
     return 0;
+
+  return amqp_uring_new(state);
+#else
+  (void)state;
+  return -ERROR_NOT_SUPPORTED;
+#endif
+}
+
+amqp_boolean_t amqp_wants_read(amqp_connection_state_t state)
+{
+  return (state->first_queued_frame == NULL
+	  && state->sock_inbound_offset == state->sock_inbound_limit);
+}
+
+amqp_boolean_t amqp_wants_write(amqp_connection_state_t state)
+{
+  return (state->sock_outbound_offset < state->sock_outbound_limit);
+}
+
+void amqp_set_batch_limits(amqp_connection_state_t state,
+			   size_t max_bytes,
+			   int max_frames)
+{
+  state->batch_max_bytes = max_bytes;
+  state->batch_max_frames = max_frames;
+}
+
+static int send_frame(amqp_connection_state_t state,
+		      const amqp_frame_t *frame,
+		      amqp_boolean_t buffered)
+{
+  struct iovec iov[3];
+
+  if (frame->frame_type == AMQP_FRAME_BODY) {
+    /* For a body frame, rather than copying data around, we use
+       writev to compose the frame */
+    void *out_frame = state->outbound_buffer.bytes;
+    uint8_t frame_end_byte = AMQP_FRAME_END;
+    const amqp_bytes_t *body = &frame->payload.body_fragment;
+
+    amqp_e8(out_frame, 0, frame->frame_type);
+    amqp_e16(out_frame, 1, frame->channel);
+    amqp_e32(out_frame, 3, body->len);
+
+    iov[0].iov_base = out_frame;
+    iov[0].iov_len = HEADER_SIZE;
+    iov[1].iov_base = body->bytes;
+    iov[1].iov_len = body->len;
+    iov[2].iov_base = &frame_end_byte;
+    iov[2].iov_len = FOOTER_SIZE;
+
+    return amqp_send_iov(state, iov, 3, 1, buffered);
+  }
+  else {
+    size_t out_frame_len = 0;
+    int res = amqp_encode_frame(state->outbound_buffer, frame, &out_frame_len);
+    if (res < 0)
+      return res;
+
+    iov[0].iov_base = state->outbound_buffer.bytes;
+    iov[0].iov_len = out_frame_len;
+
+    return amqp_send_iov(state, iov, 1, 1, buffered);
+  }
+}
+
+int amqp_send_frame(amqp_connection_state_t state,
+		    const amqp_frame_t *frame)
+{
+  return send_frame(state, frame, 0);
+}
+
+int amqp_send_frame_batch(amqp_connection_state_t state,
+			  const amqp_frame_t *frame)
+{
+  return send_frame(state, frame, 1);
 }
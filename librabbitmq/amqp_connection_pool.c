@@ -0,0 +1,458 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_getcpu */
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A connection pool keeps logged-in connections, each with a channel
+ * already open, and lends them out to threads one at a time.
+ *
+ * Idle connections are kept on several free lists, one per CPU, each
+ * with its own lock. A thread takes from and returns to the list of
+ * the CPU it is running on, and only looks at the other lists when
+ * its own is empty, so threads on different CPUs rarely contend. A
+ * count of idle connections and one of waiting threads let releases
+ * skip the pool-wide lock unless someone is actually waiting.
+ */
+
+#if defined(HAVE_PTHREAD) && defined(__ATOMIC_SEQ_CST)
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+
+typedef struct amqp_pooled_connection_t_ {
+  struct amqp_pooled_connection_t_ *next;
+  amqp_connection_state_t state;
+  amqp_channel_t channel;
+} amqp_pooled_connection_t;
+
+/* Padded out so that neighbouring free lists don't share a cache line */
+typedef union amqp_pool_stripe_t_ {
+  struct {
+    pthread_mutex_t lock;
+    amqp_pooled_connection_t *idle;
+  } s;
+  char pad[128];
+} amqp_pool_stripe_t;
+
+struct amqp_connection_pool_t_ {
+  char *host;
+  int port;
+  char *vhost;
+  char *user;
+  char *password;
+
+  int channel_max;
+  int frame_max;
+  int heartbeat;
+  amqp_channel_t channel;
+
+  int max_connections;
+  int opened;
+  int idle;
+  int waiting;
+
+  int num_stripes;
+  amqp_pool_stripe_t *stripes;
+
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+};
+
+static int current_stripe(amqp_connection_pool_t pool)
+{
+  int cpu;
+
+#ifdef HAVE_SCHED_GETCPU
+  cpu = sched_getcpu();
+  if (cpu < 0)
+    cpu = 0;
+#else
+  /* No way to ask which CPU we're on, but threads' stacks are far
+     enough apart to tell them from one another */
+  char here;
+  cpu = (int) (((size_t) &here) >> 16);
+#endif
+
+  return (int) ((unsigned int) cpu % (unsigned int) pool->num_stripes);
+}
+
+static char *copy_string(char const *s)
+{
+  char *copy = malloc(strlen(s) + 1);
+
+  if (copy != NULL)
+    strcpy(copy, s);
+
+  return copy;
+}
+
+amqp_connection_pool_t amqp_new_connection_pool(struct amqp_connection_info const *info,
+						int max_connections,
+						int channel_max,
+						int frame_max,
+						int heartbeat,
+						amqp_channel_t channel)
+{
+  amqp_connection_pool_t pool;
+  long cpus;
+  int i;
+
+  if (max_connections <= 0 || channel == 0)
+    return NULL;
+
+  pool = calloc(1, sizeof(*pool));
+  if (pool == NULL)
+    return NULL;
+
+  pool->port = info->port;
+  pool->channel_max = channel_max;
+  pool->frame_max = frame_max;
+  pool->heartbeat = heartbeat;
+  pool->channel = channel;
+  pool->max_connections = max_connections;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pool->num_stripes = (cpus < 1) ? 1 : (int) cpus;
+  if (pool->num_stripes > max_connections)
+    pool->num_stripes = max_connections;
+
+  pool->host = copy_string(info->host);
+  pool->vhost = copy_string(info->vhost);
+  pool->user = copy_string(info->user);
+  pool->password = copy_string(info->password);
+  pool->stripes = calloc(pool->num_stripes, sizeof(amqp_pool_stripe_t));
+
+  if (pool->host == NULL || pool->vhost == NULL || pool->user == NULL
+      || pool->password == NULL || pool->stripes == NULL) {
+    free(pool->host);
+    free(pool->vhost);
+    free(pool->user);
+    free(pool->password);
+    free(pool->stripes);
+    free(pool);
+    return NULL;
+  }
+
+  for (i = 0; i < pool->num_stripes; i++)
+    pthread_mutex_init(&pool->stripes[i].s.lock, NULL);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->released, NULL);
+  return pool;
+}
+
+static void close_connection(amqp_pooled_connection_t *c)
+{
+  if (c->state != NULL) {
+    if (c->channel != 0)
+      amqp_channel_close(c->state, c->channel, AMQP_REPLY_SUCCESS);
+    amqp_connection_close(c->state, AMQP_REPLY_SUCCESS);
+    amqp_destroy_connection(c->state);
+  }
+
+  free(c);
+}
+
+void amqp_destroy_connection_pool(amqp_connection_pool_t pool)
+{
+  int i;
+
+  for (i = 0; i < pool->num_stripes; i++) {
+    amqp_pooled_connection_t *c = pool->stripes[i].s.idle;
+
+    while (c != NULL) {
+      amqp_pooled_connection_t *next = c->next;
+      close_connection(c);
+      c = next;
+    }
+
+    pthread_mutex_destroy(&pool->stripes[i].s.lock);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->released);
+
+  free(pool->host);
+  free(pool->vhost);
+  free(pool->user);
+  free(pool->password);
+  free(pool->stripes);
+  free(pool);
+}
+
+static amqp_pooled_connection_t *take_idle(amqp_connection_pool_t pool)
+{
+  int start = current_stripe(pool);
+  int i;
+
+  if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == 0)
+    return NULL;
+
+  for (i = 0; i < pool->num_stripes; i++) {
+    amqp_pool_stripe_t *stripe =
+      &pool->stripes[(start + i) % pool->num_stripes];
+    amqp_pooled_connection_t *c;
+
+    pthread_mutex_lock(&stripe->s.lock);
+    c = stripe->s.idle;
+    if (c != NULL)
+      stripe->s.idle = c->next;
+    pthread_mutex_unlock(&stripe->s.lock);
+
+    if (c != NULL) {
+      __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+/* Claims one of the pool's unopened connections, if any are left */
+static amqp_boolean_t reserve_new(amqp_connection_pool_t pool)
+{
+  int opened = __atomic_load_n(&pool->opened, __ATOMIC_SEQ_CST);
+
+  while (opened < pool->max_connections)
+    if (__atomic_compare_exchange_n(&pool->opened, &opened, opened + 1, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return 1;
+
+  return 0;
+}
+
+static void wake_waiters(amqp_connection_pool_t pool)
+{
+  if (__atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void discard(amqp_connection_pool_t pool, amqp_pooled_connection_t *c)
+{
+  if (c->state != NULL)
+    amqp_destroy_connection(c->state);
+  free(c);
+
+  __atomic_sub_fetch(&pool->opened, 1, __ATOMIC_SEQ_CST);
+  wake_waiters(pool);
+}
+
+static int reply_error(amqp_rpc_reply_t reply)
+{
+  switch (reply.reply_type) {
+  case AMQP_RESPONSE_NORMAL:
+    return 0;
+  case AMQP_RESPONSE_LIBRARY_EXCEPTION:
+    return -reply.library_error;
+  default:
+    return -ERROR_CONNECTION_CLOSED;
+  }
+}
+
+/* Logs in and opens a channel on a connection that needs it */
+static int prepare(amqp_connection_pool_t pool, amqp_pooled_connection_t *c)
+{
+  int sockfd, res;
+
+  if (c->state == NULL) {
+    c->state = amqp_new_connection();
+    if (c->state == NULL)
+      return -ERROR_NO_MEMORY;
+
+    sockfd = amqp_open_socket(pool->host, pool->port);
+    if (sockfd < 0)
+      return sockfd;
+
+    amqp_set_sockfd(c->state, sockfd);
+
+    res = reply_error(amqp_login(c->state, pool->vhost, pool->channel_max,
+				 pool->frame_max, pool->heartbeat,
+				 AMQP_SASL_METHOD_PLAIN,
+				 pool->user, pool->password));
+    if (res < 0)
+      return res;
+  }
+
+  if (c->channel == 0) {
+    amqp_channel_open(c->state, pool->channel);
+    res = reply_error(amqp_get_rpc_reply(c->state));
+    if (res < 0)
+      return res;
+
+    c->channel = pool->channel;
+  }
+
+  return 0;
+}
+
+int amqp_connection_pool_lease(amqp_connection_pool_t pool,
+			       amqp_lease_t *lease)
+{
+  amqp_pooled_connection_t *c;
+  int res;
+
+  for (;;) {
+    c = take_idle(pool);
+    if (c != NULL) {
+      /* Nothing reads an idle connection, so the broker's heartbeats
+	 go unseen and ours unsent; past two intervals of that, the
+	 broker will have dropped it */
+      if (pool->heartbeat > 0 && amqp_heartbeat_tick(c->state) < 0) {
+	discard(pool, c);
+	continue;
+      }
+      break;
+    }
+
+    if (reserve_new(pool)) {
+      c = calloc(1, sizeof(*c));
+      if (c == NULL) {
+	__atomic_sub_fetch(&pool->opened, 1, __ATOMIC_SEQ_CST);
+	wake_waiters(pool);
+	return -ERROR_NO_MEMORY;
+      }
+      break;
+    }
+
+    /* Everything is lent out. Having announced that we're waiting, look
+       again, so that a release that happened in between isn't missed. */
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == 0
+	&& __atomic_load_n(&pool->opened, __ATOMIC_SEQ_CST)
+	   >= pool->max_connections)
+      pthread_cond_wait(&pool->released, &pool->lock);
+    __atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  res = prepare(pool, c);
+  if (res < 0) {
+    discard(pool, c);
+    return res;
+  }
+
+  lease->state = c->state;
+  lease->channel = c->channel;
+  lease->slot = c;
+  return 0;
+}
+
+void amqp_connection_pool_release(amqp_connection_pool_t pool,
+				  amqp_lease_t *lease,
+				  amqp_boolean_t reusable)
+{
+  amqp_pooled_connection_t *c = lease->slot;
+  amqp_pool_stripe_t *stripe;
+
+  lease->state = NULL;
+  lease->channel = 0;
+  lease->slot = NULL;
+
+  if (!reusable) {
+    discard(pool, c);
+    return;
+  }
+
+  amqp_maybe_release_buffers(c->state);
+
+  stripe = &pool->stripes[current_stripe(pool)];
+  pthread_mutex_lock(&stripe->s.lock);
+  c->next = stripe->s.idle;
+  stripe->s.idle = c;
+  pthread_mutex_unlock(&stripe->s.lock);
+
+  __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+  wake_waiters(pool);
+}
+
+#else
+
+amqp_connection_pool_t amqp_new_connection_pool(struct amqp_connection_info const *info,
+						int max_connections,
+						int channel_max,
+						int frame_max,
+						int heartbeat,
+						amqp_channel_t channel)
+{
+  (void) info;
+  (void) max_connections;
+  (void) channel_max;
+  (void) frame_max;
+  (void) heartbeat;
+  (void) channel;
+  return NULL;
+}
+
+void amqp_destroy_connection_pool(amqp_connection_pool_t pool)
+{
+  (void) pool;
+}
+
+int amqp_connection_pool_lease(amqp_connection_pool_t pool,
+			       amqp_lease_t *lease)
+{
+  (void) pool;
+  (void) lease;
+  return -ERROR_NOT_SUPPORTED;
+}
+
+void amqp_connection_pool_release(amqp_connection_pool_t pool,
+				  amqp_lease_t *lease,
+				  amqp_boolean_t reusable)
+{
+  (void) pool;
+  (void) lease;
+  (void) reusable;
+}
+
+#endif
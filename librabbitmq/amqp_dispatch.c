@@ -0,0 +1,408 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Demultiplexes the frames of one connection by channel. Each channel
+ * has its own message being assembled, so deliveries interleaved
+ * across channels are put back together independently, and complete
+ * messages go to the handler for their consumer tag or channel.
+ */
+
+typedef struct amqp_consumer_handler_t_ {
+  struct amqp_consumer_handler_t_ *next;
+  amqp_bytes_t consumer_tag;
+  amqp_message_callback_t on_message;
+  void *data;
+} amqp_consumer_handler_t;
+
+enum {
+  STAGE_IDLE = 0,
+  STAGE_HEADER,
+  STAGE_BODY
+};
+
+typedef struct amqp_dispatch_channel_t_ {
+  amqp_message_callback_t on_message;
+  amqp_method_callback_t on_method;
+  void *data;
+  amqp_consumer_handler_t *consumers;
+
+  /* The message being assembled */
+  int stage;
+  /* set for the content of a basic.return, which is skipped */
+  amqp_boolean_t discard;
+  amqp_envelope_t envelope;
+  size_t body_received;
+} amqp_dispatch_channel_t;
+
+struct amqp_dispatcher_t_ {
+  amqp_connection_state_t state;
+  /* indexed by channel number; grown as handlers are added */
+  amqp_dispatch_channel_t *channels;
+  int num_channels;
+  /* channels with a message partly assembled */
+  int assembling;
+  /* set whenever a callback runs */
+  amqp_boolean_t dispatched;
+};
+
+amqp_dispatcher_t amqp_new_dispatcher(amqp_connection_state_t state)
+{
+  amqp_dispatcher_t d = calloc(1, sizeof(struct amqp_dispatcher_t_));
+  if (d == NULL)
+    return NULL;
+
+  d->state = state;
+  return d;
+}
+
+void amqp_destroy_dispatcher(amqp_dispatcher_t d)
+{
+  int i;
+
+  for (i = 0; i < d->num_channels; i++) {
+    amqp_consumer_handler_t *c = d->channels[i].consumers;
+    while (c != NULL) {
+      amqp_consumer_handler_t *next = c->next;
+      amqp_bytes_free(c->consumer_tag);
+      free(c);
+      c = next;
+    }
+  }
+
+  if (d->assembling > 0)
+    d->state->buffer_holds--;
+
+  free(d->channels);
+  free(d);
+}
+
+static amqp_dispatch_channel_t *get_channel(amqp_dispatcher_t d,
+					    amqp_channel_t channel,
+					    amqp_boolean_t create)
+{
+  if (channel >= d->num_channels) {
+    amqp_dispatch_channel_t *channels;
+    int num = d->num_channels ? d->num_channels : 16;
+
+    if (!create)
+      return NULL;
+
+    while (num <= channel)
+      num *= 2;
+
+    channels = realloc(d->channels, num * sizeof(amqp_dispatch_channel_t));
+    if (channels == NULL)
+      return NULL;
+
+    memset(channels + d->num_channels, 0,
+	   (num - d->num_channels) * sizeof(amqp_dispatch_channel_t));
+    d->channels = channels;
+    d->num_channels = num;
+  }
+
+  return &d->channels[channel];
+}
+
+int amqp_dispatcher_on_channel(amqp_dispatcher_t d,
+			       amqp_channel_t channel,
+			       amqp_message_callback_t on_message,
+			       amqp_method_callback_t on_method,
+			       void *data)
+{
+  amqp_dispatch_channel_t *ch = get_channel(d, channel, 1);
+  if (ch == NULL)
+    return -ERROR_NO_MEMORY;
+
+  ch->on_message = on_message;
+  ch->on_method = on_method;
+  ch->data = data;
+  return 0;
+}
+
+int amqp_dispatcher_on_consumer(amqp_dispatcher_t d,
+				amqp_channel_t channel,
+				amqp_bytes_t consumer_tag,
+				amqp_message_callback_t on_message,
+				void *data)
+{
+  amqp_dispatch_channel_t *ch = get_channel(d, channel, 1);
+  amqp_consumer_handler_t **link;
+  amqp_consumer_handler_t *c;
+
+  if (ch == NULL)
+    return -ERROR_NO_MEMORY;
+
+  for (link = &ch->consumers; *link != NULL; link = &(*link)->next) {
+    c = *link;
+    if (c->consumer_tag.len == consumer_tag.len
+	&& !memcmp(c->consumer_tag.bytes, consumer_tag.bytes,
+		   consumer_tag.len)) {
+      if (on_message == NULL) {
+	*link = c->next;
+	amqp_bytes_free(c->consumer_tag);
+	free(c);
+      } else {
+	c->on_message = on_message;
+	c->data = data;
+      }
+      return 0;
+    }
+  }
+
+  if (on_message == NULL)
+    return 0;
+
+  c = malloc(sizeof(amqp_consumer_handler_t));
+  if (c == NULL)
+    return -ERROR_NO_MEMORY;
+
+  c->consumer_tag = amqp_bytes_malloc_dup(consumer_tag);
+  if (c->consumer_tag.bytes == NULL && consumer_tag.len > 0) {
+    free(c);
+    return -ERROR_NO_MEMORY;
+  }
+
+  c->on_message = on_message;
+  c->data = data;
+  c->next = ch->consumers;
+  ch->consumers = c;
+  return 0;
+}
+
+static void finish_message(amqp_dispatcher_t d, amqp_dispatch_channel_t *ch)
+{
+  amqp_envelope_t envelope = ch->envelope;
+  amqp_message_callback_t on_message = ch->on_message;
+  void *data = ch->data;
+  amqp_boolean_t discard = ch->discard;
+  amqp_consumer_handler_t *c;
+
+  ch->stage = STAGE_IDLE;
+  if (--d->assembling == 0)
+    d->state->buffer_holds--;
+
+  if (discard)
+    return;
+
+  for (c = ch->consumers; c != NULL; c = c->next) {
+    if (c->consumer_tag.len == envelope.consumer_tag.len
+	&& !memcmp(c->consumer_tag.bytes, envelope.consumer_tag.bytes,
+		   envelope.consumer_tag.len)) {
+      on_message = c->on_message;
+      data = c->data;
+      break;
+    }
+  }
+
+  /* Nothing about ch may be used past this point: the callback is
+     free to change the handlers, which may move the channel table */
+  if (on_message != NULL) {
+    d->dispatched = 1;
+    on_message(d->state, &envelope, data);
+  }
+}
+
+static int dispatch_method(amqp_dispatcher_t d, amqp_frame_t const *frame)
+{
+  amqp_dispatch_channel_t *ch = get_channel(d, frame->channel, 1);
+  amqp_method_t const *method = &frame->payload.method;
+
+  if (ch == NULL)
+    return -ERROR_NO_MEMORY;
+
+  if (method->id == AMQP_BASIC_DELIVER_METHOD
+      || method->id == AMQP_BASIC_RETURN_METHOD) {
+    if (ch->stage != STAGE_IDLE)
+      return -ERROR_BAD_AMQP_DATA;
+
+    memset(&ch->envelope, 0, sizeof(ch->envelope));
+    ch->envelope.channel = frame->channel;
+    ch->stage = STAGE_HEADER;
+    /* The envelope refers to the decoded frames, so the connection's
+       buffers have to stay put until the message is complete */
+    if (d->assembling++ == 0)
+      d->state->buffer_holds++;
+
+    if (method->id == AMQP_BASIC_DELIVER_METHOD) {
+      amqp_basic_deliver_t *deliver = method->decoded;
+      ch->discard = 0;
+      ch->envelope.consumer_tag = deliver->consumer_tag;
+      ch->envelope.delivery_tag = deliver->delivery_tag;
+      ch->envelope.redelivered = deliver->redelivered;
+      ch->envelope.exchange = deliver->exchange;
+      ch->envelope.routing_key = deliver->routing_key;
+      return 0;
+    }
+
+    /* The method itself is passed on below; its content isn't */
+    ch->discard = 1;
+  }
+
+  if (ch->on_method != NULL) {
+    d->dispatched = 1;
+    ch->on_method(d->state, frame->channel, method, ch->data);
+  }
+
+  return 0;
+}
+
+static int dispatch_header(amqp_dispatcher_t d, amqp_frame_t const *frame)
+{
+  amqp_dispatch_channel_t *ch = get_channel(d, frame->channel, 0);
+  uint64_t body_size = frame->payload.properties.body_size;
+
+  if (ch == NULL || ch->stage != STAGE_HEADER || body_size > SIZE_MAX)
+    return -ERROR_BAD_AMQP_DATA;
+
+  ch->envelope.properties = frame->payload.properties.decoded;
+  ch->envelope.raw_properties = frame->payload.properties.raw;
+  ch->envelope.body.len = (size_t)body_size;
+  ch->envelope.body.bytes = NULL;
+  ch->body_received = 0;
+  ch->stage = STAGE_BODY;
+
+  if (body_size == 0)
+    finish_message(d, ch);
+
+  return 0;
+}
+
+static int dispatch_body(amqp_dispatcher_t d, amqp_frame_t const *frame)
+{
+  amqp_dispatch_channel_t *ch = get_channel(d, frame->channel, 0);
+  amqp_bytes_t const *fragment = &frame->payload.body_fragment;
+
+  if (ch == NULL || ch->stage != STAGE_BODY
+      || fragment->len > ch->envelope.body.len - ch->body_received)
+    return -ERROR_BAD_AMQP_DATA;
+
+  if (ch->discard) {
+    /* nothing to keep */
+  } else if (ch->body_received == 0
+	     && fragment->len == ch->envelope.body.len) {
+    /* The whole body in one frame: use it in place */
+    ch->envelope.body.bytes = fragment->bytes;
+  } else {
+    if (ch->body_received == 0) {
+      ch->envelope.body.bytes = amqp_pool_alloc(&d->state->decoding_pool,
+						ch->envelope.body.len);
+      if (ch->envelope.body.bytes == NULL)
+	return -ERROR_NO_MEMORY;
+    }
+    memcpy(amqp_offset(ch->envelope.body.bytes, ch->body_received),
+	   fragment->bytes, fragment->len);
+  }
+
+  ch->body_received += fragment->len;
+  if (ch->body_received == ch->envelope.body.len)
+    finish_message(d, ch);
+
+  return 0;
+}
+
+int amqp_dispatch_frame(amqp_dispatcher_t d, amqp_frame_t const *frame)
+{
+  int res;
+
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    res = dispatch_method(d, frame);
+    break;
+  case AMQP_FRAME_HEADER:
+    res = dispatch_header(d, frame);
+    break;
+  case AMQP_FRAME_BODY:
+    res = dispatch_body(d, frame);
+    break;
+  default:
+    /* heartbeats, and the "no frame yet" of non-blocking reads */
+    res = 0;
+  }
+
+  /* Everything decoded so far has been handed over, so the buffers
+     can be reused */
+  if (res == 0 && d->assembling == 0)
+    amqp_maybe_release_buffers(d->state);
+
+  return res;
+}
+
+int amqp_dispatch(amqp_dispatcher_t d, struct timeval *timeout)
+{
+  uint64_t deadline = 0;
+  amqp_frame_t frame;
+  int res;
+
+  if (timeout != NULL)
+    deadline = amqp_get_monotonic_ms() + (uint64_t)timeout->tv_sec * 1000
+      + timeout->tv_usec / 1000;
+
+  d->dispatched = 0;
+  while (!d->dispatched) {
+    if (timeout == NULL) {
+      res = amqp_simple_wait_frame(d->state, &frame);
+    } else {
+      uint64_t now = amqp_get_monotonic_ms();
+      struct timeval remaining;
+
+      if (now >= deadline)
+	return -ERROR_TIMEOUT;
+
+      remaining.tv_sec = (long)((deadline - now) / 1000);
+      remaining.tv_usec = (long)((deadline - now) % 1000) * 1000;
+      res = amqp_simple_wait_frame_timeout(d->state, &frame, &remaining);
+    }
+    if (res < 0)
+      return res;
+
+    /* A non-blocking connection has nothing more for now */
+    if (frame.frame_type == 0)
+      return 0;
+
+    res = amqp_dispatch_frame(d, &frame);
+    if (res < 0)
+      return res;
+  }
+
+  return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/*
+ * A single thread drives many connections: every connection is put in
+ * non-blocking mode, and each pass of the loop waits for any of their
+ * sockets to become ready, then decodes whatever frames have arrived
+ * and hands them to the connection's callback.
+ *
+ * Readiness comes from epoll where it is available, and from
+ * poll()/WSAPoll() everywhere else.
+ */
+
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+
+/* Frames dispatched from one connection before moving on to the
+   next, so that a busy connection can't starve the others. */
+#define MAX_FRAMES_PER_PASS 256
+
+typedef struct amqp_event_loop_entry_t_ {
+  amqp_connection_state_t state;
+  amqp_frame_callback_t callback;
+  void *data;
+  /* the events currently registered with the poller */
+  int events;
+  /* set by amqp_event_loop_remove; the entry itself is only freed at
+     the end of the pass, as the poller may still refer to it */
+  amqp_boolean_t removed;
+} amqp_event_loop_entry_t;
+
+struct amqp_event_loop_t_ {
+  amqp_event_loop_entry_t **entries;
+  int num_entries;
+  int max_entries;
+  int live_entries;
+  amqp_boolean_t stopped;
+
+#ifdef HAVE_SYS_EPOLL_H
+  int epfd;
+  struct epoll_event *ready;
+#else
+  struct pollfd *ready;
+#endif
+  int max_ready;
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static int poller_init(amqp_event_loop_t loop)
+{
+  loop->epfd = epoll_create(64);
+  return loop->epfd < 0 ? -1 : 0;
+}
+
+static void poller_destroy(amqp_event_loop_t loop)
+{
+  close(loop->epfd);
+}
+
+static int poller_update(amqp_event_loop_t loop,
+			 amqp_event_loop_entry_t *entry,
+			 int events)
+{
+  struct epoll_event ev;
+  int op;
+
+  ev.events = ((events & EVENT_READ) ? EPOLLIN : 0)
+	      | ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+  ev.data.ptr = entry;
+
+  if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else if (entry->events == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  if (epoll_ctl(loop->epfd, op, entry->state->sockfd, &ev) < 0)
+    return -1;
+
+  entry->events = events;
+  return 0;
+}
+
+static int poller_wait(amqp_event_loop_t loop, int timeout)
+{
+  int res;
+
+  do {
+    res = epoll_wait(loop->epfd, loop->ready, loop->max_ready, timeout);
+  } while (res < 0 && errno == EINTR);
+
+  return res;
+}
+
+static amqp_event_loop_entry_t *poller_ready(amqp_event_loop_t loop,
+					     int i,
+					     int *events)
+{
+  uint32_t ev = loop->ready[i].events;
+
+  /* Errors and hangups are discovered by reading */
+  *events = ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? EVENT_READ : 0)
+	    | ((ev & EPOLLOUT) ? EVENT_WRITE : 0);
+  return loop->ready[i].data.ptr;
+}
+
+#else
+
+static int poller_init(amqp_event_loop_t loop)
+{
+  (void)loop;
+  return 0;
+}
+
+static void poller_destroy(amqp_event_loop_t loop)
+{
+  (void)loop;
+}
+
+static int poller_update(amqp_event_loop_t loop,
+			 amqp_event_loop_entry_t *entry,
+			 int events)
+{
+  (void)loop;
+  entry->events = events;
+  return 0;
+}
+
+/* The poll set is rebuilt on every pass, one pollfd per entry, so
+   that the results line up with loop->entries. */
+static int poller_wait(amqp_event_loop_t loop, int timeout)
+{
+  int i;
+
+  for (i = 0; i < loop->num_entries; i++) {
+    amqp_event_loop_entry_t *entry = loop->entries[i];
+
+    loop->ready[i].fd = entry->removed ? -1 : entry->state->sockfd;
+    loop->ready[i].events = ((entry->events & EVENT_READ) ? POLLIN : 0)
+			    | ((entry->events & EVENT_WRITE) ? POLLOUT : 0);
+    loop->ready[i].revents = 0;
+  }
+
+  if (amqp_socket_poll(loop->ready, loop->num_entries, timeout) < 0)
+    return -1;
+
+  return loop->num_entries;
+}
+
+static amqp_event_loop_entry_t *poller_ready(amqp_event_loop_t loop,
+					     int i,
+					     int *events)
+{
+  short ev = loop->ready[i].revents;
+
+  *events = ((ev & (POLLIN | POLLERR | POLLHUP)) ? EVENT_READ : 0)
+	    | ((ev & POLLOUT) ? EVENT_WRITE : 0);
+  return loop->entries[i];
+}
+
+#endif
+
+amqp_event_loop_t amqp_new_event_loop(void)
+{
+  amqp_event_loop_t loop = calloc(1, sizeof(struct amqp_event_loop_t_));
+  if (loop == NULL)
+    return NULL;
+
+  if (amqp_socket_init() < 0 || poller_init(loop) < 0) {
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void amqp_destroy_event_loop(amqp_event_loop_t loop)
+{
+  int i;
+
+  if (loop == NULL)
+    return;
+
+  poller_destroy(loop);
+
+  for (i = 0; i < loop->num_entries; i++)
+    free(loop->entries[i]);
+
+  free(loop->entries);
+  free(loop->ready);
+  free(loop);
+}
+
+int amqp_event_loop_add(amqp_event_loop_t loop,
+			amqp_connection_state_t state,
+			amqp_frame_callback_t callback,
+			void *data)
+{
+  amqp_event_loop_entry_t *entry;
+  int res;
+
+  if (loop->num_entries == loop->max_entries) {
+    int max = loop->max_entries ? loop->max_entries * 2 : 16;
+    void *entries = realloc(loop->entries, max * sizeof(*loop->entries));
+    void *ready;
+
+    if (entries == NULL)
+      return -ERROR_NO_MEMORY;
+    loop->entries = entries;
+
+    ready = realloc(loop->ready, max * sizeof(*loop->ready));
+    if (ready == NULL)
+      return -ERROR_NO_MEMORY;
+    loop->ready = ready;
+
+    loop->max_entries = max;
+    loop->max_ready = max;
+  }
+
+  res = amqp_set_nonblocking(state, 1);
+  if (res < 0)
+    return res;
+
+  entry = malloc(sizeof(amqp_event_loop_entry_t));
+  if (entry == NULL)
+    return -ERROR_NO_MEMORY;
+
+  entry->state = state;
+  entry->callback = callback;
+  entry->data = data;
+  entry->events = 0;
+  entry->removed = 0;
+
+  if (poller_update(loop, entry, EVENT_READ) < 0) {
+    res = -amqp_socket_error();
+    free(entry);
+    return res;
+  }
+
+  loop->entries[loop->num_entries++] = entry;
+  loop->live_entries++;
+  return 0;
+}
+
+static void remove_entry(amqp_event_loop_t loop,
+			 amqp_event_loop_entry_t *entry)
+{
+  /* The socket may already have been closed, which takes it out of
+     the poller anyway, so a failure here doesn't matter. */
+  poller_update(loop, entry, 0);
+  entry->removed = 1;
+  loop->live_entries--;
+}
+
+void amqp_event_loop_remove(amqp_event_loop_t loop,
+			    amqp_connection_state_t state)
+{
+  int i;
+
+  for (i = 0; i < loop->num_entries; i++) {
+    amqp_event_loop_entry_t *entry = loop->entries[i];
+
+    if (entry->state == state && !entry->removed) {
+      remove_entry(loop, entry);
+      return;
+    }
+  }
+}
+
+/* Frees the entries removed during the last pass. */
+static void purge_entries(amqp_event_loop_t loop)
+{
+  int i, j = 0;
+
+  for (i = 0; i < loop->num_entries; i++) {
+    if (loop->entries[i]->removed)
+      free(loop->entries[i]);
+    else
+      loop->entries[j++] = loop->entries[i];
+  }
+
+  loop->num_entries = j;
+}
+
+/* Drops a connection that has failed, and tells its callback why. */
+static void fail_entry(amqp_event_loop_t loop,
+		       amqp_event_loop_entry_t *entry,
+		       int status)
+{
+  remove_entry(loop, entry);
+  entry->callback(entry->state, NULL, status, entry->data);
+}
+
+/* Writes out pending output and dispatches available frames for one
+   connection. Returns the number of frames dispatched. */
+static int service_entry(amqp_event_loop_t loop,
+			 amqp_event_loop_entry_t *entry,
+			 int events)
+{
+  amqp_connection_state_t state = entry->state;
+  int dispatched = 0;
+  int res;
+
+  if (events & EVENT_WRITE) {
+    res = amqp_flush(state);
+    if (res < 0) {
+      fail_entry(loop, entry, res);
+      return 0;
+    }
+  }
+
+  if (!(events & EVENT_READ))
+    return 0;
+
+  while (dispatched < MAX_FRAMES_PER_PASS) {
+    amqp_frame_t frame;
+
+    res = amqp_simple_wait_frame(state, &frame);
+    if (res < 0) {
+      fail_entry(loop, entry, res);
+      break;
+    }
+
+    if (frame.frame_type == 0)
+      break;
+
+    entry->callback(state, &frame, 0, entry->data);
+    dispatched++;
+
+    /* The callback may have removed, and even destroyed, the
+       connection. */
+    if (entry->removed)
+      break;
+
+    amqp_maybe_release_buffers(state);
+  }
+
+  return dispatched;
+}
+
+int amqp_event_loop_run_once(amqp_event_loop_t loop, int timeout)
+{
+  int i, n;
+  int dispatched = 0;
+
+  if (loop->live_entries == 0)
+    return 0;
+
+  /* Bring each registration up to date with the connection's pending
+     output, don't sleep if any connection already has frames decoded
+     or buffered, and wake up in time for the next heartbeat. */
+  for (i = 0; i < loop->num_entries; i++) {
+    amqp_event_loop_entry_t *entry = loop->entries[i];
+    int events, heartbeat;
+
+    if (entry->removed)
+      continue;
+
+    heartbeat = amqp_heartbeat_timeout(entry->state);
+    if (heartbeat >= 0 && (timeout < 0 || heartbeat < timeout))
+      timeout = heartbeat;
+
+    /* A connection that can't be registered (its socket may have been
+       closed behind the loop's back) fails on its own; the others
+       carry on. */
+    events = EVENT_READ | (amqp_wants_write(entry->state) ? EVENT_WRITE : 0);
+    if (events != entry->events && poller_update(loop, entry, events) < 0) {
+      fail_entry(loop, entry, -amqp_socket_error());
+      continue;
+    }
+
+    if (!amqp_wants_read(entry->state))
+      timeout = 0;
+  }
+
+  n = poller_wait(loop, timeout);
+  if (n < 0)
+    return -amqp_socket_error();
+
+  for (i = 0; i < n; i++) {
+    int events;
+    amqp_event_loop_entry_t *entry = poller_ready(loop, i, &events);
+
+    if (events != 0 && !entry->removed)
+      dispatched += service_entry(loop, entry, events);
+  }
+
+  /* Frames can also be waiting without the socket being readable,
+     e.g. when a synchronous call made from a callback queued them. */
+  for (i = 0; i < loop->num_entries; i++) {
+    amqp_event_loop_entry_t *entry = loop->entries[i];
+
+    if (!entry->removed && !amqp_wants_read(entry->state))
+      dispatched += service_entry(loop, entry, EVENT_READ);
+  }
+
+  for (i = 0; i < loop->num_entries; i++) {
+    amqp_event_loop_entry_t *entry = loop->entries[i];
+    int res;
+
+    if (entry->removed)
+      continue;
+
+    /* The pass's burst of deliveries is over: send what its callbacks
+       acknowledged rather than wait for the next delivery */
+    if (entry->state->ack_batches != NULL) {
+      res = amqp_flush_coalesced_acks(entry->state);
+      if (res == 0)
+	res = amqp_flush(entry->state);
+      if (res < 0) {
+	fail_entry(loop, entry, res);
+	continue;
+      }
+    }
+
+    res = amqp_heartbeat_tick(entry->state);
+    if (res < 0)
+      fail_entry(loop, entry, res);
+  }
+
+  purge_entries(loop);
+  return dispatched;
+}
+
+int amqp_event_loop_run(amqp_event_loop_t loop)
+{
+  loop->stopped = 0;
+
+  while (!loop->stopped && loop->live_entries > 0) {
+    int res = amqp_event_loop_run_once(loop, -1);
+    if (res < 0)
+      return res;
+  }
+
+  return 0;
+}
+
+void amqp_event_loop_stop(amqp_event_loop_t loop)
+{
+  loop->stopped = 1;
+}
@@ -46,14 +46,45 @@ char const *amqp_version(void) {
   return VERSION; /* defined in config.h */
 }
 
+/* Large blocks start with a header recording their size, so that
+   they can be handed out again after the pool is recycled. It is 16
+   bytes to keep the allocations that follow it suitably aligned. */
+#define LARGE_BLOCK_HEADER_SIZE 16
+
+/* The number of large blocks recycle_amqp_pool keeps for reuse, and
+   the most memory they may hold between them. A block too big to fit
+   is freed outright. */
+#define SPARE_LARGE_BLOCKS 4
+#define SPARE_LARGE_BYTES (4 * 1024 * 1024)
+
+#define INITIAL_BLOCKLIST_CAPACITY 16
+
+/* A blocklist's array is allocated with this header in front of it,
+   which keeps the bookkeeping out of the public amqp_pool_blocklist_t.
+   Only a pool's large_blocks list has spares. */
+typedef struct blocklist_header_t_ {
+  int capacity; /* number of slots allocated after the header */
+  int num_spare;
+  size_t spare_bytes;
+  void *spare[SPARE_LARGE_BLOCKS];
+} blocklist_header_t;
+
+static blocklist_header_t *blocklist_header(amqp_pool_blocklist_t *x) {
+  if (x->blocklist == NULL)
+    return NULL;
+  return (blocklist_header_t *) x->blocklist - 1;
+}
+
+static void init_blocklist(amqp_pool_blocklist_t *x) {
+  x->num_blocks = 0;
+  x->blocklist = NULL;
+}
+
 void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
   pool->pagesize = pagesize ? pagesize : 4096;
 
-  pool->pages.num_blocks = 0;
-  pool->pages.blocklist = NULL;
-
-  pool->large_blocks.num_blocks = 0;
-  pool->large_blocks.blocklist = NULL;
+  init_blocklist(&pool->pages);
+  init_blocklist(&pool->large_blocks);
 
   pool->next_page = 0;
   pool->alloc_block = NULL;
@@ -61,20 +92,98 @@ void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
 }
 
 static void empty_blocklist(amqp_pool_blocklist_t *x) {
+  blocklist_header_t *header = blocklist_header(x);
   int i;
 
   for (i = 0; i < x->num_blocks; i++) {
     free(x->blocklist[i]);
   }
-  if (x->blocklist != NULL) {
-    free(x->blocklist);
+  if (header != NULL) {
+    for (i = 0; i < header->num_spare; i++) {
+      free(header->spare[i]);
+    }
+    free(header);
   }
-  x->num_blocks = 0;
-  x->blocklist = NULL;
+  init_blocklist(x);
+}
+
+/* Returns 1 on success, 0 on failure */
+static int record_pool_block(amqp_pool_blocklist_t *x, void *block) {
+  blocklist_header_t *header = blocklist_header(x);
+
+  if (header == NULL || x->num_blocks == header->capacity) {
+    int capacity = header ? header->capacity * 2 : INITIAL_BLOCKLIST_CAPACITY;
+    blocklist_header_t *newheader =
+      realloc(header, sizeof(blocklist_header_t) + sizeof(void *) * capacity);
+    if (newheader == NULL)
+      return 0;
+    if (header == NULL) {
+      newheader->num_spare = 0;
+      newheader->spare_bytes = 0;
+    }
+    newheader->capacity = capacity;
+    header = newheader;
+    x->blocklist = (void **) (header + 1);
+  }
+
+  x->blocklist[x->num_blocks] = block;
+  x->num_blocks++;
+  return 1;
+}
+
+static size_t large_block_size(void *block) {
+  return *(size_t *) block;
+}
+
+static void drop_spare_large_block(blocklist_header_t *header, int i) {
+  header->spare_bytes -= large_block_size(header->spare[i]);
+  header->spare[i] = header->spare[--header->num_spare];
+}
+
+/* Keeps a large block from the pool's last cycle for reuse, in
+   preference to smaller spares if there isn't room for them all */
+static void keep_spare_large_block(blocklist_header_t *header, void *block) {
+  size_t size = large_block_size(block);
+
+  while (size <= SPARE_LARGE_BYTES && header->num_spare > 0
+	 && (header->num_spare == SPARE_LARGE_BLOCKS
+	     || header->spare_bytes + size > SPARE_LARGE_BYTES)) {
+    int smallest = 0;
+    int i;
+
+    for (i = 1; i < header->num_spare; i++) {
+      if (large_block_size(header->spare[i])
+	  < large_block_size(header->spare[smallest]))
+	smallest = i;
+    }
+
+    if (large_block_size(header->spare[smallest]) >= size)
+      break;
+
+    free(header->spare[smallest]);
+    drop_spare_large_block(header, smallest);
+  }
+
+  if (size > SPARE_LARGE_BYTES
+      || header->num_spare == SPARE_LARGE_BLOCKS
+      || header->spare_bytes + size > SPARE_LARGE_BYTES) {
+    free(block);
+    return;
+  }
+
+  header->spare[header->num_spare++] = block;
+  header->spare_bytes += size;
 }
 
 void recycle_amqp_pool(amqp_pool_t *pool) {
-  empty_blocklist(&pool->large_blocks);
+  blocklist_header_t *header = blocklist_header(&pool->large_blocks);
+  int i;
+
+  for (i = 0; i < pool->large_blocks.num_blocks; i++) {
+    keep_spare_large_block(header, pool->large_blocks.blocklist[i]);
+  }
+  pool->large_blocks.num_blocks = 0;
+
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
@@ -82,27 +191,44 @@ void recycle_amqp_pool(amqp_pool_t *pool) {
 
 void empty_amqp_pool(amqp_pool_t *pool) {
   recycle_amqp_pool(pool);
+  empty_blocklist(&pool->large_blocks);
   empty_blocklist(&pool->pages);
 }
 
-/* Returns 1 on success, 0 on failure */
-static int record_pool_block(amqp_pool_blocklist_t *x, void *block) {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
+static void *alloc_large_block(amqp_pool_t *pool, size_t amount) {
+  blocklist_header_t *header = blocklist_header(&pool->large_blocks);
+  void *block = NULL;
+  int best = -1;
+  int i;
 
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL)
-      return 0;
+  /* The smallest spare block that is big enough */
+  for (i = 0; header != NULL && i < header->num_spare; i++) {
+    size_t size = large_block_size(header->spare[i]);
+    if (size >= amount
+	&& (best < 0 || size < large_block_size(header->spare[best])))
+      best = i;
+  }
+
+  if (best >= 0) {
+    block = header->spare[best];
+    drop_spare_large_block(header, best);
   } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
-    if (newbl == NULL)
-      return 0;
-    x->blocklist = newbl;
+    if (amount > SIZE_MAX - LARGE_BLOCK_HEADER_SIZE)
+      return NULL;
+
+    block = malloc(LARGE_BLOCK_HEADER_SIZE + amount);
+    if (block == NULL)
+      return NULL;
+
+    *(size_t *) block = amount;
   }
 
-  x->blocklist[x->num_blocks] = block;
-  x->num_blocks++;
-  return 1;
+  if (!record_pool_block(&pool->large_blocks, block)) {
+    free(block);
+    return NULL;
+  }
+
+  return (char *) block + LARGE_BLOCK_HEADER_SIZE;
 }
 
 void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
@@ -113,13 +239,7 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
-    if (result == NULL) {
-      return NULL;
-    }
-    if (!record_pool_block(&pool->large_blocks, result))
-      return NULL;
-    return result;
+    return alloc_large_block(pool, amount);
   }
 
   if (pool->alloc_block != NULL) {
@@ -133,12 +253,15 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = malloc(pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
-    if (!record_pool_block(&pool->pages, pool->alloc_block))
+    if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+      free(pool->alloc_block);
+      pool->alloc_block = NULL;
       return NULL;
+    }
     pool->next_page = pool->pages.num_blocks;
   } else {
     pool->alloc_block = pool->pages.blocklist[pool->next_page];
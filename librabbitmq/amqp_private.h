@@ -52,16 +52,22 @@
 #define ERROR_CATEGORY_CLIENT (0 << 29) /* librabbitmq error codes */
 #define ERROR_CATEGORY_OS (1 << 29) /* OS-specific error codes */
 
-/* librabbitmq error codes */
-#define ERROR_NO_MEMORY 1
-#define ERROR_BAD_AMQP_DATA 2
-#define ERROR_UNKNOWN_CLASS 3
-#define ERROR_UNKNOWN_METHOD 4
-#define ERROR_GETHOSTBYNAME_FAILED 5
-#define ERROR_INCOMPATIBLE_AMQP_VERSION 6
-#define ERROR_CONNECTION_CLOSED 7
-#define ERROR_BAD_AMQP_URL 8
-#define ERROR_MAX 8
+/* librabbitmq error codes, as published in amqp.h */
+#define ERROR_NO_MEMORY AMQP_ERROR_NO_MEMORY
+#define ERROR_BAD_AMQP_DATA AMQP_ERROR_BAD_AMQP_DATA
+#define ERROR_UNKNOWN_CLASS AMQP_ERROR_UNKNOWN_CLASS
+#define ERROR_UNKNOWN_METHOD AMQP_ERROR_UNKNOWN_METHOD
+#define ERROR_GETHOSTBYNAME_FAILED AMQP_ERROR_GETHOSTBYNAME_FAILED
+#define ERROR_INCOMPATIBLE_AMQP_VERSION AMQP_ERROR_INCOMPATIBLE_AMQP_VERSION
+#define ERROR_CONNECTION_CLOSED AMQP_ERROR_CONNECTION_CLOSED
+#define ERROR_BAD_AMQP_URL AMQP_ERROR_BAD_AMQP_URL
+#define ERROR_NOT_SUPPORTED AMQP_ERROR_NOT_SUPPORTED
+#define ERROR_TIMEOUT AMQP_ERROR_TIMEOUT
+#define ERROR_HEARTBEAT_TIMEOUT AMQP_ERROR_HEARTBEAT_TIMEOUT
+#define ERROR_UNEXPECTED_FRAME AMQP_ERROR_UNEXPECTED_FRAME
+#define ERROR_PUBLISH_NACKED AMQP_ERROR_PUBLISH_NACKED
+#define ERROR_CHANNEL_CLOSED AMQP_ERROR_CHANNEL_CLOSED
+#define ERROR_MAX 14
 
 /* GCC attributes */
 #if __GNUC__ > 2 | (__GNUC__ == 2 && __GNUC_MINOR__ > 4)
@@ -93,15 +99,17 @@ amqp_os_error_string(int err);
  * - CONNECTION_STATE_IDLE: The normal state between
  *   frames. Connections may only be reconfigured, and the
  *   connection's pools recycled, when in this state. Whenever we're
- *   in this state, the inbound_buffer's bytes pointer must be NULL;
- *   any other state, and it must point to a block of memory allocated
- *   from the frame_pool.
+ *   in this state, the inbound_buffer's bytes pointer must be NULL.
  *
  * - CONNECTION_STATE_HEADER: Some bytes of an incoming frame have
- *   been seen, but not a complete frame header's worth.
+ *   been seen, but not a complete frame header's worth. In this
+ *   state (and in CONNECTION_STATE_INITIAL) the inbound_buffer's
+ *   bytes pointer refers to the fixed-size header_buffer.
  *
  * - CONNECTION_STATE_BODY: A complete frame header has been seen, but
- *   the frame is not yet complete. When it is completed, it will be
+ *   the frame is not yet complete. The inbound_buffer's bytes pointer
+ *   refers to a block from the frame_pool sized to fit exactly the
+ *   frame announced by the header. When it is completed, it will be
  *   returned, and the connection will return to IDLE state.
  *
  */
@@ -118,10 +126,75 @@ typedef enum amqp_connection_state_enum_ {
 
 #define AMQP_PSEUDOFRAME_PROTOCOL_HEADER 'A'
 
-typedef struct amqp_link_t_ {
-  struct amqp_link_t_ *next;
-  void *data;
-} amqp_link_t;
+/* A frame that was read while waiting for something else. Queued
+   frames are linked in arrival order across all channels, and again
+   per channel, so that the next frame for a given channel is found
+   without a scan. */
+typedef struct amqp_queued_frame_t_ {
+  amqp_frame_t frame;
+  struct amqp_queued_frame_t_ *next;
+  struct amqp_queued_frame_t_ *prev;
+  struct amqp_queued_frame_t_ *next_on_channel;
+} amqp_queued_frame_t;
+
+typedef struct amqp_channel_queue_t_ {
+  amqp_queued_frame_t *first;
+  amqp_queued_frame_t *last;
+} amqp_channel_queue_t;
+
+/* Publisher confirm tracking for one channel. Tags from oldest_tag
+   up to next_tag have been published; a tag is still awaiting
+   confirmation if its bit is set in the pending ring, which has room
+   for window tags. */
+typedef struct amqp_confirm_t_ {
+  struct amqp_confirm_t_ *next;
+  amqp_channel_t channel;
+  uint64_t next_tag;
+  uint64_t oldest_tag;
+  int window;
+  int outstanding;
+  amqp_boolean_t nacked;
+  amqp_confirm_callback_t callback;
+  void *callback_data;
+  uint32_t *pending;
+} amqp_confirm_t;
+
+/* Coalescing of a channel's acknowledgements. Every delivery tag up
+   to base has been settled with the broker. Past that, a tag's bit is
+   set in acked once the application has acknowledged it, and also in
+   sent once that has gone out on its own; both are rings with room
+   for AMQP_ACK_WINDOW tags. unsent is the lowest tag acknowledged
+   since the batch was last flushed (0 if none), so that a flush need
+   not rescan what went out before. pending counts the acks not yet
+   sent, the first of which was made at since. */
+#define AMQP_ACK_WINDOW 65536
+
+typedef struct amqp_ack_batch_t_ {
+  struct amqp_ack_batch_t_ *next;
+  amqp_channel_t channel;
+  int max_pending;
+  int max_delay;
+  uint64_t base;
+  uint64_t highest;
+  uint64_t unsent;
+  int pending;
+  uint64_t since;
+  uint32_t *acked;
+  uint32_t *sent;
+} amqp_ack_batch_t;
+
+#define AMQP_RPC_MAX_REPLIES 3
+
+/* A request sent with amqp_simple_rpc_send whose reply hasn't been
+   collected yet. */
+typedef struct amqp_pending_rpc_t_ {
+  amqp_channel_t channel;
+  /* zero-terminated, like the list passed to amqp_simple_rpc */
+  amqp_method_number_t reply_ids[AMQP_RPC_MAX_REPLIES + 1];
+  /* the error to fail with, once an earlier request has been answered
+     by the broker closing the channel or connection; 0 until then */
+  int failed;
+} amqp_pending_rpc_t;
 
 struct amqp_connection_state_t_ {
   amqp_pool_t frame_pool;
@@ -133,21 +206,78 @@ struct amqp_connection_state_t_ {
   int frame_max;
   int heartbeat;
   amqp_bytes_t inbound_buffer;
+  /* Holds a frame header until its length field is known. Large enough
+     for the 8-byte protocol header, too. */
+  uint8_t header_buffer[HEADER_SIZE + 1];
 
   size_t inbound_offset;
   size_t target_size;
 
   amqp_bytes_t outbound_buffer;
 
+  /* Output waiting to be written: bytes from sock_outbound_offset up to
+     sock_outbound_limit, making up sock_outbound_frames frames. While
+     any output is waiting, further frames are appended here too, so
+     that they go out in order. */
+  amqp_bytes_t sock_outbound_buffer;
+  size_t sock_outbound_offset;
+  size_t sock_outbound_limit;
+  int sock_outbound_frames;
+  size_t batch_max_bytes;
+  int batch_max_frames;
+  /* Set by amqp_set_lazy_properties */
+  amqp_boolean_t lazy_properties;
+  /* While non-zero, decoded frames are still in use by the library
+     (e.g. a dispatcher assembling a message), so the buffers must not
+     be released */
+  int buffer_holds;
+
   int sockfd;
+  /* Set by amqp_set_nonblocking. Reads and writes that would block
+     leave their work pending rather than waiting. */
+  amqp_boolean_t nonblocking;
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
-
-  amqp_link_t *first_queued_frame;
-  amqp_link_t *last_queued_frame;
+  /* The malloc()ed buffer owned by the connection. sock_inbound_buffer
+     points either here or at a block from the frame_pool. */
+  void *sock_inbound_primary;
+  /* Set when frames have been decoded in place from sock_inbound_buffer,
+     so its contents must not be overwritten until the buffers are
+     released. */
+  amqp_boolean_t sock_inbound_pinned;
+  /* Set by amqp_use_io_uring; blocking reads and writes then go
+     through the ring instead of plain system calls. */
+  struct amqp_uring_t_ *uring;
+
+  amqp_queued_frame_t *first_queued_frame;
+  amqp_queued_frame_t *last_queued_frame;
+  /* Indexed by channel number; grown as channels are seen */
+  amqp_channel_queue_t *channel_queues;
+  int num_channel_queues;
+
+  /* Pipelined requests, oldest first, from pending_rpcs[pending_rpc_head]
+     up to pending_rpcs[pending_rpc_tail] */
+  amqp_pending_rpc_t *pending_rpcs;
+  int pending_rpc_head;
+  int pending_rpc_tail;
+  int pending_rpc_capacity;
+
+  /* Channels in confirm mode */
+  amqp_confirm_t *confirms;
+  amqp_ack_batch_t *ack_batches;
 
   amqp_rpc_reply_t most_recent_api_result;
+
+  /* Limit on synchronous waits for the broker (amqp_login,
+     amqp_simple_rpc), in milliseconds; -1 for none. */
+  int rpc_timeout;
+
+  /* When data was last written to and read from the socket, on the
+     amqp_get_monotonic_ms clock. Only kept up to date while
+     heartbeats are enabled. */
+  uint64_t last_send;
+  uint64_t last_recv;
 };
 
 static inline void *amqp_offset(void *data, size_t offset)
@@ -281,4 +411,85 @@ AMQP_NORETURN
 void
 amqp_abort(const char *fmt, ...);
 
+int
+amqp_handle_sock_input(amqp_connection_state_t state,
+		       amqp_frame_t *decoded_frame);
+
+/* Encodes a complete frame, header and footer included, at *offset in
+   encoded, and advances *offset past it. */
+int
+amqp_encode_frame(amqp_bytes_t encoded,
+		  amqp_frame_t const *frame,
+		  size_t *offset);
+
+/* Encoders for the frames of a publish, generated by codegen.py
+   especially for the fast path. They work like amqp_encode_frame. */
+int
+amqp_encode_basic_publish_frame(amqp_bytes_t encoded, size_t *offset,
+				amqp_channel_t channel,
+				amqp_basic_publish_t const *m);
+
+int
+amqp_encode_basic_header_frame(amqp_bytes_t encoded, size_t *offset,
+			       amqp_channel_t channel, uint64_t body_size,
+			       amqp_basic_properties_t const *p);
+
+#define AMQP_SEND_IOV_MAX 64
+
+/* Writes out all of the given buffers, which between them hold the
+   given number of frames. If buffered is set, or other output is
+   already waiting, the data is appended to the connection's outbound
+   buffer instead, which is written out once the batch limits are
+   reached. On a non-blocking connection, whatever the socket won't
+   take straight away is kept in the outbound buffer too. The iovec
+   array is used as scratch space, and is left modified. At most
+   AMQP_SEND_IOV_MAX iovecs may be passed in one call. */
+int
+amqp_send_iov(amqp_connection_state_t state,
+	      struct iovec *iov,
+	      int iovcnt,
+	      int frames,
+	      amqp_boolean_t buffered);
+
+/* Accounts for written bytes of pending output. */
+void
+amqp_outbound_written(amqp_connection_state_t state, size_t written);
+
+/* Like amqp_send_frame, but appends to the outbound batch. */
+int
+amqp_send_frame_batch(amqp_connection_state_t state, const amqp_frame_t *frame);
+
+/* The confirm tracking for a channel, or NULL if it isn't in confirm
+   mode. */
+amqp_confirm_t *
+amqp_find_confirm(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Settles publishes if the frame is a basic.ack or basic.nack on a
+   channel in confirm mode. Returns 1 if it was, so the frame should
+   not be passed on, 0 if not, or a negative error. */
+int
+amqp_handle_confirm(amqp_connection_state_t state, amqp_frame_t const *frame);
+
+/* Sends the acknowledgements held back on every channel, appending
+   them to the outbound batch. */
+int
+amqp_flush_coalesced_acks(amqp_connection_state_t state);
+
+/* Milliseconds until the oldest ack held back on any channel has
+   waited its max_delay, 0 if one already has, or -1 if none is
+   waiting against a delay. */
+int
+amqp_coalesced_acks_timeout(amqp_connection_state_t state);
+
+/* Sends the acks of every channel whose max_delay has run out and
+   writes them out. */
+int
+amqp_flush_due_acks(amqp_connection_state_t state);
+
+/* Reads frames until no more than max_outstanding publishes await
+   confirmation, within the RPC timeout. Other frames are queued. */
+int
+amqp_wait_confirms(amqp_connection_state_t state, amqp_confirm_t *confirm,
+		   int max_outstanding);
+
 #endif
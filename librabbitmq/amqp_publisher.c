@@ -0,0 +1,562 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A publisher lets any number of threads publish on one connection.
+ * Each producer encodes its message into a self-contained block of
+ * frames on its own thread, and pushes the block onto a lock-free
+ * multi-producer, single-consumer queue. The connection's own I/O
+ * thread pops whatever has accumulated and writes it out with one
+ * writev, so producers never touch the socket and never wait on each
+ * other.
+ *
+ * The queue is the intrusive one due to Dmitry Vyukov: a push is a
+ * single atomic exchange of the head followed by linking the previous
+ * head to the new node. The consumer owns the tail and a stub node,
+ * which keeps the queue from ever becoming truly empty.
+ *
+ * When it runs out of work, the I/O thread sleeps in poll() on the
+ * socket and on a self-pipe; a producer that finds it asleep writes a
+ * byte to the pipe to wake it.
+ */
+
+#if defined(HAVE_PTHREAD) && defined(__ATOMIC_SEQ_CST)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct amqp_publish_msg_t_ {
+  struct amqp_publish_msg_t_ *next;
+  size_t len;
+  int frames;
+  /* the encoded frames follow */
+} amqp_publish_msg_t;
+
+struct amqp_publisher_t_ {
+  amqp_connection_state_t state;
+  amqp_boolean_t was_nonblocking;
+  pthread_t thread;
+
+  amqp_publish_msg_t *head;	/* pushed to by producers */
+  amqp_publish_msg_t *tail;	/* popped from by the I/O thread */
+  amqp_publish_msg_t stub;
+
+  int wake_fds[2];
+  int sleeping;
+  int wake_pending;
+  int stopping;
+  /* when stopping gives up on output the broker won't take, on the
+     amqp_get_monotonic_ms clock; 0 for never */
+  uint64_t stop_deadline;
+  int status;
+};
+
+/* Room for the method and content header frames of a typical message;
+   messages with large properties are encoded again with more. */
+#define INITIAL_HEADER_ROOM 512
+
+static void push(amqp_publisher_t p, amqp_publish_msg_t *msg)
+{
+  amqp_publish_msg_t *prev;
+
+  __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&p->head, msg, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&prev->next, msg, __ATOMIC_SEQ_CST);
+}
+
+/* Called only from the I/O thread. Returns NULL if the queue is empty
+   or a push is half-way through; in the latter case the producer will
+   wake the thread once it has finished. */
+static amqp_publish_msg_t *pop(amqp_publisher_t p)
+{
+  amqp_publish_msg_t *tail = p->tail;
+  amqp_publish_msg_t *next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+
+  if (tail == &p->stub) {
+    if (next == NULL)
+      return NULL;
+    p->tail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_SEQ_CST);
+  }
+
+  if (next != NULL) {
+    p->tail = next;
+    return tail;
+  }
+
+  if (tail != __atomic_load_n(&p->head, __ATOMIC_SEQ_CST))
+    return NULL;
+
+  push(p, &p->stub);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+  if (next != NULL) {
+    p->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+static amqp_boolean_t queue_empty(amqp_publisher_t p)
+{
+  return p->tail == &p->stub
+    && __atomic_load_n(&p->stub.next, __ATOMIC_SEQ_CST) == NULL;
+}
+
+static void set_status(amqp_publisher_t p, int status)
+{
+  int expected = 0;
+
+  __atomic_compare_exchange_n(&p->status, &expected, status, 0,
+			      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void wake(amqp_publisher_t p)
+{
+  char c = 0;
+
+  if (!__atomic_exchange_n(&p->wake_pending, 1, __ATOMIC_SEQ_CST))
+    while (write(p->wake_fds[1], &c, 1) < 0 && errno == EINTR)
+      ;
+}
+
+static int send_queued(amqp_publisher_t p)
+{
+  struct iovec iov[AMQP_SEND_IOV_MAX];
+  amqp_publish_msg_t *msgs[AMQP_SEND_IOV_MAX];
+  amqp_publish_msg_t *msg;
+  int i, n, frames, res;
+
+  for (;;) {
+    n = 0;
+    frames = 0;
+    while (n < AMQP_SEND_IOV_MAX && (msg = pop(p)) != NULL) {
+      iov[n].iov_base = msg + 1;
+      iov[n].iov_len = msg->len;
+      frames += msg->frames;
+      msgs[n++] = msg;
+    }
+
+    if (n == 0)
+      return 0;
+
+    res = amqp_send_iov(p->state, iov, n, frames, 0);
+
+    for (i = 0; i < n; i++)
+      free(msgs[i]);
+
+    if (res < 0)
+      return res;
+
+    if (amqp_wants_write(p->state))
+      return 0;
+  }
+}
+
+/* Confirms are settled as frames are read; anything else is of no
+   interest, unless the broker is closing the channel or connection,
+   after which there's no point carrying on. */
+static int read_incoming(amqp_publisher_t p)
+{
+  amqp_frame_t frame;
+  int res;
+
+  for (;;) {
+    res = amqp_simple_wait_frame(p->state, &frame);
+    if (res < 0)
+      return res;
+
+    if (frame.frame_type == 0)
+      break;
+
+    if (frame.frame_type == AMQP_FRAME_METHOD) {
+      if (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD)
+	return -ERROR_CONNECTION_CLOSED;
+      if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)
+	return -ERROR_UNEXPECTED_FRAME;
+    }
+  }
+
+  amqp_maybe_release_buffers(p->state);
+  return 0;
+}
+
+static void *publisher_thread(void *arg)
+{
+  amqp_publisher_t p = arg;
+  amqp_connection_state_t state = p->state;
+  struct pollfd pfd[2];
+  char drain[64];
+  int timeout;
+  int res;
+
+  for (;;) {
+    if (!amqp_wants_write(state)) {
+      res = send_queued(p);
+      if (res < 0)
+	goto fail;
+    }
+
+    __atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if (!amqp_wants_write(state)) {
+      if (!queue_empty(p)) {
+	__atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+	continue;
+      }
+      if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST))
+	break;
+    }
+
+    timeout = amqp_wants_read(state) ? amqp_heartbeat_timeout(state) : 0;
+
+    /* The broker may have stopped reading (connection.blocked, or
+       just gone quiet); a stop with a deadline doesn't wait for it
+       forever */
+    if (__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)
+	&& p->stop_deadline != 0) {
+      uint64_t now = amqp_get_monotonic_ms();
+
+      if (now >= p->stop_deadline) {
+	res = -ERROR_TIMEOUT;
+	goto fail;
+      }
+
+      if (timeout < 0 || p->stop_deadline - now < (uint64_t)timeout)
+	timeout = (int)(p->stop_deadline - now);
+    }
+
+    pfd[0].fd = p->wake_fds[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = state->sockfd;
+    pfd[1].events = POLLIN | (amqp_wants_write(state) ? POLLOUT : 0);
+
+    res = poll(pfd, 2, timeout);
+    __atomic_store_n(&p->sleeping, 0, __ATOMIC_SEQ_CST);
+
+    if (res < 0) {
+      if (errno == EINTR)
+	continue;
+      res = -amqp_socket_error();
+      goto fail;
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      while (read(p->wake_fds[0], drain, sizeof(drain)) > 0)
+	;
+      __atomic_store_n(&p->wake_pending, 0, __ATOMIC_SEQ_CST);
+    }
+
+    if (pfd[1].revents & POLLOUT) {
+      res = amqp_flush(state);
+      if (res < 0)
+	goto fail;
+    }
+
+    if (!amqp_wants_read(state) || (pfd[1].revents & ~POLLOUT)) {
+      res = read_incoming(p);
+      if (res < 0)
+	goto fail;
+    }
+
+    res = amqp_heartbeat_tick(state);
+    if (res < 0)
+      goto fail;
+  }
+
+  return NULL;
+
+ fail:
+  set_status(p, res);
+  return NULL;
+}
+
+static int set_nonblocking_fd(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+
+  return 0;
+}
+
+amqp_publisher_t amqp_start_publisher(amqp_connection_state_t state)
+{
+  amqp_publisher_t p = calloc(1, sizeof(*p));
+
+  if (p == NULL)
+    return NULL;
+
+  p->state = state;
+  p->head = &p->stub;
+  p->tail = &p->stub;
+
+  if (pipe(p->wake_fds) < 0) {
+    free(p);
+    return NULL;
+  }
+
+  if (set_nonblocking_fd(p->wake_fds[0]) < 0
+      || set_nonblocking_fd(p->wake_fds[1]) < 0)
+    goto fail;
+
+  p->was_nonblocking = state->nonblocking;
+  if (amqp_set_nonblocking(state, 1) < 0)
+    goto fail;
+
+  if (pthread_create(&p->thread, NULL, publisher_thread, p) != 0) {
+    amqp_set_nonblocking(state, p->was_nonblocking);
+    goto fail;
+  }
+
+  return p;
+
+ fail:
+  close(p->wake_fds[0]);
+  close(p->wake_fds[1]);
+  free(p);
+  return NULL;
+}
+
+/* Encodes the message's frames into msg's trailing data, which has
+   room for header_room bytes of method and content header frames
+   followed by the body frames. */
+static int encode_message(amqp_publish_msg_t *msg,
+			  size_t header_room,
+			  size_t frame_max,
+			  amqp_channel_t channel,
+			  amqp_basic_publish_t *m,
+			  amqp_basic_properties_t const *properties,
+			  amqp_bytes_t body)
+{
+  size_t usable_body_payload_size = frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t offset = 0, start, body_offset;
+  amqp_bytes_t out;
+  uint8_t *data = (uint8_t *) (msg + 1);
+  int res;
+
+  out.bytes = data;
+  out.len = header_room;
+
+  res = amqp_encode_basic_publish_frame(out, &offset, channel, m);
+  if (res < 0)
+    return res;
+  if (offset > frame_max)
+    return -ERROR_BAD_AMQP_DATA;
+
+  start = offset;
+  res = amqp_encode_basic_header_frame(out, &offset, channel, body.len,
+				       properties);
+  if (res < 0)
+    return res;
+  if (offset - start > frame_max)
+    return -ERROR_BAD_AMQP_DATA;
+
+  msg->frames = 2;
+
+  for (body_offset = 0; body_offset < body.len; ) {
+    size_t fragment_len = body.len - body_offset;
+
+    if (fragment_len > usable_body_payload_size)
+      fragment_len = usable_body_payload_size;
+
+    amqp_e8(data, offset, AMQP_FRAME_BODY);
+    amqp_e16(data, offset + 1, channel);
+    amqp_e32(data, offset + 3, fragment_len);
+    memcpy(data + offset + HEADER_SIZE,
+	   amqp_offset(body.bytes, body_offset), fragment_len);
+    offset += HEADER_SIZE + fragment_len;
+    amqp_e8(data, offset, AMQP_FRAME_END);
+    offset += FOOTER_SIZE;
+
+    body_offset += fragment_len;
+    msg->frames++;
+  }
+
+  msg->len = offset;
+  return 0;
+}
+
+int amqp_publisher_publish(amqp_publisher_t p,
+			   amqp_channel_t channel,
+			   amqp_bytes_t exchange,
+			   amqp_bytes_t routing_key,
+			   amqp_boolean_t mandatory,
+			   amqp_boolean_t immediate,
+			   amqp_basic_properties_t const *properties,
+			   amqp_bytes_t body)
+{
+  size_t frame_max = p->state->frame_max;
+  size_t usable_body_payload_size = frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t body_frames = (body.len + usable_body_payload_size - 1)
+    / usable_body_payload_size;
+  size_t body_room = body.len + body_frames * (HEADER_SIZE + FOOTER_SIZE);
+  size_t header_room = INITIAL_HEADER_ROOM;
+  amqp_basic_properties_t default_properties;
+  amqp_basic_publish_t m;
+  amqp_publish_msg_t *msg;
+  int res;
+
+  res = __atomic_load_n(&p->status, __ATOMIC_SEQ_CST);
+  if (res < 0)
+    return res;
+
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  for (;;) {
+    msg = malloc(sizeof(*msg) + header_room + body_room);
+    if (msg == NULL)
+      return -ERROR_NO_MEMORY;
+
+    res = encode_message(msg, header_room, frame_max, channel,
+			 &m, properties, body);
+    if (res == 0)
+      break;
+
+    free(msg);
+
+    /* Both frames must fit in frame_max, so beyond twice that the
+       failure can't be for lack of room */
+    if (res != -ERROR_BAD_AMQP_DATA || header_room >= 2 * frame_max)
+      return res;
+
+    header_room *= 4;
+  }
+
+  push(p, msg);
+
+  if (__atomic_load_n(&p->sleeping, __ATOMIC_SEQ_CST))
+    wake(p);
+
+  return 0;
+}
+
+int amqp_stop_publisher(amqp_publisher_t p)
+{
+  return amqp_stop_publisher_timeout(p, NULL);
+}
+
+int amqp_stop_publisher_timeout(amqp_publisher_t p, struct timeval *timeout)
+{
+  amqp_publish_msg_t *msg;
+  int res;
+
+  if (timeout != NULL)
+    p->stop_deadline = amqp_get_monotonic_ms()
+      + (uint64_t)timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+  __atomic_store_n(&p->stopping, 1, __ATOMIC_SEQ_CST);
+  wake(p);
+  pthread_join(p->thread, NULL);
+
+  /* Whatever is left could not be sent */
+  while ((msg = pop(p)) != NULL)
+    free(msg);
+
+  close(p->wake_fds[0]);
+  close(p->wake_fds[1]);
+
+  res = amqp_set_nonblocking(p->state, p->was_nonblocking);
+  if (p->status < 0)
+    res = p->status;
+
+  free(p);
+  return res;
+}
+
+#else
+
+amqp_publisher_t amqp_start_publisher(amqp_connection_state_t state)
+{
+  (void) state;
+  return NULL;
+}
+
+int amqp_publisher_publish(amqp_publisher_t p,
+			   amqp_channel_t channel,
+			   amqp_bytes_t exchange,
+			   amqp_bytes_t routing_key,
+			   amqp_boolean_t mandatory,
+			   amqp_boolean_t immediate,
+			   amqp_basic_properties_t const *properties,
+			   amqp_bytes_t body)
+{
+  (void) p;
+  (void) channel;
+  (void) exchange;
+  (void) routing_key;
+  (void) mandatory;
+  (void) immediate;
+  (void) properties;
+  (void) body;
+  return -ERROR_NOT_SUPPORTED;
+}
+
+int amqp_stop_publisher(amqp_publisher_t p)
+{
+  (void) p;
+  return -ERROR_NOT_SUPPORTED;
+}
+
+int amqp_stop_publisher_timeout(amqp_publisher_t p, struct timeval *timeout)
+{
+  (void) p;
+  (void) timeout;
+  return -ERROR_NOT_SUPPORTED;
+}
+
+#endif
@@ -42,8 +42,90 @@
 #include <stdarg.h>
 #include <assert.h>
 
-int amqp_open_socket(char const *hostname,
-		     int portnumber)
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+/* Converts a timeout into a deadline on the amqp_get_monotonic_ms
+   clock. A NULL timeout means no deadline, which is represented by 0. */
+static uint64_t timeout_deadline(struct timeval *timeout)
+{
+  if (timeout == NULL)
+    return 0;
+
+  return amqp_get_monotonic_ms() + (uint64_t)timeout->tv_sec * 1000
+    + timeout->tv_usec / 1000;
+}
+
+static uint64_t rpc_deadline(amqp_connection_state_t state)
+{
+  if (state->rpc_timeout < 0)
+    return 0;
+
+  return amqp_get_monotonic_ms() + state->rpc_timeout;
+}
+
+/* Waits for the socket to become readable or writable, failing with
+   ERROR_TIMEOUT if the deadline (if any) passes first. */
+static int wait_socket(int sockfd, int for_write, uint64_t deadline)
+{
+  int timeout = -1;
+  int res;
+
+  if (deadline != 0) {
+    uint64_t now = amqp_get_monotonic_ms();
+    timeout = (now >= deadline) ? 0 : (int)(deadline - now);
+  }
+
+  res = amqp_socket_wait(sockfd, for_write, timeout);
+  if (res < 0)
+    return -amqp_socket_error();
+  if (res == 0)
+    return -ERROR_TIMEOUT;
+
+  return 0;
+}
+
+/* Connects the socket, giving up once the deadline (if any) passes */
+static int connect_socket(int sockfd, struct addrinfo *addr,
+			  uint64_t deadline)
+{
+  int res;
+
+  if (deadline == 0) {
+    if (connect(sockfd, addr->ai_addr, addr->ai_addrlen) != 0)
+      return -amqp_socket_error();
+
+    return 0;
+  }
+
+  if (amqp_socket_set_nonblocking(sockfd, 1) < 0)
+    return -amqp_socket_error();
+
+  if (connect(sockfd, addr->ai_addr, addr->ai_addrlen) != 0) {
+    if (!amqp_socket_connect_in_progress())
+      return -amqp_socket_error();
+
+    res = wait_socket(sockfd, 1, deadline);
+    if (res < 0)
+      return res;
+
+    res = amqp_socket_pending_error(sockfd);
+    if (res < 0)
+      return -amqp_socket_error();
+    if (res > 0)
+      return -(res | ERROR_CATEGORY_OS);
+  }
+
+  if (amqp_socket_set_nonblocking(sockfd, 0) < 0)
+    return -amqp_socket_error();
+
+  return 0;
+}
+
+static int open_socket(char const *hostname,
+		       int portnumber,
+		       uint64_t deadline)
 {
   struct addrinfo hint;
   struct addrinfo *address_list;
@@ -90,13 +172,17 @@ int amqp_open_socket(char const *hostname,
       continue;
     }
 #endif /* DISABLE_SIGPIPE_WITH_SETSOCKOPT */
-    if (0 != amqp_socket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))
-        || 0 != connect(sockfd, addr->ai_addr, addr->ai_addrlen))
+    if (0 != amqp_socket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
     {
       last_error = -amqp_socket_error();
       amqp_socket_close(sockfd);
       continue;
     }
+    if (0 != (last_error = connect_socket(sockfd, addr, deadline)))
+    {
+      amqp_socket_close(sockfd);
+      continue;
+    }
     else
     {
       last_error = 0;
@@ -113,12 +199,37 @@ int amqp_open_socket(char const *hostname,
   return sockfd;
 }
 
+int amqp_open_socket(char const *hostname,
+		     int portnumber)
+{
+  return open_socket(hostname, portnumber, 0);
+}
+
+int amqp_open_socket_timeout(char const *hostname,
+			     int portnumber,
+			     struct timeval *timeout)
+{
+  return open_socket(hostname, portnumber, timeout_deadline(timeout));
+}
+
 int amqp_send_header(amqp_connection_state_t state) {
   static const uint8_t header[8] = { 'A', 'M', 'Q', 'P', 0,
 				     AMQP_PROTOCOL_VERSION_MAJOR,
 				     AMQP_PROTOCOL_VERSION_MINOR,
 				     AMQP_PROTOCOL_VERSION_REVISION };
-  return send(state->sockfd, (void *)header, 8, MSG_NOSIGNAL);
+  struct iovec iov;
+  int res;
+
+  iov.iov_base = (void *)header;
+  iov.iov_len = 8;
+  res = amqp_send_iov(state, &iov, 1, 0, 0);
+  if (res < 0)
+    return res;
+
+  /* Callers have always been given the number of bytes sent. In
+     non-blocking mode the header may only be queued, but it is
+     accepted whole and will go out ahead of anything sent after it. */
+  return sizeof(header);
 }
 
 static amqp_bytes_t sasl_method_name(amqp_sasl_method_enum method) {
@@ -183,71 +294,606 @@ amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state) {
   return (state->sock_inbound_offset < state->sock_inbound_limit);
 }
 
+/* When the heartbeat next needs attention: either a heartbeat is due
+   to be sent, or the broker will have been silent for too long. */
+static uint64_t heartbeat_deadline(amqp_connection_state_t state)
+{
+  uint64_t interval = (uint64_t)state->heartbeat * 1000;
+  uint64_t send_due = state->last_send + interval;
+  uint64_t recv_due = state->last_recv + 2 * interval;
+
+  return send_due < recv_due ? send_due : recv_due;
+}
+
+int amqp_heartbeat_timeout(amqp_connection_state_t state)
+{
+  uint64_t now, deadline;
+  int timeout, acks;
+
+  /* Held-back acks are sent on the same tick */
+  acks = amqp_coalesced_acks_timeout(state);
+  if (state->heartbeat == 0)
+    return acks;
+
+  now = amqp_get_monotonic_ms();
+  deadline = heartbeat_deadline(state);
+  timeout = now >= deadline ? 0 : (int)(deadline - now);
+  return acks >= 0 && acks < timeout ? acks : timeout;
+}
+
+int amqp_heartbeat_tick(amqp_connection_state_t state)
+{
+  uint64_t now, interval;
+  int res;
+
+  if (state->ack_batches != NULL) {
+    res = amqp_flush_due_acks(state);
+    if (res < 0)
+      return res;
+  }
+
+  if (state->heartbeat == 0)
+    return 0;
+
+  now = amqp_get_monotonic_ms();
+  interval = (uint64_t)state->heartbeat * 1000;
+
+  /* The spec allows the peer to miss two heartbeats */
+  if (now >= state->last_recv + 2 * interval)
+    return -ERROR_HEARTBEAT_TIMEOUT;
+
+  if (now >= state->last_send + interval) {
+    amqp_frame_t heartbeat;
+
+    heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+    heartbeat.channel = 0;
+    return amqp_send_frame(state, &heartbeat);
+  }
+
+  return 0;
+}
+
+/* Waits for the socket to become readable, sending heartbeats while
+   it does. */
+static int wait_readable(amqp_connection_state_t state, uint64_t deadline)
+{
+  while (1) {
+    uint64_t until = deadline;
+    int res;
+
+    if (state->heartbeat > 0) {
+      uint64_t heartbeat = heartbeat_deadline(state);
+      if (until == 0 || heartbeat < until)
+	until = heartbeat;
+    }
+
+    res = wait_socket(state->sockfd, 0, until);
+    if (res != -ERROR_TIMEOUT)
+      return res;
+
+    if (deadline != 0 && amqp_get_monotonic_ms() >= deadline)
+      return -ERROR_TIMEOUT;
+
+    res = amqp_heartbeat_tick(state);
+    if (res < 0)
+      return res;
+  }
+}
+
+/* Writes out all pending output, waiting for the socket to accept it
+   if the connection is non-blocking. */
+static int flush_all(amqp_connection_state_t state, uint64_t deadline)
+{
+  while (1) {
+    int res = amqp_flush(state);
+    if (res < 0)
+      return res;
+
+    if (!amqp_wants_write(state))
+      return 0;
+
+    res = wait_socket(state->sockfd, 1, deadline);
+    if (res < 0)
+      return res;
+  }
+}
+
+/* Reads until a complete frame has been decoded. If block is not set
+   and the connection is non-blocking, it instead returns with a
+   frame_type of 0 once the socket has no more data to give. A
+   non-zero deadline limits how long it waits for data. */
 static int wait_frame_inner(amqp_connection_state_t state,
-			    amqp_frame_t *decoded_frame)
+			    amqp_frame_t *decoded_frame,
+			    amqp_boolean_t block,
+			    uint64_t deadline)
 {
   while (1) {
     int res;
+    size_t start;
 
     while (amqp_data_in_buffer(state)) {
-      amqp_bytes_t buffer;
-      buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
-      buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
-
-      res = amqp_handle_input(state, buffer, decoded_frame);
+      res = amqp_handle_sock_input(state, decoded_frame);
       if (res < 0)
 	return res;
 
-      state->sock_inbound_offset += res;
-
       if (decoded_frame->frame_type != 0)
 	/* Complete frame was read. Return it. */
 	return 0;
 
       /* Incomplete or ignored frame. Keep processing input. */
-      assert(res != 0);
     }
 
-    res = recv(state->sockfd, state->sock_inbound_buffer.bytes,
-		  state->sock_inbound_buffer.len, 0);
+    /* Before going to the socket for more, send the acknowledgements
+       held back so far: the broker may be waiting on them to deliver
+       anything further. */
+    if (state->ack_batches != NULL) {
+      res = amqp_flush_coalesced_acks(state);
+      if (res < 0)
+	return res;
+    }
+
+    if (!state->sock_inbound_pinned) {
+      start = 0;
+    } else {
+      /* Frames decoded in place still refer to the buffer, so read
+	 into whatever space follows them. Once that runs low, carry
+	 on in a fresh buffer from the frame_pool. */
+      start = state->sock_inbound_limit;
+      if (state->sock_inbound_buffer.len - start < AMQP_FRAME_MIN_SIZE) {
+	void *buffer = amqp_pool_alloc(&state->frame_pool,
+				       state->sock_inbound_buffer.len);
+	if (buffer == NULL)
+	  return -ERROR_NO_MEMORY;
+
+	state->sock_inbound_buffer.bytes = buffer;
+	state->sock_inbound_pinned = 0;
+	start = 0;
+      }
+    }
+
+#ifdef HAVE_IO_URING
+    if (state->uring != NULL && !state->nonblocking && deadline == 0
+	&& state->heartbeat == 0 && state->rpc_timeout < 0) {
+      /* The ring sends any pending output along with the read. */
+      res = amqp_uring_recv(state,
+			    amqp_offset(state->sock_inbound_buffer.bytes, start),
+			    state->sock_inbound_buffer.len - start);
+    } else
+#endif
+    {
+      /* Anything still sitting in the outbound batch has to reach the
+	 broker before we block waiting for its reply. */
+      res = block ? flush_all(state, deadline) : amqp_flush(state);
+      if (res < 0)
+	return res;
+
+      /* A blocking socket has to be polled, to give up in time and
+	 to keep the heartbeat going */
+      if ((deadline != 0 || state->heartbeat > 0) && !state->nonblocking) {
+	res = wait_readable(state, deadline);
+	if (res < 0)
+	  return res;
+      }
+
+      res = recv(state->sockfd,
+		 amqp_offset(state->sock_inbound_buffer.bytes, start),
+		 state->sock_inbound_buffer.len - start, 0);
+    }
+
     if (res <= 0) {
       if (res == 0)
 	return -ERROR_CONNECTION_CLOSED;
-      else
+
+      if (!state->nonblocking || !amqp_socket_would_block())
 	return -amqp_socket_error();
+
+      if (!block) {
+	decoded_frame->frame_type = 0;
+	return 0;
+      }
+
+      res = wait_readable(state, deadline);
+      if (res < 0)
+	return res;
+
+      continue;
     }
 
-    state->sock_inbound_limit = res;
-    state->sock_inbound_offset = 0;
+    if (state->heartbeat > 0)
+      state->last_recv = amqp_get_monotonic_ms();
+
+    state->sock_inbound_offset = start;
+    state->sock_inbound_limit = start + res;
   }
 }
 
-int amqp_simple_wait_frame(amqp_connection_state_t state,
-			   amqp_frame_t *decoded_frame)
+/* Like wait_frame_inner, but deals with any publisher confirms that
+   arrive rather than returning them. */
+static int wait_frame(amqp_connection_state_t state,
+		      amqp_frame_t *decoded_frame,
+		      amqp_boolean_t block,
+		      uint64_t deadline)
+{
+  int res;
+
+  while (1) {
+    res = wait_frame_inner(state, decoded_frame, block, deadline);
+    if (res < 0 || decoded_frame->frame_type == 0)
+      return res;
+
+    res = amqp_handle_confirm(state, decoded_frame);
+    if (res <= 0)
+      return res;
+  }
+}
+
+/* The queue for a channel, which is created if create is set. */
+static amqp_channel_queue_t *channel_queue(amqp_connection_state_t state,
+					   amqp_channel_t channel,
+					   amqp_boolean_t create)
+{
+  if (channel >= state->num_channel_queues) {
+    amqp_channel_queue_t *queues;
+    int num = state->num_channel_queues ? state->num_channel_queues : 16;
+
+    if (!create)
+      return NULL;
+
+    while (num <= channel)
+      num *= 2;
+
+    queues = realloc(state->channel_queues,
+		     num * sizeof(amqp_channel_queue_t));
+    if (queues == NULL)
+      return NULL;
+
+    memset(queues + state->num_channel_queues, 0,
+	   (num - state->num_channel_queues) * sizeof(amqp_channel_queue_t));
+    state->channel_queues = queues;
+    state->num_channel_queues = num;
+  }
+
+  return &state->channel_queues[channel];
+}
+
+/* Keeps a frame aside to be returned by a later amqp_simple_wait_frame,
+   either after the frames already queued or, with at_head set, before
+   them. */
+static int enqueue_frame(amqp_connection_state_t state,
+			 amqp_frame_t const *frame,
+			 amqp_boolean_t at_head)
+{
+  amqp_channel_queue_t *queue = channel_queue(state, frame->channel, 1);
+  amqp_queued_frame_t *qf = amqp_pool_alloc(&state->decoding_pool,
+					    sizeof(amqp_queued_frame_t));
+
+  if (queue == NULL || qf == NULL)
+    return -ERROR_NO_MEMORY;
+
+  qf->frame = *frame;
+
+  if (at_head) {
+    qf->prev = NULL;
+    qf->next = state->first_queued_frame;
+    if (qf->next != NULL)
+      qf->next->prev = qf;
+    else
+      state->last_queued_frame = qf;
+    state->first_queued_frame = qf;
+
+    qf->next_on_channel = queue->first;
+    queue->first = qf;
+    if (queue->last == NULL)
+      queue->last = qf;
+  } else {
+    qf->next = NULL;
+    qf->prev = state->last_queued_frame;
+    if (qf->prev != NULL)
+      qf->prev->next = qf;
+    else
+      state->first_queued_frame = qf;
+    state->last_queued_frame = qf;
+
+    qf->next_on_channel = NULL;
+    if (queue->last != NULL)
+      queue->last->next_on_channel = qf;
+    else
+      queue->first = qf;
+    queue->last = qf;
+  }
+
+  return 0;
+}
+
+/* Removes a frame from the queue. prev_on_channel is the frame before
+   it in its channel's queue, or NULL if it is the first there. */
+static void take_queued_frame(amqp_connection_state_t state,
+			      amqp_queued_frame_t *qf,
+			      amqp_queued_frame_t *prev_on_channel,
+			      amqp_frame_t *decoded_frame)
+{
+  amqp_channel_queue_t *queue = &state->channel_queues[qf->frame.channel];
+
+  if (qf->prev != NULL)
+    qf->prev->next = qf->next;
+  else
+    state->first_queued_frame = qf->next;
+  if (qf->next != NULL)
+    qf->next->prev = qf->prev;
+  else
+    state->last_queued_frame = qf->prev;
+
+  if (prev_on_channel != NULL)
+    prev_on_channel->next_on_channel = qf->next_on_channel;
+  else
+    queue->first = qf->next_on_channel;
+  if (queue->last == qf)
+    queue->last = prev_on_channel;
+
+  *decoded_frame = qf->frame;
+}
+
+static int simple_wait_frame(amqp_connection_state_t state,
+			     amqp_frame_t *decoded_frame,
+			     amqp_boolean_t block,
+			     uint64_t deadline)
 {
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    /* The oldest frame is necessarily first on its channel, too */
+    take_queued_frame(state, state->first_queued_frame, NULL, decoded_frame);
     return 0;
   } else {
-    return wait_frame_inner(state, decoded_frame);
+    return wait_frame(state, decoded_frame, block, deadline);
   }
 }
 
-int amqp_simple_wait_method(amqp_connection_state_t state,
-			    amqp_channel_t expected_channel,
-			    amqp_method_number_t expected_method,
-			    amqp_method_t *output)
+int amqp_simple_wait_frame(amqp_connection_state_t state,
+			   amqp_frame_t *decoded_frame)
+{
+  return simple_wait_frame(state, decoded_frame, !state->nonblocking, 0);
+}
+
+int amqp_simple_wait_frame_timeout(amqp_connection_state_t state,
+				   amqp_frame_t *decoded_frame,
+				   struct timeval *timeout)
+{
+  if (timeout == NULL)
+    return amqp_simple_wait_frame(state, decoded_frame);
+
+  return simple_wait_frame(state, decoded_frame, 1,
+			   timeout_deadline(timeout));
+}
+
+/* Returns the next frame for the given channel, taking it from the
+   queue if one is there. Frames for other channels are queued. */
+static int wait_channel_frame(amqp_connection_state_t state,
+			      amqp_channel_t channel,
+			      amqp_frame_t *decoded_frame,
+			      uint64_t deadline)
+{
+  amqp_channel_queue_t *queue = channel_queue(state, channel, 0);
+  int res;
+
+  if (queue != NULL && queue->first != NULL) {
+    take_queued_frame(state, queue->first, NULL, decoded_frame);
+    return 0;
+  }
+
+  while (1) {
+    res = wait_frame(state, decoded_frame, 1, deadline);
+    if (res < 0)
+      return res;
+
+    if (decoded_frame->frame_type == AMQP_FRAME_HEARTBEAT)
+      continue;
+
+    if (decoded_frame->channel == channel)
+      return 0;
+
+    res = enqueue_frame(state, decoded_frame, 0);
+    if (res < 0)
+      return res;
+  }
+}
+
+int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
+				      amqp_channel_t channel,
+				      amqp_frame_t *decoded_frame)
+{
+  return wait_channel_frame(state, channel, decoded_frame, 0);
+}
+
+int amqp_consume_message(amqp_connection_state_t state,
+			 amqp_envelope_t *envelope,
+			 struct timeval *timeout)
 {
+  uint64_t deadline = timeout_deadline(timeout);
+  amqp_basic_deliver_t *deliver;
   amqp_frame_t frame;
-  int res = amqp_simple_wait_frame(state, &frame);
+  uint64_t body_size;
+  size_t offset;
+  int res;
+
+  do {
+    res = simple_wait_frame(state, &frame, 1, deadline);
+    if (res < 0)
+      return res;
+  } while (frame.frame_type == AMQP_FRAME_HEARTBEAT);
+
+  if (frame.frame_type != AMQP_FRAME_METHOD
+      || frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
+    /* Leave it for the caller to deal with */
+    res = enqueue_frame(state, &frame, 1);
+    return res < 0 ? res : -ERROR_UNEXPECTED_FRAME;
+  }
+
+  deliver = frame.payload.method.decoded;
+  envelope->channel = frame.channel;
+  envelope->consumer_tag = deliver->consumer_tag;
+  envelope->delivery_tag = deliver->delivery_tag;
+  envelope->redelivered = deliver->redelivered;
+  envelope->exchange = deliver->exchange;
+  envelope->routing_key = deliver->routing_key;
+
+  res = wait_channel_frame(state, envelope->channel, &frame, deadline);
+  if (res < 0)
+    return res;
+
+  if (frame.frame_type != AMQP_FRAME_HEADER)
+    return -ERROR_BAD_AMQP_DATA;
+
+  envelope->properties = frame.payload.properties.decoded;
+  envelope->raw_properties = frame.payload.properties.raw;
+  body_size = frame.payload.properties.body_size;
+  if (body_size > SIZE_MAX)
+    return -ERROR_NO_MEMORY;
+
+  envelope->body.len = (size_t)body_size;
+  envelope->body.bytes = NULL;
+  if (body_size == 0)
+    return 0;
+
+  res = wait_channel_frame(state, envelope->channel, &frame, deadline);
+  if (res < 0)
+    return res;
+
+  if (frame.frame_type != AMQP_FRAME_BODY
+      || frame.payload.body_fragment.len > envelope->body.len)
+    return -ERROR_BAD_AMQP_DATA;
+
+  if (frame.payload.body_fragment.len == envelope->body.len) {
+    /* The common case: the body came in one frame, which is still
+       sitting in the inbound buffer */
+    envelope->body.bytes = frame.payload.body_fragment.bytes;
+    return 0;
+  }
+
+  envelope->body.bytes = amqp_pool_alloc(&state->decoding_pool,
+					 envelope->body.len);
+  if (envelope->body.bytes == NULL)
+    return -ERROR_NO_MEMORY;
+
+  offset = 0;
+  while (1) {
+    memcpy(amqp_offset(envelope->body.bytes, offset),
+	   frame.payload.body_fragment.bytes,
+	   frame.payload.body_fragment.len);
+    offset += frame.payload.body_fragment.len;
+    if (offset == envelope->body.len)
+      return 0;
+
+    res = wait_channel_frame(state, envelope->channel, &frame, deadline);
+    if (res < 0)
+      return res;
+
+    if (frame.frame_type != AMQP_FRAME_BODY
+	|| frame.payload.body_fragment.len > envelope->body.len - offset)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+}
+
+int amqp_envelope_properties(amqp_connection_state_t state,
+			     amqp_envelope_t *envelope)
+{
+  void *decoded;
+  int res;
+
+  if (envelope->properties != NULL)
+    return 0;
+
+  res = amqp_decode_properties(AMQP_BASIC_CLASS, &state->decoding_pool,
+			       envelope->raw_properties, &decoded);
   if (res < 0)
     return res;
 
+  envelope->properties = decoded;
+  return 0;
+}
+
+/* Reads frames until at most max_span publishes, counting from the
+   oldest unconfirmed one, are outstanding. */
+static int wait_confirms(amqp_connection_state_t state,
+			 amqp_confirm_t *confirm,
+			 uint64_t max_span,
+			 uint64_t deadline)
+{
+  amqp_frame_t frame;
+  int res;
+
+  while (confirm->next_tag - confirm->oldest_tag > max_span) {
+    res = wait_frame_inner(state, &frame, 1, deadline);
+    if (res < 0)
+      return res;
+
+    res = amqp_handle_confirm(state, &frame);
+    if (res < 0)
+      return res;
+
+    if (res > 0 || frame.frame_type == AMQP_FRAME_HEARTBEAT)
+      continue;
+
+    res = enqueue_frame(state, &frame, 0);
+    if (res < 0)
+      return res;
+
+    /* Confirms won't be coming if the channel or connection has been
+       closed; leave the close for the caller to find */
+    if (frame.frame_type == AMQP_FRAME_METHOD
+	&& ((frame.channel == confirm->channel
+	     && frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)
+	    || (frame.channel == 0
+		&& frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD)))
+      return -ERROR_UNEXPECTED_FRAME;
+  }
+
+  return 0;
+}
+
+int amqp_wait_confirms(amqp_connection_state_t state,
+		       amqp_confirm_t *confirm,
+		       int max_outstanding)
+{
+  return wait_confirms(state, confirm, (uint64_t)max_outstanding,
+		       rpc_deadline(state));
+}
+
+int amqp_wait_for_confirms(amqp_connection_state_t state,
+			   amqp_channel_t channel,
+			   struct timeval *timeout)
+{
+  amqp_confirm_t *confirm = amqp_find_confirm(state, channel);
+  int res;
+
+  if (confirm == NULL)
+    return -ERROR_NOT_SUPPORTED;
+
+  res = wait_confirms(state, confirm, 0, timeout_deadline(timeout));
+  if (res < 0)
+    return res;
+
+  if (confirm->nacked) {
+    confirm->nacked = 0;
+    return -ERROR_PUBLISH_NACKED;
+  }
+
+  return 0;
+}
+
+static int simple_wait_method(amqp_connection_state_t state,
+			      amqp_channel_t expected_channel,
+			      amqp_method_number_t expected_method,
+			      amqp_method_t *output,
+			      uint64_t deadline)
+{
+  amqp_frame_t frame;
+  int res;
+
+  do {
+    res = simple_wait_frame(state, &frame, 1, deadline);
+    if (res < 0)
+      return res;
+  } while (frame.frame_type == AMQP_FRAME_HEARTBEAT);
+
   if (frame.channel != expected_channel)
     amqp_abort("Expected 0x%08X method frame on channel %d, got frame on channel %d",
 	       expected_method,
@@ -267,6 +913,15 @@ int amqp_simple_wait_method(amqp_connection_state_t state,
   return 0;
 }
 
+int amqp_simple_wait_method(amqp_connection_state_t state,
+			    amqp_channel_t expected_channel,
+			    amqp_method_number_t expected_method,
+			    amqp_method_t *output)
+{
+  return simple_wait_method(state, expected_channel, expected_method,
+			    output, rpc_deadline(state));
+}
+
 int amqp_send_method(amqp_connection_state_t state,
 		     amqp_channel_t channel,
 		     amqp_method_number_t id,
@@ -290,11 +945,66 @@ static int amqp_id_in_reply_list( amqp_method_number_t expected, amqp_method_num
   return 0;
 }
 
-amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
-				 amqp_channel_t channel,
-				 amqp_method_number_t request_id,
-				 amqp_method_number_t *expected_reply_ids,
-				 void *decoded_request_method)
+/*
+ * Whether a frame answers a request on the given channel, namely a
+ * method frame that is either
+ *  - on the channel we want, and of the expected type, or
+ *  - on the channel we want, and a channel.close frame, or
+ *  - on channel zero, and a connection.close frame.
+ */
+static int is_rpc_reply(amqp_frame_t const *frame,
+			amqp_channel_t channel,
+			amqp_method_number_t *expected_reply_ids)
+{
+  return (frame->frame_type == AMQP_FRAME_METHOD) &&
+	 (   ((frame->channel == channel) &&
+	      ((amqp_id_in_reply_list(frame->payload.method.id, expected_reply_ids)) ||
+	       (frame->payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)))
+	  ||
+	     ((frame->channel == 0) &&
+	      (frame->payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))   );
+}
+
+/* Takes the reply to a request on the given channel from the queue,
+   if it is there, looking only at the frames for that channel and for
+   channel zero. */
+static int take_rpc_reply(amqp_connection_state_t state,
+			  amqp_channel_t channel,
+			  amqp_method_number_t *expected_reply_ids,
+			  amqp_frame_t *decoded_frame)
+{
+  amqp_channel_t channels[2];
+  int i;
+
+  channels[0] = channel;
+  channels[1] = 0;
+
+  for (i = 0; i < (channel == 0 ? 1 : 2); i++) {
+    amqp_channel_queue_t *queue = channel_queue(state, channels[i], 0);
+    amqp_queued_frame_t *prev = NULL;
+    amqp_queued_frame_t *qf;
+
+    if (queue == NULL)
+      continue;
+
+    for (qf = queue->first; qf != NULL; qf = qf->next_on_channel) {
+      if (is_rpc_reply(&qf->frame, channel, expected_reply_ids)) {
+	take_queued_frame(state, qf, prev, decoded_frame);
+	return 1;
+      }
+      prev = qf;
+    }
+  }
+
+  return 0;
+}
+
+static amqp_rpc_reply_t simple_rpc(amqp_connection_state_t state,
+				   amqp_channel_t channel,
+				   amqp_method_number_t request_id,
+				   amqp_method_number_t *expected_reply_ids,
+				   void *decoded_request_method,
+				   uint64_t deadline)
 {
   int status;
   amqp_rpc_reply_t result;
@@ -312,50 +1022,27 @@ amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
     amqp_frame_t frame;
 
   retry:
-    status = wait_frame_inner(state, &frame);
+    status = wait_frame(state, &frame, 1, deadline);
     if (status < 0) {
       result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       result.library_error = -status;
       return result;
     }
 
-    /*
-     * We store the frame for later processing unless it's something
-     * that directly affects us here, namely a method frame that is
-     * either
-     *  - on the channel we want, and of the expected type, or
-     *  - on the channel we want, and a channel.close frame, or
-     *  - on channel zero, and a connection.close frame.
-     */
-    if (!( (frame.frame_type == AMQP_FRAME_METHOD) &&
-	   (   ((frame.channel == channel) &&
-		((amqp_id_in_reply_list(frame.payload.method.id, expected_reply_ids)) ||
-		 (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)))
-	    ||
-	       ((frame.channel == 0) &&
-		(frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))   ) ))
-    {
-      amqp_frame_t *frame_copy = amqp_pool_alloc(&state->decoding_pool, sizeof(amqp_frame_t));
-      amqp_link_t *link = amqp_pool_alloc(&state->decoding_pool, sizeof(amqp_link_t));
+    /* Heartbeats have done their job just by arriving */
+    if (frame.frame_type == AMQP_FRAME_HEARTBEAT)
+      goto retry;
 
-      if (frame_copy == NULL || link == NULL) {
+    /* We store the frame for later processing unless it's the reply */
+    if (!is_rpc_reply(&frame, channel, expected_reply_ids))
+    {
+      status = enqueue_frame(state, &frame, 0);
+      if (status < 0) {
 	result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-	result.library_error = ERROR_NO_MEMORY;
+	result.library_error = -status;
 	return result;
       }
 
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-	state->first_queued_frame = link;
-      } else {
-	state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
@@ -368,6 +1055,16 @@ amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
   }
 }
 
+amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
+				 amqp_channel_t channel,
+				 amqp_method_number_t request_id,
+				 amqp_method_number_t *expected_reply_ids,
+				 void *decoded_request_method)
+{
+  return simple_rpc(state, channel, request_id, expected_reply_ids,
+		    decoded_request_method, rpc_deadline(state));
+}
+
 void *amqp_simple_rpc_decoded(amqp_connection_state_t state,
 			      amqp_channel_t channel,
 			      amqp_method_number_t request_id,
@@ -388,6 +1085,152 @@ void *amqp_simple_rpc_decoded(amqp_connection_state_t state,
     return NULL;
 }
 
+int amqp_simple_rpc_send(amqp_connection_state_t state,
+			 amqp_channel_t channel,
+			 amqp_method_number_t request_id,
+			 amqp_method_number_t *expected_reply_ids,
+			 void *decoded_request_method)
+{
+  amqp_pending_rpc_t *pending;
+  amqp_frame_t frame;
+  int i, res;
+
+  if (state->pending_rpc_tail == state->pending_rpc_capacity) {
+    if (state->pending_rpc_head > 0) {
+      /* Reuse the space left by replies already collected */
+      memmove(state->pending_rpcs,
+	      state->pending_rpcs + state->pending_rpc_head,
+	      (state->pending_rpc_tail - state->pending_rpc_head)
+	      * sizeof(amqp_pending_rpc_t));
+      state->pending_rpc_tail -= state->pending_rpc_head;
+      state->pending_rpc_head = 0;
+    } else {
+      int capacity = state->pending_rpc_capacity ?
+	state->pending_rpc_capacity * 2 : 16;
+      void *newbuf = realloc(state->pending_rpcs,
+			     capacity * sizeof(amqp_pending_rpc_t));
+      if (newbuf == NULL)
+	return -ERROR_NO_MEMORY;
+
+      state->pending_rpcs = newbuf;
+      state->pending_rpc_capacity = capacity;
+    }
+  }
+
+  pending = &state->pending_rpcs[state->pending_rpc_tail];
+  pending->channel = channel;
+  pending->failed = 0;
+  for (i = 0; expected_reply_ids[i] != 0; i++) {
+    if (i == AMQP_RPC_MAX_REPLIES)
+      return -ERROR_NOT_SUPPORTED;
+    pending->reply_ids[i] = expected_reply_ids[i];
+  }
+  pending->reply_ids[i] = 0;
+
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = channel;
+  frame.payload.method.id = request_id;
+  frame.payload.method.decoded = decoded_request_method;
+  res = amqp_send_frame_batch(state, &frame);
+  if (res < 0)
+    return res;
+
+  state->pending_rpc_tail++;
+  return 0;
+}
+
+/* The broker answered a pipelined request by closing its channel, or
+   the whole connection. It discards the requests still outstanding
+   there, so they will never be answered: fail them instead. */
+static void fail_pending_rpcs(amqp_connection_state_t state,
+			      amqp_frame_t const *close)
+{
+  int i;
+
+  for (i = state->pending_rpc_head; i < state->pending_rpc_tail; i++) {
+    amqp_pending_rpc_t *pending = &state->pending_rpcs[i];
+
+    if (pending->failed != 0)
+      continue;
+
+    if (close->payload.method.id == AMQP_CONNECTION_CLOSE_METHOD)
+      pending->failed = ERROR_CONNECTION_CLOSED;
+    else if (pending->channel == close->channel)
+      pending->failed = ERROR_CHANNEL_CLOSED;
+  }
+}
+
+amqp_rpc_reply_t amqp_simple_rpc_collect(amqp_connection_state_t state)
+{
+  uint64_t deadline = rpc_deadline(state);
+  amqp_pending_rpc_t pending;
+  amqp_rpc_reply_t result;
+  amqp_frame_t frame;
+  int status;
+
+  memset(&result, 0, sizeof(result));
+
+  if (state->pending_rpc_head == state->pending_rpc_tail) {
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = ERROR_NOT_SUPPORTED;
+    return result;
+  }
+
+  pending = state->pending_rpcs[state->pending_rpc_head++];
+  if (state->pending_rpc_head == state->pending_rpc_tail)
+    state->pending_rpc_head = state->pending_rpc_tail = 0;
+
+  if (pending.failed != 0) {
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = pending.failed;
+    state->most_recent_api_result = result;
+    return result;
+  }
+
+  /* The reply may have arrived while an earlier one was awaited */
+  if (take_rpc_reply(state, pending.channel, pending.reply_ids, &frame))
+    goto done;
+
+  while (1) {
+    status = wait_frame(state, &frame, 1, deadline);
+    if (status < 0) {
+      result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      result.library_error = -status;
+      return result;
+    }
+
+    if (frame.frame_type == AMQP_FRAME_HEARTBEAT)
+      continue;
+
+    if (is_rpc_reply(&frame, pending.channel, pending.reply_ids))
+      break;
+
+    status = enqueue_frame(state, &frame, 0);
+    if (status < 0) {
+      result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      result.library_error = -status;
+      return result;
+    }
+  }
+
+ done:
+  result.reply_type = (amqp_id_in_reply_list(frame.payload.method.id, pending.reply_ids))
+    ? AMQP_RESPONSE_NORMAL
+    : AMQP_RESPONSE_SERVER_EXCEPTION;
+
+  if (result.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION)
+    fail_pending_rpcs(state, &frame);
+
+  result.reply = frame.payload.method;
+  state->most_recent_api_result = result;
+  return result;
+}
+
+int amqp_simple_rpc_outstanding(amqp_connection_state_t state)
+{
+  return state->pending_rpc_tail - state->pending_rpc_head;
+}
+
 amqp_rpc_reply_t amqp_get_rpc_reply(amqp_connection_state_t state)
 {
   return state->most_recent_api_result;
@@ -399,7 +1242,8 @@ static int amqp_login_inner(amqp_connection_state_t state,
 			    int frame_max,
 			    int heartbeat,
 			    amqp_sasl_method_enum sasl_method,
-			    va_list vl)
+			    va_list vl,
+			    uint64_t deadline)
 {
   int res;
   amqp_method_t method;
@@ -409,8 +1253,8 @@ static int amqp_login_inner(amqp_connection_state_t state,
 
   amqp_send_header(state);
 
-  res = amqp_simple_wait_method(state, 0, AMQP_CONNECTION_START_METHOD,
-				&method);
+  res = simple_wait_method(state, 0, AMQP_CONNECTION_START_METHOD,
+			   &method, deadline);
   if (res < 0)
     return res;
 
@@ -459,8 +1303,8 @@ static int amqp_login_inner(amqp_connection_state_t state,
 
   amqp_release_buffers(state);
 
-  res = amqp_simple_wait_method(state, 0, AMQP_CONNECTION_TUNE_METHOD,
-				&method);
+  res = simple_wait_method(state, 0, AMQP_CONNECTION_TUNE_METHOD,
+			   &method, deadline);
   if (res < 0)
     return res;
 
@@ -511,10 +1355,12 @@ amqp_rpc_reply_t amqp_login(amqp_connection_state_t state,
   va_list vl;
   amqp_rpc_reply_t result;
   int status;
+  /* The whole handshake shares one deadline */
+  uint64_t deadline = rpc_deadline(state);
 
   va_start(vl, sasl_method);
 
-  status = amqp_login_inner(state, channel_max, frame_max, heartbeat, sasl_method, vl);
+  status = amqp_login_inner(state, channel_max, frame_max, heartbeat, sasl_method, vl, deadline);
   if (status < 0) {
     result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
     result.reply.id = 0;
@@ -531,11 +1377,12 @@ amqp_rpc_reply_t amqp_login(amqp_connection_state_t state,
     s.capabilities.bytes = NULL;
     s.insist = 1;
 
-    result = amqp_simple_rpc(state,
-			     0,
-			     AMQP_CONNECTION_OPEN_METHOD,
-			     (amqp_method_number_t *) &replies,
-			     &s);
+    result = simple_rpc(state,
+			0,
+			AMQP_CONNECTION_OPEN_METHOD,
+			(amqp_method_number_t *) &replies,
+			&s,
+			deadline);
     if (result.reply_type != AMQP_RESPONSE_NORMAL)
       return result;
   }
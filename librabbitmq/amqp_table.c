@@ -41,9 +41,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define INITIAL_ARRAY_SIZE 16
-#define INITIAL_TABLE_SIZE 16
-
 static int amqp_decode_field_value(amqp_bytes_t encoded,
 				   amqp_pool_t *pool,
 				   amqp_field_value_t *entry,
@@ -55,6 +52,71 @@ static int amqp_encode_field_value(amqp_bytes_t encoded,
 
 /*---------------------------------------------------------------------------*/
 
+/* Steps over a field value without decoding it. Tables and arrays
+   are counted this way before being decoded, so that their entries
+   can go straight into a block of the right size from the pool. */
+static int amqp_skip_field_value(amqp_bytes_t encoded, size_t *offset)
+{
+  uint8_t kind;
+  uint32_t len;
+  size_t size;
+
+  if (!amqp_decode_8(encoded, offset, &kind))
+    return 0;
+
+  switch (kind) {
+  case AMQP_FIELD_KIND_BOOLEAN:
+  case AMQP_FIELD_KIND_I8:
+  case AMQP_FIELD_KIND_U8:
+    size = 1;
+    break;
+
+  case AMQP_FIELD_KIND_I16:
+  case AMQP_FIELD_KIND_U16:
+    size = 2;
+    break;
+
+  case AMQP_FIELD_KIND_I32:
+  case AMQP_FIELD_KIND_U32:
+  case AMQP_FIELD_KIND_F32:
+    size = 4;
+    break;
+
+  case AMQP_FIELD_KIND_I64:
+  case AMQP_FIELD_KIND_U64:
+  case AMQP_FIELD_KIND_F64:
+  case AMQP_FIELD_KIND_TIMESTAMP:
+    size = 8;
+    break;
+
+  case AMQP_FIELD_KIND_DECIMAL:
+    size = 5;
+    break;
+
+  case AMQP_FIELD_KIND_UTF8:
+  case AMQP_FIELD_KIND_BYTES:
+  case AMQP_FIELD_KIND_ARRAY:
+  case AMQP_FIELD_KIND_TABLE:
+    if (!amqp_decode_32(encoded, offset, &len))
+      return 0;
+    size = len;
+    break;
+
+  case AMQP_FIELD_KIND_VOID:
+    size = 0;
+    break;
+
+  default:
+    return 0;
+  }
+
+  if (size > encoded.len - *offset)
+    return 0;
+
+  *offset += size;
+  return 1;
+}
+
 static int amqp_decode_array(amqp_bytes_t encoded,
 			     amqp_pool_t *pool,
 			     amqp_array_t *output,
@@ -62,52 +124,37 @@ static int amqp_decode_array(amqp_bytes_t encoded,
 {
   uint32_t arraysize;
   int num_entries = 0;
-  int allocated_entries = INITIAL_ARRAY_SIZE;
   amqp_field_value_t *entries;
-  size_t limit;
-  int res;
+  size_t start, limit;
+  int i, res;
 
   if (!amqp_decode_32(encoded, offset, &arraysize))
     return -ERROR_BAD_AMQP_DATA;
 
-  entries = malloc(allocated_entries * sizeof(amqp_field_value_t));
-  if (entries == NULL)
-    return -ERROR_NO_MEMORY;
-
-  limit = *offset + arraysize;
+  start = *offset;
+  limit = start + arraysize;
   while (*offset < limit) {
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_field_value_t));
-      res = -ERROR_NO_MEMORY;
-      if (newentries == NULL)
-	goto out;
-
-      entries = newentries;
-    }
-
-    res = amqp_decode_field_value(encoded, pool, &entries[num_entries],
-				  offset);
-    if (res < 0)
-      goto out;
+    if (!amqp_skip_field_value(encoded, offset))
+      return -ERROR_BAD_AMQP_DATA;
 
     num_entries++;
   }
 
-  output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
-  res = -ERROR_NO_MEMORY;
+  entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
   /* NULL is legitimate if we requested a zero-length block. */
-  if (output->entries == NULL && num_entries > 0)
-    goto out;
+  if (entries == NULL && num_entries > 0)
+    return -ERROR_NO_MEMORY;
 
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_field_value_t));
-  res = 0;
+  *offset = start;
+  for (i = 0; i < num_entries; i++) {
+    res = amqp_decode_field_value(encoded, pool, &entries[i], offset);
+    if (res < 0)
+      return res;
+  }
 
- out:
-  free(entries);
-  return res;
+  output->num_entries = num_entries;
+  output->entries = entries;
+  return 0;
 }
 
 int amqp_decode_table(amqp_bytes_t encoded,
@@ -118,61 +165,49 @@ int amqp_decode_table(amqp_bytes_t encoded,
   uint32_t tablesize;
   int num_entries = 0;
   amqp_table_entry_t *entries;
-  int allocated_entries = INITIAL_TABLE_SIZE;
-  size_t limit;
-  int res;
+  size_t start, limit;
+  int i, res;
 
   if (!amqp_decode_32(encoded, offset, &tablesize))
     return -ERROR_BAD_AMQP_DATA;
 
-  entries = malloc(allocated_entries * sizeof(amqp_table_entry_t));
-  if (entries == NULL)
-    return -ERROR_NO_MEMORY;
-
-  limit = *offset + tablesize;
+  start = *offset;
+  limit = start + tablesize;
   while (*offset < limit) {
     uint8_t keylen;
 
-    res = -ERROR_BAD_AMQP_DATA;
-    if (!amqp_decode_8(encoded, offset, &keylen))
-      goto out;
-
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_table_entry_t));
-      res = -ERROR_NO_MEMORY;
-      if (newentries == NULL)
-	goto out;
+    if (!amqp_decode_8(encoded, offset, &keylen)
+	|| keylen > encoded.len - *offset)
+      return -ERROR_BAD_AMQP_DATA;
 
-      entries = newentries;
-    }
-
-    res = -ERROR_BAD_AMQP_DATA;
-    if (!amqp_decode_bytes(encoded, offset, &entries[num_entries].key, keylen))
-      goto out;
-
-    res = amqp_decode_field_value(encoded, pool, &entries[num_entries].value,
-				  offset);
-    if (res < 0)
-      goto out;
+    *offset += keylen;
+    if (!amqp_skip_field_value(encoded, offset))
+      return -ERROR_BAD_AMQP_DATA;
 
     num_entries++;
   }
 
-  output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
-  res = -ERROR_NO_MEMORY;
+  entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
   /* NULL is legitimate if we requested a zero-length block. */
-  if (output->entries == NULL && num_entries > 0)
-    goto out;
+  if (entries == NULL && num_entries > 0)
+    return -ERROR_NO_MEMORY;
 
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_table_entry_t));
-  res = 0;
+  *offset = start;
+  for (i = 0; i < num_entries; i++) {
+    uint8_t keylen;
 
- out:
-  free(entries);
-  return res;
+    if (!amqp_decode_8(encoded, offset, &keylen)
+	|| !amqp_decode_bytes(encoded, offset, &entries[i].key, keylen))
+      return -ERROR_BAD_AMQP_DATA;
+
+    res = amqp_decode_field_value(encoded, pool, &entries[i].value, offset);
+    if (res < 0)
+      return res;
+  }
+
+  output->num_entries = num_entries;
+  output->entries = entries;
+  return 0;
 }
 
 static int amqp_decode_field_value(amqp_bytes_t encoded,
@@ -295,6 +330,14 @@ int amqp_encode_table(amqp_bytes_t encoded,
   size_t start = *offset;
   int i, res;
 
+  if (input->num_entries == AMQP_ENCODED_TABLE) {
+    /* Written by an amqp_table_writer_t; the size is already there */
+    if (!amqp_encode_bytes(encoded, offset, input->entries->key))
+      return -ERROR_BAD_AMQP_DATA;
+
+    return 0;
+  }
+
   *offset += 4; /* size of the table gets filled in later on */
 
   for (i = 0; i < input->num_entries; i++) {
@@ -422,3 +465,277 @@ int amqp_table_entry_cmp(void const *entry1, void const *entry2) {
 
   return p1->key.len - p2->key.len;
 }
+
+amqp_field_value_t *amqp_table_get(amqp_table_t const *table,
+				   amqp_bytes_t key)
+{
+  int i;
+
+  for (i = 0; i < table->num_entries; i++) {
+    amqp_table_entry_t *entry = &table->entries[i];
+
+    if (entry->key.len == key.len
+	&& memcmp(entry->key.bytes, key.bytes, key.len) == 0)
+      return &entry->value;
+  }
+
+  return NULL;
+}
+
+/* An open-addressed hash table of entry numbers, with at least twice
+   as many slots as the table has entries */
+struct amqp_table_index_t_ {
+  amqp_table_t const *table;
+  uint32_t mask;
+  /* entry number plus one, or 0 for an empty slot */
+  int slots[1];
+};
+
+static uint32_t hash_key(amqp_bytes_t key)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < key.len; i++) {
+    h ^= ((uint8_t *) key.bytes)[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+amqp_table_index_t *amqp_index_table(amqp_pool_t *pool,
+				     amqp_table_t const *table)
+{
+  amqp_table_index_t *index;
+  uint32_t nslots = 4;
+  int i;
+
+  /* The entries of a table from a writer are already encoded */
+  if (table->num_entries == AMQP_ENCODED_TABLE)
+    return NULL;
+
+  if (table->num_entries > 0)
+    while (nslots < 2 * (uint32_t) table->num_entries)
+      nslots *= 2;
+
+  index = amqp_pool_alloc(pool, sizeof(amqp_table_index_t)
+			  + (nslots - 1) * sizeof(int));
+  if (index == NULL)
+    return NULL;
+
+  index->table = table;
+  index->mask = nslots - 1;
+  memset(index->slots, 0, nslots * sizeof(int));
+
+  /* Entries go in in order, so that with linear probing a lookup
+     finds the first of several entries with the same key, as
+     amqp_table_get does */
+  for (i = 0; i < table->num_entries; i++) {
+    uint32_t slot = hash_key(table->entries[i].key) & index->mask;
+
+    while (index->slots[slot] != 0)
+      slot = (slot + 1) & index->mask;
+
+    index->slots[slot] = i + 1;
+  }
+
+  return index;
+}
+
+amqp_field_value_t *amqp_table_index_get(amqp_table_index_t const *index,
+					 amqp_bytes_t key)
+{
+  uint32_t slot = hash_key(key) & index->mask;
+
+  while (index->slots[slot] != 0) {
+    amqp_table_entry_t *entry = &index->table->entries[index->slots[slot] - 1];
+
+    if (entry->key.len == key.len
+	&& memcmp(entry->key.bytes, key.bytes, key.len) == 0)
+      return &entry->value;
+
+    slot = (slot + 1) & index->mask;
+  }
+
+  return NULL;
+}
+
+static int writer_fail(amqp_table_writer_t *w, int res)
+{
+  if (w->error == 0)
+    w->error = res;
+
+  return w->error;
+}
+
+/* Writes the key of the next entry, unless it is going into an
+   array */
+static int writer_key(amqp_table_writer_t *w, amqp_bytes_t key)
+{
+  if (w->error != 0)
+    return w->error;
+
+  /* Nothing more can go in once the table has been finished */
+  if (w->depth == 0)
+    return writer_fail(w, -ERROR_BAD_AMQP_DATA);
+
+  if (w->in_array[w->depth - 1])
+    return 0;
+
+  if (key.len > UINT8_MAX
+      || !amqp_encode_8(w->buffer, &w->offset, (uint8_t) key.len)
+      || !amqp_encode_bytes(w->buffer, &w->offset, key))
+    return writer_fail(w, -ERROR_BAD_AMQP_DATA);
+
+  return 0;
+}
+
+/* Starts a table or array whose size is filled in when it ends */
+static void writer_open(amqp_table_writer_t *w, amqp_boolean_t is_array)
+{
+  if (w->depth == AMQP_TABLE_WRITER_MAX_DEPTH) {
+    writer_fail(w, -ERROR_NOT_SUPPORTED);
+    return;
+  }
+
+  w->starts[w->depth] = w->offset;
+  w->in_array[w->depth] = is_array;
+  w->depth++;
+
+  if (!amqp_encode_32(w->buffer, &w->offset, 0))
+    writer_fail(w, -ERROR_BAD_AMQP_DATA);
+}
+
+static void writer_close(amqp_table_writer_t *w)
+{
+  size_t start;
+
+  w->depth--;
+  start = w->starts[w->depth];
+  if (!amqp_encode_32(w->buffer, &start, w->offset - start - 4))
+    writer_fail(w, -ERROR_BAD_AMQP_DATA);
+}
+
+void amqp_table_writer_init(amqp_table_writer_t *w, amqp_bytes_t buffer)
+{
+  w->buffer = buffer;
+  w->offset = 0;
+  w->error = 0;
+  w->depth = 0;
+  writer_open(w, 0);
+}
+
+int amqp_table_add(amqp_table_writer_t *w, amqp_bytes_t key,
+		   amqp_field_value_t const *value)
+{
+  int res = writer_key(w, key);
+
+  if (res < 0)
+    return res;
+
+  res = amqp_encode_field_value(w->buffer, (amqp_field_value_t *) value,
+				&w->offset);
+  if (res < 0)
+    return writer_fail(w, res);
+
+  return 0;
+}
+
+int amqp_table_add_utf8(amqp_table_writer_t *w, amqp_bytes_t key,
+			amqp_bytes_t value)
+{
+  amqp_field_value_t v;
+
+  v.kind = AMQP_FIELD_KIND_UTF8;
+  v.value.bytes = value;
+  return amqp_table_add(w, key, &v);
+}
+
+int amqp_table_add_i32(amqp_table_writer_t *w, amqp_bytes_t key,
+		       int32_t value)
+{
+  amqp_field_value_t v;
+
+  v.kind = AMQP_FIELD_KIND_I32;
+  v.value.i32 = value;
+  return amqp_table_add(w, key, &v);
+}
+
+int amqp_table_add_i64(amqp_table_writer_t *w, amqp_bytes_t key,
+		       int64_t value)
+{
+  amqp_field_value_t v;
+
+  v.kind = AMQP_FIELD_KIND_I64;
+  v.value.i64 = value;
+  return amqp_table_add(w, key, &v);
+}
+
+int amqp_table_add_boolean(amqp_table_writer_t *w, amqp_bytes_t key,
+			   amqp_boolean_t value)
+{
+  amqp_field_value_t v;
+
+  v.kind = AMQP_FIELD_KIND_BOOLEAN;
+  v.value.boolean = value;
+  return amqp_table_add(w, key, &v);
+}
+
+static int begin_nested(amqp_table_writer_t *w, amqp_bytes_t key,
+			uint8_t kind)
+{
+  int res = writer_key(w, key);
+
+  if (res < 0)
+    return res;
+
+  if (!amqp_encode_8(w->buffer, &w->offset, kind))
+    return writer_fail(w, -ERROR_BAD_AMQP_DATA);
+
+  writer_open(w, kind == AMQP_FIELD_KIND_ARRAY);
+  return w->error;
+}
+
+int amqp_table_begin_table(amqp_table_writer_t *w, amqp_bytes_t key)
+{
+  return begin_nested(w, key, AMQP_FIELD_KIND_TABLE);
+}
+
+int amqp_table_begin_array(amqp_table_writer_t *w, amqp_bytes_t key)
+{
+  return begin_nested(w, key, AMQP_FIELD_KIND_ARRAY);
+}
+
+int amqp_table_end(amqp_table_writer_t *w)
+{
+  if (w->error != 0)
+    return w->error;
+
+  /* The outermost table is closed by amqp_table_writer_finish */
+  if (w->depth < 2)
+    return writer_fail(w, -ERROR_BAD_AMQP_DATA);
+
+  writer_close(w);
+  return w->error;
+}
+
+int amqp_table_writer_finish(amqp_table_writer_t *w, amqp_table_t *table)
+{
+  if (w->error != 0)
+    return w->error;
+
+  if (w->depth != 1)
+    return writer_fail(w, -ERROR_BAD_AMQP_DATA);
+
+  writer_close(w);
+  if (w->error != 0)
+    return w->error;
+
+  w->encoded.key.bytes = w->buffer.bytes;
+  w->encoded.key.len = w->offset;
+  table->num_entries = AMQP_ENCODED_TABLE;
+  table->entries = &w->encoded;
+  return 0;
+}
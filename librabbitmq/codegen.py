@@ -106,6 +106,35 @@ class BitEncoder(object):
             self.flush()
 
 
+class FastBitEncoder(object):
+    """Like BitEncoder, but for the specialized frame encoders, which
+    write without bounds checks."""
+
+    def __init__(self, emitter):
+        self.emitter = emitter
+        self.bit = 0
+
+    def flush(self):
+        if self.bit:
+            self.emitter.emit("amqp_e8(encoded.bytes, o, bit_buffer);")
+            self.emitter.emit("o += 1;")
+            self.bit = 0
+
+    def emit(self, line):
+        self.flush()
+        self.emitter.emit(line)
+
+    def put_bit(self, value):
+        if self.bit == 0:
+            self.emitter.emit("bit_buffer = 0;")
+
+        self.emitter.emit("if (%s) bit_buffer |= (1 << %d);"
+                                                       % (value, self.bit))
+        self.bit += 1
+        if self.bit == 8:
+            self.flush()
+
+
 class SimpleType(object):
     """A AMQP type that corresponds to a simple scalar C value of a
     certain width."""
@@ -123,6 +152,13 @@ class SimpleType(object):
     def literal(self, value):
         return value
 
+    def size(self, value):
+        return "%d" % (self.bits / 8,)
+
+    def put(self, emitter, value):
+        emitter.emit("amqp_e%d(encoded.bytes, o, %s);" % (self.bits, value))
+        emitter.emit("o += %d;" % (self.bits / 8,))
+
 class StrType(object):
     """The AMQP shortstr or longstr types."""
 
@@ -149,6 +185,15 @@ class StrType(object):
 
         return "amqp_empty_bytes"
 
+    def size(self, value):
+        return "%d + %s.len" % (self.lenbits / 8, value)
+
+    def put(self, emitter, value):
+        emitter.emit("amqp_e%d(encoded.bytes, o, (uint%d_t) %s.len);" % (self.lenbits, self.lenbits, value))
+        emitter.emit("o += %d;" % (self.lenbits / 8,))
+        emitter.emit("memcpy(amqp_offset(encoded.bytes, o), %s.bytes, %s.len);" % (value, value))
+        emitter.emit("o += %s.len;" % (value,))
+
 class BitType(object):
     """The AMQP bit type."""
 
@@ -164,6 +209,9 @@ class BitType(object):
     def literal(self, value):
         return {True: 1, False: 0}[value]
 
+    def put(self, emitter, value):
+        emitter.put_bit(value)
+
 class TableType(object):
     """The AMQP table type."""
 
@@ -185,6 +233,16 @@ class TableType(object):
     def literal(self, value):
         raise NotImplementedError()
 
+    def size(self, value):
+        # only known once the table has been encoded
+        return None
+
+    def put(self, emitter, value):
+        emitter.emit("{")
+        emitter.emit("  int res = amqp_encode_table(encoded, (amqp_table_t *) &(%s), &o);" % (value,))
+        emitter.emit("  if (res < 0) return res;")
+        emitter.emit("}")
+
 types = {
     'octet': SimpleType(8),
     'short': SimpleType(16),
@@ -229,6 +287,12 @@ apiMethodInfo  = {
 # fields, and the fixed values to use for them.
 apiMethodsSuppressArgs = {"ticket": 0, "nowait": False}
 
+# Methods and classes that get a frame encoder of their own, for the
+# publishing fast path. These work out the size of the frame first, so
+# that they can then write it out without checking each field.
+fastEncodeMethods = ["basic.publish"]
+fastEncodeClasses = ["basic"]
+
 AmqpMethod.defName = lambda m: cConstantName(c_ize(m.klass.name) + '_' + c_ize(m.name) + "_method")
 AmqpMethod.fullName = lambda m: "amqp_%s_%s" % (c_ize(m.klass.name), c_ize(m.name))
 AmqpMethod.structName = lambda m: m.fullName() + "_t"
@@ -292,6 +356,8 @@ def genErl(spec):
         print "      %s *p = (%s *) amqp_pool_alloc(pool, sizeof(%s));" % \
               (c.structName(), c.structName(), c.structName())
         print "      if (p == NULL) { return -ERROR_NO_MEMORY; }"
+        print "      /* pool memory isn't zeroed; absent properties read as zero */"
+        print "      memset(p, 0, sizeof(%s));" % (c.structName(),)
         print "      p->_flags = flags;"
 
         emitter = Emitter("      ")
@@ -500,6 +566,131 @@ int amqp_encode_properties(uint16_t class_id,
   }
 }"""
 
+    def fieldSizes(fields, value, present):
+        """The C expressions for the encoded sizes of fields, other
+        than tables, in order; bits are packed into octets."""
+        sizes = []
+        bit = 0
+        for f in fields:
+            t = typeFor(spec, f)
+            if isinstance(t, BitType):
+                if bit == 0:
+                    sizes.append("1")
+                bit = (bit + 1) % 8
+                continue
+            bit = 0
+            size = t.size(value(f))
+            if size is not None:
+                sizes.append(present(f, size))
+        return sizes
+
+    def genShortStrChecks(fields, value, present):
+        checks = []
+        for f in fields:
+            t = typeFor(spec, f)
+            if isinstance(t, StrType) and t.lenbits == 8:
+                checks.append(present(f, "%s.len > UINT8_MAX" % (value(f),)))
+        if checks:
+            print "  if (%s)" % ("\n      || ".join(checks),)
+            print "    return -ERROR_BAD_AMQP_DATA;"
+            print
+
+    def genFastFields(fields, value, present, guard):
+        emitter = FastBitEncoder(Emitter("  "))
+        for i, f in enumerate(fields):
+            t = typeFor(spec, f)
+            field_emitter = emitter
+            if guard is not None:
+                emitter.emit("if (%s) {" % (guard(f),))
+                field_emitter = FastBitEncoder(Emitter("    "))
+            t.put(field_emitter, value(f))
+            if isinstance(t, TableType):
+                # what follows the table hasn't been accounted for yet
+                rest = fieldSizes(fields[i + 1:], value, present) + ["FOOTER_SIZE"]
+                field_emitter.emit("if (encoded.len - o < %s)" % ("\n        + ".join(rest),))
+                field_emitter.emit("  return -ERROR_BAD_AMQP_DATA;")
+            if guard is not None:
+                field_emitter.flush()
+                emitter.emit("}")
+        emitter.flush()
+
+    def genFrameEnd():
+        print "  amqp_e32(encoded.bytes, start + 3, (uint32_t) (o - start - HEADER_SIZE));"
+        print "  amqp_e8(encoded.bytes, o, AMQP_FRAME_END);"
+        print "  *offset = o + FOOTER_SIZE;"
+        print "  return 0;"
+        print "}"
+
+    def genFastEncodeMethod(m):
+        value = lambda f: "m->" + c_ize(f.name)
+        present = lambda f, expr: expr
+        argtypes = [typeFor(spec, f) for f in m.arguments]
+
+        print
+        print "int %s_frame(amqp_bytes_t encoded, size_t *offset," % (m.fullName().replace("amqp_", "amqp_encode_", 1),)
+        print "                 amqp_channel_t channel, %s const *m)" % (m.structName(),)
+        print "{"
+        print "  size_t start = *offset;"
+        print "  size_t o = start + HEADER_SIZE;"
+        if [t for t in argtypes if isinstance(t, BitType)]:
+            print "  uint8_t bit_buffer;"
+        print "  size_t size = %s;" % (" + ".join(["HEADER_SIZE", "4"] + fieldSizes(m.arguments, value, present) + ["FOOTER_SIZE"]),)
+        print
+        genShortStrChecks(m.arguments, value, present)
+        print "  if (start > encoded.len || encoded.len - start < size)"
+        print "    return -ERROR_BAD_AMQP_DATA;"
+        print
+        print "  amqp_e8(encoded.bytes, start, AMQP_FRAME_METHOD);"
+        print "  amqp_e16(encoded.bytes, start + 1, channel);"
+        print "  amqp_e32(encoded.bytes, o, %s);" % (m.defName(),)
+        print "  o += 4;"
+        genFastFields(m.arguments, value, present, None)
+        genFrameEnd()
+
+    def genFastEncodeHeader(c):
+        value = lambda f: "p->" + c_ize(f.name)
+        present = lambda f, expr: "((flags & %s) ? %s : 0)" % (cFlagName(c, f), expr)
+        present_check = lambda f, expr: "((flags & %s) && %s)" % (cFlagName(c, f), expr)
+        guard = lambda f: "flags & %s" % (cFlagName(c, f),)
+
+        if len(c.fields) > 15:
+            raise NotImplementedError("more than one property flag word")
+
+        print
+        print "int amqp_encode_%s_header_frame(amqp_bytes_t encoded, size_t *offset," % (c_ize(c.name),)
+        print "                 amqp_channel_t channel, uint64_t body_size,"
+        print "                 %s const *p)" % (c.structName(),)
+        print "{"
+        print "  size_t start = *offset;"
+        print "  size_t o = start + HEADER_SIZE;"
+        print "  amqp_flags_t flags = p->_flags;"
+        print "  size_t size = HEADER_SIZE + 14"
+        for size in fieldSizes(c.fields, value, present):
+            print "    + %s" % (size,)
+        print "    + FOOTER_SIZE;"
+        print
+        genShortStrChecks(c.fields, value, present_check)
+        print "  if (start > encoded.len || encoded.len - start < size)"
+        print "    return -ERROR_BAD_AMQP_DATA;"
+        print
+        print "  amqp_e8(encoded.bytes, start, AMQP_FRAME_HEADER);"
+        print "  amqp_e16(encoded.bytes, start + 1, channel);"
+        print "  amqp_e16(encoded.bytes, o, %d);" % (c.index,)
+        print "  amqp_e16(encoded.bytes, o + 2, 0); /* \"weight\" */"
+        print "  amqp_e64(encoded.bytes, o + 4, body_size);"
+        print "  amqp_e16(encoded.bytes, o + 12, (uint16_t) flags);"
+        print "  o += 14;"
+        genFastFields(c.fields, value, present, guard)
+        genFrameEnd()
+
+    for m in methods:
+        if "%s.%s" % (m.klass.name, m.name) in fastEncodeMethods:
+            genFastEncodeMethod(m)
+
+    for c in spec.allClasses():
+        if c.name in fastEncodeClasses:
+            genFastEncodeHeader(c)
+
     for m in methods:
         if not m.isSynchronous:
             continue
@@ -42,6 +42,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 int
@@ -77,6 +78,111 @@ int amqp_socket_socket(int domain, int type, int proto)
 	return s;
 }
 
+int
+amqp_socket_writev(int sock, struct iovec *iov, int nvecs)
+{
+	/* sendmsg() rather than writev(), so that MSG_NOSIGNAL applies */
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nvecs;
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+int
+amqp_socket_set_nonblocking(int sock, int nonblocking)
+{
+	int flags = fcntl(sock, F_GETFL);
+	if (flags == -1)
+		return -1;
+
+	if (nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(sock, F_SETFL, (long)flags);
+}
+
+int
+amqp_socket_would_block(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+int
+amqp_socket_set_send_timeout(int sock, int timeout)
+{
+	struct timeval tv;
+
+	/* A zero timeval turns the timeout off */
+	if (timeout < 0)
+		timeout = 0;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	return setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int
+amqp_socket_send_timed_out(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+int
+amqp_socket_wait(int sock, int for_write, int timeout)
+{
+	struct pollfd pfd;
+	uint64_t deadline = 0;
+	int res;
+
+	pfd.fd = sock;
+	pfd.events = for_write ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+
+	if (timeout > 0)
+		deadline = amqp_get_monotonic_ms() + timeout;
+
+	while ((res = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+		if (deadline != 0) {
+			uint64_t now = amqp_get_monotonic_ms();
+			timeout = now >= deadline ? 0 : (int)(deadline - now);
+		}
+	}
+
+	return res;
+}
+
+int
+amqp_socket_connect_in_progress(void)
+{
+	return errno == EINPROGRESS;
+}
+
+int
+amqp_socket_pending_error(int sock)
+{
+	int error;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		return -1;
+
+	return error;
+}
+
+uint64_t
+amqp_get_monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 char *amqp_os_error_string(int err)
 {
 	return strdup(strerror(err));
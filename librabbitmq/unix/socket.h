@@ -37,7 +37,9 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -51,9 +53,36 @@ amqp_socket_socket(int domain, int type, int proto);
 int
 amqp_socket_error(void);
 
+int
+amqp_socket_writev(int sock, struct iovec *iov, int nvecs);
+
+int
+amqp_socket_set_nonblocking(int sock, int nonblocking);
+
+int
+amqp_socket_would_block(void);
+
+int
+amqp_socket_set_send_timeout(int sock, int timeout);
+
+int
+amqp_socket_send_timed_out(void);
+
+int
+amqp_socket_wait(int sock, int for_write, int timeout);
+
+int
+amqp_socket_connect_in_progress(void);
+
+int
+amqp_socket_pending_error(int sock);
+
+uint64_t
+amqp_get_monotonic_ms(void);
+
 #define amqp_socket_setsockopt setsockopt
 #define amqp_socket_close close
-#define amqp_socket_writev writev
+#define amqp_socket_poll poll
 
 #ifndef MSG_NOSIGNAL
 # define MSG_NOSIGNAL 0x0
@@ -0,0 +1,445 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* A connection has at most a send and a recv in flight */
+#define URING_ENTRIES 4
+
+#define OP_SEND 1
+#define OP_RECV 2
+#define OP_WRITEV 3
+#define OP_CANCEL 4
+
+struct amqp_uring_t_ {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_queued;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  /* The inbound buffer registered as fixed buffer 0, if any */
+  void *fixed;
+  size_t fixed_len;
+
+  /* For the sendmsg operation in flight */
+  struct msghdr msg;
+  struct iovec send_iov;
+
+  /* A send of the pending output that amqp_uring_recv left in flight,
+     and the error from one that failed, to be reported by
+     amqp_uring_finish_send */
+  amqp_boolean_t sending;
+  int send_error;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void unmap_rings(amqp_uring_t *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED
+      && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+int amqp_uring_new(amqp_connection_state_t state)
+{
+  struct io_uring_params p;
+  amqp_uring_t *ring;
+  struct iovec fixed;
+  int e;
+
+  ring = calloc(1, sizeof(amqp_uring_t));
+  if (ring == NULL)
+    return -ERROR_NO_MEMORY;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = uring_setup(URING_ENTRIES, &p);
+  if (ring->fd < 0) {
+    e = errno;
+    free(ring);
+    return -(e | ERROR_CATEGORY_OS);
+  }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes
+    + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+  ring->sq_head = amqp_offset(ring->sq_ring, p.sq_off.head);
+  ring->sq_tail = amqp_offset(ring->sq_ring, p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)amqp_offset(ring->sq_ring, p.sq_off.ring_mask);
+  ring->sq_array = amqp_offset(ring->sq_ring, p.sq_off.array);
+  ring->cq_head = amqp_offset(ring->cq_ring, p.cq_off.head);
+  ring->cq_tail = amqp_offset(ring->cq_ring, p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)amqp_offset(ring->cq_ring, p.cq_off.ring_mask);
+  ring->cqes = amqp_offset(ring->cq_ring, p.cq_off.cqes);
+
+  /* Registering the inbound buffer saves the kernel mapping it on
+     every read. It counts against RLIMIT_MEMLOCK, so carry on
+     without it if that's too low. */
+  fixed.iov_base = state->sock_inbound_primary;
+  fixed.iov_len = state->sock_inbound_buffer.len;
+  if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &fixed, 1) == 0) {
+    ring->fixed = fixed.iov_base;
+    ring->fixed_len = fixed.iov_len;
+  }
+
+  state->uring = ring;
+  return 0;
+
+ fail:
+  e = errno;
+  unmap_rings(ring);
+  close(ring->fd);
+  free(ring);
+  return -(e | ERROR_CATEGORY_OS);
+}
+
+static struct io_uring_sqe *get_sqe(amqp_uring_t *ring);
+static int submit_and_wait(amqp_uring_t *ring, unsigned wait_nr);
+static int pop_cqe(amqp_uring_t *ring, uint64_t *user_data, int *res);
+
+void amqp_uring_destroy(amqp_uring_t *ring)
+{
+  if (ring == NULL)
+    return;
+
+  /* The kernel mustn't go on reading output that is about to be freed */
+  if (ring->sending) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_SEND;
+    sqe->user_data = OP_CANCEL;
+
+    while (ring->sending) {
+      uint64_t user_data;
+      int res;
+
+      if (submit_and_wait(ring, 1) < 0)
+	break;
+
+      while (pop_cqe(ring, &user_data, &res))
+	if (user_data == OP_SEND)
+	  ring->sending = 0;
+    }
+  }
+
+  unmap_rings(ring);
+  close(ring->fd);
+  free(ring);
+}
+
+/* Returns a cleared submission entry, to be published by the next
+   call to submit_and_wait. There is always room, as no more than
+   URING_ENTRIES operations are ever in flight. */
+static struct io_uring_sqe *get_sqe(amqp_uring_t *ring)
+{
+  unsigned index = (*ring->sq_tail + ring->sq_queued) & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_queued++;
+  return sqe;
+}
+
+static int submit_and_wait(amqp_uring_t *ring, unsigned wait_nr)
+{
+  unsigned to_submit = ring->sq_queued;
+  int res;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+		   __ATOMIC_RELEASE);
+  ring->sq_queued = 0;
+
+  /* The kernel may take fewer entries than it was offered, in which
+     case it doesn't wait; the rest stay in the ring, to be offered
+     again. */
+  while (1) {
+    res = uring_enter(ring->fd, to_submit, wait_nr);
+    if (res < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    if ((unsigned)res >= to_submit)
+      return 0;
+
+    if (res == 0) {
+      errno = EBUSY;
+      return -1;
+    }
+
+    to_submit -= res;
+  }
+}
+
+static int pop_cqe(amqp_uring_t *ring, uint64_t *user_data, int *res)
+{
+  unsigned head = *ring->cq_head;
+  struct io_uring_cqe *cqe;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  cqe = &ring->cqes[head & ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void queue_sendmsg(amqp_uring_t *ring, int fd,
+			  struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+
+  memset(&ring->msg, 0, sizeof(ring->msg));
+  ring->msg.msg_iov = iov;
+  ring->msg.msg_iovlen = iovcnt;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)&ring->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+/* Queues a send of the connection's pending output */
+static void queue_pending_output(amqp_connection_state_t state)
+{
+  amqp_uring_t *ring = state->uring;
+
+  ring->send_iov.iov_base = amqp_offset(state->sock_outbound_buffer.bytes,
+					state->sock_outbound_offset);
+  ring->send_iov.iov_len = state->sock_outbound_limit
+    - state->sock_outbound_offset;
+  queue_sendmsg(ring, state->sockfd, &ring->send_iov, 1, OP_SEND);
+  ring->sending = 1;
+}
+
+/* Accounts for a completed send of the pending output, and queues
+   the rest of it after a short send */
+static void send_completed(amqp_connection_state_t state, int res)
+{
+  amqp_uring_t *ring = state->uring;
+
+  ring->sending = 0;
+  if (res < 0) {
+    ring->send_error = -res;
+    return;
+  }
+
+  amqp_outbound_written(state, res);
+  if (ring->send_error == 0
+      && state->sock_outbound_offset < state->sock_outbound_limit)
+    queue_pending_output(state);
+}
+
+int amqp_uring_finish_send(amqp_connection_state_t state)
+{
+  amqp_uring_t *ring = state->uring;
+
+  while (ring->sending) {
+    uint64_t user_data;
+    int res;
+
+    if (submit_and_wait(ring, 1) < 0)
+      return -1;
+
+    while (pop_cqe(ring, &user_data, &res))
+      if (user_data == OP_SEND)
+	send_completed(state, res);
+  }
+
+  if (ring->send_error != 0) {
+    errno = ring->send_error;
+    ring->send_error = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+int amqp_uring_writev(amqp_connection_state_t state, struct iovec *iov,
+		      int iovcnt)
+{
+  amqp_uring_t *ring = state->uring;
+  uint64_t user_data;
+  int res;
+
+  if (amqp_uring_finish_send(state) < 0)
+    return -1;
+
+  queue_sendmsg(ring, state->sockfd, iov, iovcnt, OP_WRITEV);
+
+  do {
+    if (submit_and_wait(ring, 1) < 0)
+      return -1;
+  } while (!pop_cqe(ring, &user_data, &res));
+
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+
+  return res;
+}
+
+int amqp_uring_recv(amqp_connection_state_t state, void *buf, size_t len)
+{
+  amqp_uring_t *ring = state->uring;
+  struct io_uring_sqe *sqe;
+  amqp_boolean_t receiving = 1;
+  int received = 0;
+
+  if (amqp_uring_finish_send(state) < 0)
+    return -1;
+
+  if (state->sock_outbound_offset < state->sock_outbound_limit)
+    queue_pending_output(state);
+
+  sqe = get_sqe(ring);
+  sqe->fd = state->sockfd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->user_data = OP_RECV;
+  if (ring->fixed != NULL
+      && (char *)buf >= (char *)ring->fixed
+      && (char *)buf + len <= (char *)ring->fixed + ring->fixed_len) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = 0;
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+  }
+
+  /* Only the read is waited for. A send that is still going once it
+     completes (the broker may be waiting on us to read before it
+     reads in turn) is left in flight; amqp_uring_finish_send must be
+     called before the pending output is next touched. */
+  while (receiving) {
+    uint64_t user_data;
+    int res;
+
+    if (submit_and_wait(ring, 1) < 0)
+      return -1;
+
+    while (pop_cqe(ring, &user_data, &res)) {
+      if (user_data == OP_RECV) {
+	receiving = 0;
+	received = res;
+      } else if (user_data == OP_SEND) {
+	send_completed(state, res);
+      }
+    }
+  }
+
+  if (received < 0) {
+    errno = -received;
+    return -1;
+  }
+
+  return received;
+}
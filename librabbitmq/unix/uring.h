@@ -0,0 +1,71 @@
+#ifndef librabbitmq_unix_uring_h
+#define librabbitmq_unix_uring_h
+
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * An io_uring transport for a blocking connection. Writes are
+ * submitted as sendmsg operations; a read is submitted together with
+ * a send of whatever output is still pending, so that the usual
+ * flush-then-wait for a reply costs a single io_uring_enter call.
+ * Reads into the connection's own inbound buffer use it as a
+ * registered (fixed) buffer.
+ *
+ * Both calls behave like their socket counterparts: they return the
+ * number of bytes transferred, or -1 with errno set.
+ *
+ * The send that goes with a read may still be in flight when the read
+ * returns. amqp_uring_finish_send waits for it, and reports its error
+ * if it failed; it must be called before the pending output is
+ * changed or written some other way.
+ */
+
+typedef struct amqp_uring_t_ amqp_uring_t;
+
+int
+amqp_uring_new(amqp_connection_state_t state);
+
+void
+amqp_uring_destroy(amqp_uring_t *ring);
+
+int
+amqp_uring_writev(amqp_connection_state_t state, struct iovec *iov,
+		  int iovcnt);
+
+int
+amqp_uring_recv(amqp_connection_state_t state, void *buf, size_t len);
+
+int
+amqp_uring_finish_send(amqp_connection_state_t state);
+
+#endif
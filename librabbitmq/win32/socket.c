@@ -94,6 +94,78 @@ amqp_socket_writev(int sock, struct iovec *iov, int nvecs)
 		return -1;
 }
 
+int
+amqp_socket_set_nonblocking(int sock, int nonblocking)
+{
+	u_long mode = nonblocking ? 1 : 0;
+	return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1;
+}
+
+int
+amqp_socket_would_block(void)
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+int
+amqp_socket_set_send_timeout(int sock, int timeout)
+{
+	/* Zero turns the timeout off */
+	DWORD ms = timeout < 0 ? 0 : (DWORD)timeout;
+
+	return setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&ms,
+			  sizeof(ms));
+}
+
+int
+amqp_socket_send_timed_out(void)
+{
+	return WSAGetLastError() == WSAETIMEDOUT;
+}
+
+int
+amqp_socket_wait(int sock, int for_write, int timeout)
+{
+	fd_set fds;
+	struct timeval tv;
+	int res;
+
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	res = select(sock + 1, for_write ? NULL : &fds, for_write ? &fds : NULL,
+		     NULL, timeout < 0 ? NULL : &tv);
+	return res == SOCKET_ERROR ? -1 : res;
+}
+
+int
+amqp_socket_connect_in_progress(void)
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+int
+amqp_socket_pending_error(int sock)
+{
+	int error;
+	int len = sizeof(error);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len)
+	    == SOCKET_ERROR)
+		return -1;
+
+	return error;
+}
+
+uint64_t
+amqp_get_monotonic_ms(void)
+{
+	return GetTickCount64();
+}
+
 int
 amqp_socket_error(void)
 {
@@ -47,6 +47,7 @@ amqp_socket_init(void);
 
 #define amqp_socket_socket socket
 #define amqp_socket_close closesocket
+#define amqp_socket_poll WSAPoll
 
 int
 amqp_socket_setsockopt(int sock, int level, int optname, const void *optval,
@@ -55,6 +56,30 @@ amqp_socket_setsockopt(int sock, int level, int optname, const void *optval,
 int
 amqp_socket_writev(int sock, struct iovec *iov, int nvecs);
 
+int
+amqp_socket_set_nonblocking(int sock, int nonblocking);
+
+int
+amqp_socket_would_block(void);
+
+int
+amqp_socket_set_send_timeout(int sock, int timeout);
+
+int
+amqp_socket_send_timed_out(void);
+
+int
+amqp_socket_wait(int sock, int for_write, int timeout);
+
+int
+amqp_socket_connect_in_progress(void);
+
+int
+amqp_socket_pending_error(int sock);
+
+uint64_t
+amqp_get_monotonic_ms(void);
+
 int
 amqp_socket_error(void);
 
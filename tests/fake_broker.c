@@ -0,0 +1,210 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "fake_broker.h"
+
+void die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+uint8_t *put_u8(uint8_t *p, uint8_t v)
+{
+	*p++ = v;
+	return p;
+}
+
+uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+	p = put_u8(p, v >> 8);
+	return put_u8(p, v & 0xff);
+}
+
+uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+	p = put_u16(p, v >> 16);
+	return put_u16(p, v & 0xffff);
+}
+
+uint8_t *put_u64(uint8_t *p, uint64_t v)
+{
+	p = put_u32(p, (uint32_t)(v >> 32));
+	return put_u32(p, (uint32_t)v);
+}
+
+uint8_t *put_shortstr(uint8_t *p, const char *s)
+{
+	size_t len = strlen(s);
+	p = put_u8(p, (uint8_t)len);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+void expect_frame(amqp_connection_state_t peer, amqp_frame_t *frame,
+		  uint8_t frame_type, int channel)
+{
+	int res = amqp_simple_wait_frame(peer, frame);
+
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	if (frame->frame_type != frame_type)
+		die("expected frame type %d, got %d", frame_type,
+		    frame->frame_type);
+	if (channel != ANY_CHANNEL && frame->channel != channel)
+		die("expected a frame on channel %d, got one on %d", channel,
+		    frame->channel);
+}
+
+#ifndef _WIN32
+
+amqp_connection_state_t fake_connection(int *peer_fd)
+{
+	amqp_connection_state_t conn = amqp_new_connection();
+	int fds[2];
+
+	if (conn == NULL)
+		die("amqp_new_connection failed");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		die("socketpair failed");
+
+	amqp_set_sockfd(conn, fds[0]);
+	*peer_fd = fds[1];
+	return conn;
+}
+
+void connection_pair(amqp_connection_state_t *conn,
+		     amqp_connection_state_t *peer)
+{
+	int fd;
+
+	*conn = fake_connection(&fd);
+	*peer = amqp_new_connection();
+	if (*peer == NULL)
+		die("amqp_new_connection failed");
+
+	amqp_set_sockfd(*peer, fd);
+}
+
+void send_frame(int fd, uint8_t type, uint16_t channel,
+		const void *payload, size_t len)
+{
+	uint8_t *buf = malloc(len + 8);
+	uint8_t *p = buf;
+
+	if (buf == NULL)
+		die("out of memory");
+
+	p = put_u8(p, type);
+	p = put_u16(p, channel);
+	p = put_u32(p, (uint32_t)len);
+	memcpy(p, payload, len);
+	p = put_u8(p + len, AMQP_FRAME_END);
+
+	if (write(fd, buf, p - buf) != p - buf)
+		die("write to peer failed");
+
+	free(buf);
+}
+
+void send_method(int fd, uint16_t channel, amqp_method_number_t method,
+		 const uint8_t *args, size_t len)
+{
+	uint8_t payload[256];
+
+	if (len > sizeof(payload) - 4)
+		die("method arguments too long");
+
+	put_u32(payload, method);
+	if (len > 0)
+		memcpy(payload + 4, args, len);
+	send_frame(fd, AMQP_FRAME_METHOD, channel, payload, len + 4);
+}
+
+void send_deliver(int fd, uint16_t channel, const char *consumer_tag,
+		  uint64_t delivery_tag)
+{
+	uint8_t args[64];
+	uint8_t *p = args;
+
+	p = put_shortstr(p, consumer_tag);
+	p = put_u64(p, delivery_tag);
+	p = put_u8(p, 0);
+	p = put_shortstr(p, "ex");
+	p = put_shortstr(p, "rk");
+	send_method(fd, channel, AMQP_BASIC_DELIVER_METHOD, args, p - args);
+}
+
+void send_header(int fd, uint16_t channel, uint64_t body_size)
+{
+	uint8_t payload[64];
+	uint8_t *p = payload;
+
+	p = put_u16(p, AMQP_BASIC_CLASS);
+	p = put_u16(p, 0);
+	p = put_u64(p, body_size);
+	p = put_u16(p, 0);
+	send_frame(fd, AMQP_FRAME_HEADER, channel, payload, p - payload);
+}
+
+void send_body(int fd, uint16_t channel, const char *body)
+{
+	send_frame(fd, AMQP_FRAME_BODY, channel, body, strlen(body));
+}
+
+void expect_nothing(int fd)
+{
+	char c;
+
+	if (recv(fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) >= 0 || errno != EAGAIN)
+		die("unexpected output");
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#ifndef FAKE_BROKER_H
+#define FAKE_BROKER_H
+
+/*
+ * Helpers shared by the tests, most of them for tests that talk to a
+ * connection over a socketpair, playing the broker's part by writing
+ * frames by hand.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+void die(const char *fmt, ...);
+
+/* Each returns the position just after what it wrote */
+uint8_t *put_u8(uint8_t *p, uint8_t v);
+uint8_t *put_u16(uint8_t *p, uint16_t v);
+uint8_t *put_u32(uint8_t *p, uint32_t v);
+uint8_t *put_u64(uint8_t *p, uint64_t v);
+uint8_t *put_shortstr(uint8_t *p, const char *s);
+
+/* Passed to expect_frame for a frame on any channel */
+#define ANY_CHANNEL (-1)
+
+/* Reads the next frame, which must be of the given type and on the
+   given channel */
+void expect_frame(amqp_connection_state_t peer, amqp_frame_t *frame,
+		  uint8_t frame_type, int channel);
+
+/* The rest need a socketpair, which Windows doesn't have */
+#ifndef _WIN32
+
+/* A new connection whose socket is one end of a socketpair. The
+   other end is returned in peer_fd. */
+amqp_connection_state_t fake_connection(int *peer_fd);
+
+/* Two connections joined by a socketpair, for tests that read what
+   one sends by decoding it with the other */
+void connection_pair(amqp_connection_state_t *conn,
+		     amqp_connection_state_t *peer);
+
+void send_frame(int fd, uint8_t type, uint16_t channel,
+		const void *payload, size_t len);
+
+/* A method frame with the given encoded arguments */
+void send_method(int fd, uint16_t channel, amqp_method_number_t method,
+		 const uint8_t *args, size_t len);
+
+/* basic.deliver with exchange "ex" and routing key "rk" */
+void send_deliver(int fd, uint16_t channel, const char *consumer_tag,
+		  uint64_t delivery_tag);
+
+/* A basic content header with no properties */
+void send_header(int fd, uint16_t channel, uint64_t body_size);
+
+void send_body(int fd, uint16_t channel, const char *body);
+
+/* Checks that nothing has been written to fd */
+void expect_nothing(int fd);
+
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+static void ack(amqp_connection_state_t conn, uint64_t tag)
+{
+	int res = amqp_basic_ack(conn, 1, tag, 0);
+	if (res < 0)
+		die("amqp_basic_ack returned %d", res);
+}
+
+static void expect_ack(amqp_connection_state_t peer, uint64_t tag,
+		       amqp_boolean_t multiple)
+{
+	amqp_frame_t frame;
+	amqp_basic_ack_t *m;
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 1);
+	if (frame.payload.method.id != AMQP_BASIC_ACK_METHOD)
+		die("expected basic.ack");
+
+	m = frame.payload.method.decoded;
+	if (m->delivery_tag != tag || m->multiple != multiple)
+		die("expected ack of %d%s, got %d%s",
+		    (int)tag, multiple ? " (multiple)" : "",
+		    (int)m->delivery_tag, m->multiple ? " (multiple)" : "");
+}
+
+/* Acknowledges each delivery as the event loop hands it over */
+static void on_frame(amqp_connection_state_t state, amqp_frame_t const *frame,
+		     int status, void *data)
+{
+	int *delivered = data;
+
+	if (status < 0)
+		die("event loop callback got status %d", status);
+
+	if (frame->frame_type == AMQP_FRAME_METHOD
+	    && frame->payload.method.id == AMQP_BASIC_DELIVER_METHOD) {
+		amqp_basic_deliver_t *m = frame->payload.method.decoded;
+		ack(state, m->delivery_tag);
+		(*delivered)++;
+	}
+}
+
+static void deliver(amqp_connection_state_t peer, uint64_t tag)
+{
+	amqp_basic_deliver_t m;
+
+	memset(&m, 0, sizeof(m));
+	m.consumer_tag = amqp_cstring_bytes("ctag");
+	m.delivery_tag = tag;
+	m.exchange = amqp_cstring_bytes("ex");
+	m.routing_key = amqp_cstring_bytes("rk");
+	if (amqp_send_method(peer, 1, AMQP_BASIC_DELIVER_METHOD, &m) < 0)
+		die("amqp_send_method failed");
+}
+
+/* Reads the acks of a flushed batch, one each for the tags from first
+   to last in any order: those too far past the gap are queued as they
+   are made, the others when the batch is flushed */
+static void expect_acks(amqp_connection_state_t peer, uint64_t first,
+			uint64_t last)
+{
+	char seen[100];
+	uint64_t i;
+
+	memset(seen, 0, sizeof(seen));
+	for (i = first; i <= last; i++) {
+		amqp_frame_t frame;
+		amqp_basic_ack_t *m;
+
+		expect_frame(peer, &frame, AMQP_FRAME_METHOD, 1);
+		if (frame.payload.method.id != AMQP_BASIC_ACK_METHOD)
+			die("expected basic.ack");
+
+		m = frame.payload.method.decoded;
+		if (m->multiple || m->delivery_tag < first
+		    || m->delivery_tag > last
+		    || seen[m->delivery_tag - first]++)
+			die("unexpected ack of %d between %d and %d",
+			    (int)m->delivery_tag, (int)first, (int)last);
+	}
+
+	amqp_maybe_release_buffers(peer);
+}
+
+/* The first delivery stays unacknowledged while many more are acked,
+   well past the window of tags a batch can record. Each flush sends
+   only what was acked since the last one, and acks beyond the window
+   are still held back until the batch is due. */
+static void test_held_gap(void)
+{
+	amqp_connection_state_t conn, peer;
+	uint64_t last = 70001;
+	uint64_t tag;
+
+	connection_pair(&conn, &peer);
+	if (amqp_coalesce_acks(conn, 1, 100, 0) < 0)
+		die("amqp_coalesce_acks failed");
+
+	for (tag = 2; tag <= last; tag++) {
+		ack(conn, tag);
+
+		if ((tag - 1) % 100 == 99)
+			expect_nothing(amqp_get_sockfd(peer));
+		else if ((tag - 1) % 100 == 0)
+			expect_acks(peer, tag - 99, tag);
+	}
+
+	/* The gap closes with a single multiple ack */
+	ack(conn, 1);
+	amqp_flush_acks(conn, 1);
+	expect_ack(peer, 1, 1);
+	expect_nothing(amqp_get_sockfd(peer));
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+}
+
+int main(void)
+{
+	amqp_event_loop_t loop;
+	int delivered = 0;
+	amqp_connection_state_t conn, peer;
+	amqp_frame_t frame;
+	uint64_t tag;
+	int res;
+
+	connection_pair(&conn, &peer);
+
+	res = amqp_coalesce_acks(conn, 1, 100, 0);
+	if (res < 0)
+		die("amqp_coalesce_acks returned %d", res);
+
+	/* A contiguous run is held back, then sent as one multiple ack;
+	   the tags after a gap go one by one */
+	for (tag = 1; tag <= 10; tag++)
+		ack(conn, tag);
+	ack(conn, 12);
+	ack(conn, 13);
+	expect_nothing(amqp_get_sockfd(peer));
+
+	amqp_flush_acks(conn, 1);
+	expect_ack(peer, 10, 1);
+	expect_ack(peer, 12, 0);
+	expect_ack(peer, 13, 0);
+
+	/* Once the gap is filled, the run carries on past the tags already
+	   acknowledged, and past a rejected one */
+	ack(conn, 11);
+	ack(conn, 14);
+	amqp_basic_reject(conn, 1, 15, 0);
+	ack(conn, 16);
+	if (amqp_simple_wait_frame(peer, &frame) < 0
+	    || frame.payload.method.id != AMQP_BASIC_REJECT_METHOD)
+		die("expected basic.reject");
+
+	amqp_flush_acks(conn, 1);
+	expect_ack(peer, 16, 1);
+
+	/* The count threshold sends the batch by itself */
+	for (tag = 17; tag < 117; tag++)
+		ack(conn, tag);
+	expect_ack(peer, 116, 1);
+
+	/* So does going to the socket for more frames */
+	ack(conn, 117);
+	expect_nothing(amqp_get_sockfd(peer));
+	amqp_basic_ack(peer, 1, 1, 0);
+	res = amqp_simple_wait_frame(conn, &frame);
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	expect_ack(peer, 117, 1);
+
+	/* Turning coalescing off sends what was held back */
+	ack(conn, 118);
+	amqp_coalesce_acks(conn, 1, 0, 0);
+	expect_ack(peer, 118, 1);
+	ack(conn, 119);
+	expect_ack(peer, 119, 0);
+
+	/* max_delay runs on a timer, with no further ack to trigger it */
+	res = amqp_coalesce_acks(conn, 1, 100, 50);
+	if (res < 0)
+		die("amqp_coalesce_acks returned %d", res);
+	ack(conn, 120);
+	res = amqp_heartbeat_timeout(conn);
+	if (res < 0 || res > 50)
+		die("amqp_heartbeat_timeout returned %d with an ack held back",
+		    res);
+	if (amqp_heartbeat_tick(conn) < 0)
+		die("amqp_heartbeat_tick failed");
+	expect_nothing(amqp_get_sockfd(peer));
+	usleep(60 * 1000);
+	if (amqp_heartbeat_timeout(conn) != 0)
+		die("held-back ack should be due");
+	if (amqp_heartbeat_tick(conn) < 0)
+		die("amqp_heartbeat_tick failed");
+	expect_ack(peer, 120, 0);
+	if (amqp_heartbeat_timeout(conn) != -1)
+		die("nothing should be left to wait for");
+
+	/* The event loop sends what its callbacks acknowledged at the end
+	   of the pass, without waiting for another delivery */
+	res = amqp_coalesce_acks(conn, 1, 100, 0);
+	if (res < 0)
+		die("amqp_coalesce_acks returned %d", res);
+	loop = amqp_new_event_loop();
+	if (loop == NULL || amqp_event_loop_add(loop, conn, on_frame,
+						&delivered) < 0)
+		die("could not set up the event loop");
+	deliver(peer, 121);
+	deliver(peer, 122);
+	while (delivered < 2)
+		if (amqp_event_loop_run_once(loop, 1000) <= 0)
+			die("deliveries did not arrive");
+	expect_ack(peer, 121, 0);
+	expect_ack(peer, 122, 0);
+	expect_nothing(amqp_get_sockfd(peer));
+	amqp_event_loop_remove(loop, conn);
+	amqp_destroy_event_loop(loop);
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+
+	test_held_gap();
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+static void publish(amqp_connection_state_t conn, const char *key,
+		    const char *body, amqp_boolean_t batch)
+{
+	int res;
+
+	if (batch)
+		res = amqp_basic_publish_batch(conn, 1,
+					       amqp_cstring_bytes("ex"),
+					       amqp_cstring_bytes(key), 0, 0,
+					       NULL, amqp_cstring_bytes(body));
+	else
+		res = amqp_basic_publish(conn, 1, amqp_cstring_bytes("ex"),
+					 amqp_cstring_bytes(key), 0, 0, NULL,
+					 amqp_cstring_bytes(body));
+	if (res < 0)
+		die("publishing %s returned %d", key, res);
+}
+
+/* Reads the next message and checks that it's the one published with
+   the given routing key */
+static void expect_message(amqp_connection_state_t peer, const char *key,
+			   const char *body)
+{
+	amqp_basic_publish_t *m;
+	amqp_frame_t frame;
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 1);
+	if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+		die("expected basic.publish");
+	m = frame.payload.method.decoded;
+	if (m->routing_key.len != strlen(key)
+	    || memcmp(m->routing_key.bytes, key, m->routing_key.len) != 0)
+		die("expected message %s", key);
+
+	expect_frame(peer, &frame, AMQP_FRAME_HEADER, 1);
+	if (frame.payload.properties.body_size != strlen(body))
+		die("body size of %s doesn't match", key);
+
+	expect_frame(peer, &frame, AMQP_FRAME_BODY, 1);
+	if (frame.payload.body_fragment.len != strlen(body)
+	    || memcmp(frame.payload.body_fragment.bytes, body,
+		      strlen(body)) != 0)
+		die("body of %s doesn't match", key);
+
+	amqp_maybe_release_buffers(peer);
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn, peer;
+	amqp_frame_t frame;
+	char big[300];
+	int peer_fd;
+
+	connection_pair(&conn, &peer);
+	peer_fd = amqp_get_sockfd(peer);
+
+	/* Each message is three frames: the batch goes out with the
+	   message that takes it to the frame limit */
+	amqp_set_batch_limits(conn, 0, 7);
+	publish(conn, "a", "one", 1);
+	publish(conn, "b", "two", 1);
+	expect_nothing(peer_fd);
+	publish(conn, "c", "three", 1);
+	expect_message(peer, "a", "one");
+	expect_message(peer, "b", "two");
+	expect_message(peer, "c", "three");
+	expect_nothing(peer_fd);
+
+	/* Likewise the byte limit */
+	amqp_set_batch_limits(conn, 256, 0);
+	publish(conn, "d", "four", 1);
+	expect_nothing(peer_fd);
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	publish(conn, "e", big, 1);
+	expect_message(peer, "d", "four");
+	expect_message(peer, "e", big);
+	expect_nothing(peer_fd);
+
+	/* With no limits, only amqp_flush sends the batch */
+	amqp_set_batch_limits(conn, 0, 0);
+	publish(conn, "f", "six", 1);
+	publish(conn, "g", "seven", 1);
+	expect_nothing(peer_fd);
+	if (amqp_flush(conn) < 0)
+		die("amqp_flush failed");
+	expect_message(peer, "f", "six");
+	expect_message(peer, "g", "seven");
+
+	/* An unbuffered publish goes out at once, behind the batch */
+	publish(conn, "h", "eight", 1);
+	publish(conn, "i", "nine", 0);
+	expect_message(peer, "h", "eight");
+	expect_message(peer, "i", "nine");
+	expect_nothing(peer_fd);
+
+	/* The batch goes out before the connection reads */
+	publish(conn, "j", "ten", 1);
+	expect_nothing(peer_fd);
+	frame.frame_type = AMQP_FRAME_HEARTBEAT;
+	frame.channel = 0;
+	if (amqp_send_frame(peer, &frame) < 0)
+		die("amqp_send_frame failed");
+	if (amqp_simple_wait_frame(conn, &frame) < 0
+	    || frame.frame_type != AMQP_FRAME_HEARTBEAT)
+		die("expected a heartbeat");
+	expect_message(peer, "j", "ten");
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+	return 0;
+}
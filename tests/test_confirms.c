@@ -0,0 +1,180 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+/* Writes a method frame whose arguments are a delivery tag and a bit
+   field, as basic.ack and basic.nack have, or no arguments at all if
+   method isn't one of those. */
+static void send_confirm(int fd, uint16_t channel, amqp_method_number_t method,
+			 uint64_t delivery_tag, uint8_t bits)
+{
+	uint8_t args[16];
+	uint8_t *p = args;
+
+	if (method == AMQP_BASIC_ACK_METHOD
+	    || method == AMQP_BASIC_NACK_METHOD) {
+		p = put_u64(p, delivery_tag);
+		p = put_u8(p, bits);
+	}
+
+	send_method(fd, channel, method, args, p - args);
+}
+
+struct settled {
+	uint64_t tags[16];
+	amqp_boolean_t acked[16];
+	int count;
+};
+
+static void AMQP_CALL on_confirm(amqp_connection_state_t state,
+				 amqp_channel_t channel,
+				 uint64_t delivery_tag,
+				 amqp_boolean_t acked,
+				 void *data)
+{
+	struct settled *s = data;
+	(void)state;
+
+	if (channel != 1)
+		die("confirm on channel %d", channel);
+	if (s->count == 16)
+		die("too many confirms");
+
+	s->tags[s->count] = delivery_tag;
+	s->acked[s->count] = acked;
+	s->count++;
+}
+
+static void check_settled(struct settled *s, int index, uint64_t tag,
+			  amqp_boolean_t acked)
+{
+	if (index >= s->count)
+		die("only %d publishes settled", s->count);
+	if (s->tags[index] != tag || !s->acked[index] != !acked)
+		die("settled %d: got tag %d (%d), expected %d (%d)", index,
+		    (int)s->tags[index], s->acked[index], (int)tag, acked);
+}
+
+static void publish(amqp_connection_state_t conn)
+{
+	int res = amqp_basic_publish(conn, 1, amqp_cstring_bytes("ex"),
+				     amqp_cstring_bytes("rk"), 0, 0, NULL,
+				     amqp_cstring_bytes("hello"));
+	if (res < 0)
+		die("amqp_basic_publish returned %d", res);
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn;
+	struct settled settled;
+	amqp_rpc_reply_t reply;
+	amqp_frame_t frame;
+	int peer;
+	int i, res;
+
+	conn = fake_connection(&peer);
+	memset(&settled, 0, sizeof(settled));
+
+	send_confirm(peer, 1, AMQP_CONFIRM_SELECT_OK_METHOD, 0, 0);
+	reply = amqp_enable_confirms(conn, 1, 4, on_confirm, &settled);
+	if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+		die("amqp_enable_confirms failed");
+
+	for (i = 0; i < 4; i++)
+		publish(conn);
+
+	if (amqp_confirm_next_tag(conn, 1) != 5
+	    || amqp_confirms_outstanding(conn, 1) != 4)
+		die("expected 4 publishes outstanding");
+
+	/* Settled out of order, and several at once */
+	send_confirm(peer, 1, AMQP_BASIC_ACK_METHOD, 2, 0);
+	send_confirm(peer, 1, AMQP_BASIC_NACK_METHOD, 3, 1);
+	send_confirm(peer, 1, AMQP_BASIC_ACK_METHOD, 4, 0);
+
+	if (amqp_wait_for_confirms(conn, 1, NULL) >= 0)
+		die("expected the nacks to be reported");
+
+	if (settled.count != 4)
+		die("expected 4 publishes settled, got %d", settled.count);
+	check_settled(&settled, 0, 2, 1);
+	check_settled(&settled, 1, 1, 0);
+	check_settled(&settled, 2, 3, 0);
+	check_settled(&settled, 3, 4, 1);
+
+	if (amqp_wait_for_confirms(conn, 1, NULL) != 0)
+		die("nacks reported twice");
+
+	/* Fill the window. The next publish has to wait for tag 5, and
+	   keeps the unrelated frame that arrives first for later. */
+	for (i = 0; i < 4; i++)
+		publish(conn);
+
+	send_confirm(peer, 5, AMQP_BASIC_ACK_METHOD, 1, 0);
+	send_confirm(peer, 1, AMQP_BASIC_ACK_METHOD, 5, 0);
+	publish(conn);
+
+	check_settled(&settled, 4, 5, 1);
+	if (amqp_confirms_outstanding(conn, 1) != 4)
+		die("expected 4 publishes outstanding");
+
+	res = amqp_simple_wait_frame(conn, &frame);
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	if (frame.frame_type != AMQP_FRAME_METHOD
+	    || frame.channel != 5
+	    || frame.payload.method.id != AMQP_BASIC_ACK_METHOD)
+		die("bad frame: type %d channel %d",
+		    frame.frame_type, frame.channel);
+
+	send_confirm(peer, 1, AMQP_BASIC_ACK_METHOD, 9, 1);
+	if (amqp_wait_for_confirms(conn, 1, NULL) != 0)
+		die("expected everything to be acked");
+	if (settled.count != 9)
+		die("expected 9 publishes settled, got %d", settled.count);
+	check_settled(&settled, 8, 9, 1);
+
+	close(peer);
+	amqp_destroy_connection(conn);
+
+	return 0;
+}
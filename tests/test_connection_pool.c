@@ -0,0 +1,393 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+#define THREADS 8
+#define MAX_CONNECTIONS 3
+#define LEASES 50
+/* Every seventeenth lease is released as unusable */
+#define DISCARDS (THREADS * (LEASES / 17))
+
+/* What the broker has seen, across all of its connections */
+static struct {
+	pthread_mutex_t lock;
+	int accepted;
+	int open;
+	int closed;	/* with connection.close */
+	int channel_max;
+	int frame_max;
+	int heartbeat;
+	int channel;
+} broker = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0 };
+
+static void reply(amqp_connection_state_t conn, amqp_channel_t channel,
+		  amqp_method_number_t method, void *decoded)
+{
+	if (amqp_send_method(conn, channel, method, decoded) < 0)
+		die("broker: amqp_send_method failed");
+}
+
+/* Plays the broker for one connection, until the client goes away */
+static void *serve(void *arg)
+{
+	int fd = (int)(size_t)arg;
+	amqp_connection_state_t conn;
+	amqp_connection_start_t start;
+	char header[8];
+	size_t got = 0;
+	int closed = 0;
+
+	while (got < sizeof(header)) {
+		ssize_t res = read(fd, header + got, sizeof(header) - got);
+		if (res <= 0)
+			die("broker: no protocol header");
+		got += res;
+	}
+	if (memcmp(header, "AMQP", 4) != 0)
+		die("broker: bad protocol header");
+
+	conn = amqp_new_connection();
+	if (conn == NULL)
+		die("amqp_new_connection failed");
+	amqp_set_sockfd(conn, fd);
+
+	memset(&start, 0, sizeof(start));
+	start.version_major = AMQP_PROTOCOL_VERSION_MAJOR;
+	start.version_minor = AMQP_PROTOCOL_VERSION_MINOR;
+	start.server_properties = amqp_empty_table;
+	start.mechanisms = amqp_cstring_bytes("PLAIN");
+	start.locales = amqp_cstring_bytes("en_US");
+	reply(conn, 0, AMQP_CONNECTION_START_METHOD, &start);
+
+	while (!closed) {
+		amqp_frame_t frame;
+
+		amqp_maybe_release_buffers(conn);
+		if (amqp_simple_wait_frame(conn, &frame) < 0)
+			break;
+		if (frame.frame_type != AMQP_FRAME_METHOD)
+			continue;
+
+		switch (frame.payload.method.id) {
+		case AMQP_CONNECTION_START_OK_METHOD: {
+			/* Leave it to the client to pick the limits */
+			amqp_connection_tune_t tune;
+			memset(&tune, 0, sizeof(tune));
+			reply(conn, 0, AMQP_CONNECTION_TUNE_METHOD, &tune);
+			break;
+		}
+
+		case AMQP_CONNECTION_TUNE_OK_METHOD: {
+			amqp_connection_tune_ok_t *m =
+				frame.payload.method.decoded;
+			pthread_mutex_lock(&broker.lock);
+			broker.channel_max = m->channel_max;
+			broker.frame_max = m->frame_max;
+			broker.heartbeat = m->heartbeat;
+			pthread_mutex_unlock(&broker.lock);
+			break;
+		}
+
+		case AMQP_CONNECTION_OPEN_METHOD: {
+			amqp_connection_open_ok_t ok;
+			ok.known_hosts = amqp_empty_bytes;
+			reply(conn, 0, AMQP_CONNECTION_OPEN_OK_METHOD, &ok);
+			break;
+		}
+
+		case AMQP_CHANNEL_OPEN_METHOD: {
+			amqp_channel_open_ok_t ok;
+			pthread_mutex_lock(&broker.lock);
+			broker.channel = frame.channel;
+			pthread_mutex_unlock(&broker.lock);
+			ok.channel_id = amqp_empty_bytes;
+			reply(conn, frame.channel, AMQP_CHANNEL_OPEN_OK_METHOD,
+			      &ok);
+			break;
+		}
+
+		case AMQP_CHANNEL_CLOSE_METHOD: {
+			amqp_channel_close_ok_t ok;
+			reply(conn, frame.channel,
+			      AMQP_CHANNEL_CLOSE_OK_METHOD, &ok);
+			break;
+		}
+
+		case AMQP_BASIC_QOS_METHOD: {
+			amqp_basic_qos_ok_t ok;
+			reply(conn, frame.channel, AMQP_BASIC_QOS_OK_METHOD,
+			      &ok);
+			break;
+		}
+
+		case AMQP_CONNECTION_CLOSE_METHOD: {
+			amqp_connection_close_ok_t ok;
+			reply(conn, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &ok);
+			closed = 1;
+			break;
+		}
+		}
+	}
+
+	pthread_mutex_lock(&broker.lock);
+	broker.open--;
+	broker.closed += closed;
+	pthread_mutex_unlock(&broker.lock);
+
+	amqp_destroy_connection(conn);
+	return NULL;
+}
+
+static void *accept_connections(void *arg)
+{
+	int listener = (int)(size_t)arg;
+
+	for (;;) {
+		pthread_t thread;
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0)
+			die("accept failed");
+
+		pthread_mutex_lock(&broker.lock);
+		broker.accepted++;
+		broker.open++;
+		pthread_mutex_unlock(&broker.lock);
+
+		if (pthread_create(&thread, NULL, serve, (void *)(size_t)fd)
+		    != 0)
+			die("pthread_create failed");
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+/* Starts the broker listening on a local port, and returns the port */
+static int start_broker(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (listener < 0)
+		die("socket failed");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(listener, 16) < 0
+	    || getsockname(listener, (struct sockaddr *)&addr, &len) < 0)
+		die("could not listen on a local port");
+
+	if (pthread_create(&thread, NULL, accept_connections,
+			   (void *)(size_t)listener) != 0)
+		die("pthread_create failed");
+	pthread_detach(thread);
+
+	return ntohs(addr.sin_port);
+}
+
+static int broker_count(int *count)
+{
+	int value;
+	pthread_mutex_lock(&broker.lock);
+	value = *count;
+	pthread_mutex_unlock(&broker.lock);
+	return value;
+}
+
+/* Waits for the broker to see a connection go away */
+static void wait_open(int open)
+{
+	int i;
+
+	for (i = 0; i < 500 && broker_count(&broker.open) != open; i++)
+		usleep(10 * 1000);
+
+	if (broker_count(&broker.open) != open)
+		die("expected %d open connections, the broker has %d", open,
+		    broker_count(&broker.open));
+}
+
+static amqp_connection_pool_t new_pool(int port, int max, int heartbeat)
+{
+	struct amqp_connection_info info;
+	amqp_connection_pool_t pool;
+
+	amqp_default_connection_info(&info);
+	info.host = "127.0.0.1";
+	info.port = port;
+
+	pool = amqp_new_connection_pool(&info, max, 10, 65536, heartbeat, 3);
+	if (pool == NULL)
+		die("amqp_new_connection_pool failed");
+	return pool;
+}
+
+static void lease(amqp_connection_pool_t pool, amqp_lease_t *l)
+{
+	int res = amqp_connection_pool_lease(pool, l);
+	if (res < 0)
+		die("amqp_connection_pool_lease returned %d", res);
+	if (l->channel != 3)
+		die("leased channel %d, not the pool's", l->channel);
+
+	/* The connection is ready for use */
+	amqp_basic_qos(l->state, l->channel, 0, 10, 0);
+	if (amqp_get_rpc_reply(l->state).reply_type != AMQP_RESPONSE_NORMAL)
+		die("basic.qos failed on a leased connection");
+}
+
+static void test_lease_release(int port)
+{
+	amqp_connection_pool_t pool = new_pool(port, 2, 60);
+	amqp_connection_state_t first;
+	amqp_lease_t l;
+
+	/* The pool's connection parameters reach the broker */
+	lease(pool, &l);
+	if (broker_count(&broker.channel_max) != 10
+	    || broker_count(&broker.frame_max) != 65536
+	    || broker_count(&broker.heartbeat) != 60
+	    || broker_count(&broker.channel) != 3)
+		die("the broker saw the wrong connection parameters");
+
+	/* A reusable connection is lent out again */
+	first = l.state;
+	amqp_connection_pool_release(pool, &l, 1);
+	if (l.state != NULL || l.slot != NULL)
+		die("release should clear the lease");
+	lease(pool, &l);
+	if (l.state != first || broker_count(&broker.accepted) != 1)
+		die("the released connection was not reused");
+
+	/* A discarded one is dropped, and replaced when next needed */
+	amqp_connection_pool_release(pool, &l, 0);
+	wait_open(0);
+	lease(pool, &l);
+	if (broker_count(&broker.accepted) != 2)
+		die("the discarded connection was not replaced");
+	amqp_connection_pool_release(pool, &l, 1);
+
+	/* Destroying the pool closes its idle connections properly */
+	amqp_destroy_connection_pool(pool);
+	wait_open(0);
+	if (broker_count(&broker.closed) != 1)
+		die("the idle connection was not closed with connection.close");
+}
+
+static amqp_connection_pool_t contended;
+static pthread_mutex_t holders_lock = PTHREAD_MUTEX_INITIALIZER;
+static int holders;
+static int max_holders;
+
+static void count_holder(int delta)
+{
+	pthread_mutex_lock(&holders_lock);
+	holders += delta;
+	if (holders > MAX_CONNECTIONS)
+		die("%d leases held at once", holders);
+	if (holders > max_holders)
+		max_holders = holders;
+	pthread_mutex_unlock(&holders_lock);
+}
+
+static void *worker(void *arg)
+{
+	int i;
+	(void)arg;
+
+	for (i = 0; i < LEASES; i++) {
+		amqp_lease_t l;
+
+		lease(contended, &l);
+		count_holder(1);
+		usleep(100);
+		count_holder(-1);
+
+		amqp_connection_pool_release(contended, &l, i % 17 != 16);
+	}
+
+	return NULL;
+}
+
+/* More threads than connections: they take turns, never holding more
+   leases at once than the pool has connections */
+static void test_contention(int port)
+{
+	pthread_t threads[THREADS];
+	int i, accepted = broker_count(&broker.accepted);
+
+	contended = new_pool(port, MAX_CONNECTIONS, 0);
+
+	for (i = 0; i < THREADS; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			die("pthread_create failed");
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	amqp_destroy_connection_pool(contended);
+	wait_open(0);
+
+	/* Only discarded connections get replaced */
+	accepted = broker_count(&broker.accepted) - accepted;
+	if (accepted < MAX_CONNECTIONS || accepted > MAX_CONNECTIONS + DISCARDS)
+		die("the pool opened %d connections", accepted);
+	if (max_holders < 2)
+		die("leases were never held concurrently");
+}
+
+int main(void)
+{
+	int port = start_broker();
+
+	test_lease_release(port);
+	test_contention(port);
+	return 0;
+}
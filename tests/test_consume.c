@@ -0,0 +1,269 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+/* basic.ack(delivery_tag = 0x0102030405060708, multiple = 1) on
+   channel 5 */
+static const uint8_t ack_frame[] = {
+	0x01, 0x00, 0x05, 0x00, 0x00, 0x00, 0x0d,
+	0x00, 0x3c, 0x00, 0x50,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x01,
+	0xce
+};
+
+/* A content header with only the content-type property set */
+static void send_typed_header(int fd, uint16_t channel, uint64_t body_size,
+			      const char *content_type)
+{
+	uint8_t payload[64];
+	uint8_t *p = payload;
+
+	p = put_u16(p, AMQP_BASIC_CLASS);
+	p = put_u16(p, 0);
+	p = put_u64(p, body_size);
+	p = put_u16(p, AMQP_BASIC_CONTENT_TYPE_FLAG);
+	p = put_shortstr(p, content_type);
+	send_frame(fd, AMQP_FRAME_HEADER, channel, payload, p - payload);
+}
+
+static void check_envelope(amqp_envelope_t *envelope, uint16_t channel,
+			   uint64_t delivery_tag, const char *body)
+{
+	if (envelope->channel != channel
+	    || envelope->delivery_tag != delivery_tag)
+		die("got delivery %d on channel %d, expected %d on %d",
+		    (int)envelope->delivery_tag, envelope->channel,
+		    (int)delivery_tag, channel);
+
+	if (envelope->consumer_tag.len != 4
+	    || memcmp(envelope->consumer_tag.bytes, "ctag", 4)
+	    || envelope->exchange.len != 2
+	    || memcmp(envelope->exchange.bytes, "ex", 2)
+	    || envelope->routing_key.len != 2
+	    || memcmp(envelope->routing_key.bytes, "rk", 2))
+		die("bad delivery contents");
+
+	if (envelope->properties == NULL)
+		die("no properties");
+
+	if (envelope->body.len != strlen(body)
+	    || memcmp(envelope->body.bytes, body, envelope->body.len))
+		die("bad body for delivery %d", (int)delivery_tag);
+}
+
+static void test_consume_message(void)
+{
+	amqp_connection_state_t conn;
+	amqp_envelope_t envelope;
+	amqp_frame_t frame;
+	int peer;
+	int res;
+
+	conn = fake_connection(&peer);
+
+	/* Two deliveries whose frames are interleaved across channels,
+	   the first with a body split over two frames */
+	send_deliver(peer, 1, "ctag", 1);
+	send_deliver(peer, 2, "ctag", 2);
+	send_header(peer, 1, 8);
+	send_header(peer, 2, 3);
+	send_body(peer, 1, "abcd");
+	send_body(peer, 2, "xyz");
+	send_body(peer, 1, "efgh");
+
+	/* An empty message */
+	send_deliver(peer, 1, "ctag", 3);
+	send_header(peer, 1, 0);
+
+	/* Something that isn't a delivery */
+	send_frame(peer, AMQP_FRAME_METHOD, 5, ack_frame + 7,
+		   sizeof(ack_frame) - 8);
+
+	res = amqp_consume_message(conn, &envelope, NULL);
+	if (res < 0)
+		die("amqp_consume_message returned %d", res);
+	check_envelope(&envelope, 1, 1, "abcdefgh");
+
+	res = amqp_consume_message(conn, &envelope, NULL);
+	if (res < 0)
+		die("amqp_consume_message returned %d", res);
+	check_envelope(&envelope, 2, 2, "xyz");
+
+	res = amqp_consume_message(conn, &envelope, NULL);
+	if (res < 0)
+		die("amqp_consume_message returned %d", res);
+	check_envelope(&envelope, 1, 3, "");
+
+	res = amqp_consume_message(conn, &envelope, NULL);
+	if (res != -AMQP_ERROR_UNEXPECTED_FRAME)
+		die("expected basic.ack to be rejected, got %d", res);
+
+	/* The frame is still there to be read in the usual way */
+	res = amqp_simple_wait_frame(conn, &frame);
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	if (frame.frame_type != AMQP_FRAME_METHOD
+	    || frame.channel != 5
+	    || frame.payload.method.id != AMQP_BASIC_ACK_METHOD)
+		die("bad frame: type %d channel %d",
+		    frame.frame_type, frame.channel);
+
+	close(peer);
+	amqp_destroy_connection(conn);
+}
+
+/* With lazy properties, nothing is decoded until it is asked for */
+static void test_lazy_properties(void)
+{
+	amqp_connection_state_t conn;
+	amqp_basic_properties_t *props;
+	amqp_envelope_t envelope;
+	amqp_frame_t frame;
+	int peer;
+	int res;
+
+	conn = fake_connection(&peer);
+	amqp_set_lazy_properties(conn, 1);
+
+	send_deliver(peer, 1, "ctag", 1);
+	send_typed_header(peer, 1, 4, "text/plain");
+	send_body(peer, 1, "abcd");
+	send_typed_header(peer, 2, 0, "application/json");
+
+	res = amqp_consume_message(conn, &envelope, NULL);
+	if (res < 0)
+		die("amqp_consume_message returned %d", res);
+	if (envelope.properties != NULL)
+		die("properties were decoded");
+	if (envelope.body.len != 4 || memcmp(envelope.body.bytes, "abcd", 4))
+		die("bad body");
+
+	res = amqp_envelope_properties(conn, &envelope);
+	if (res < 0)
+		die("amqp_envelope_properties returned %d", res);
+	props = envelope.properties;
+	if (props == NULL
+	    || props->_flags != AMQP_BASIC_CONTENT_TYPE_FLAG
+	    || props->content_type.len != 10
+	    || memcmp(props->content_type.bytes, "text/plain", 10))
+		die("bad envelope properties");
+
+	res = amqp_simple_wait_frame(conn, &frame);
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	if (frame.frame_type != AMQP_FRAME_HEADER
+	    || frame.payload.properties.decoded != NULL)
+		die("expected an undecoded content header");
+
+	res = amqp_decode_frame_properties(conn, &frame);
+	if (res < 0)
+		die("amqp_decode_frame_properties returned %d", res);
+	props = frame.payload.properties.decoded;
+	if (props->content_type.len != 16
+	    || memcmp(props->content_type.bytes, "application/json", 16))
+		die("bad frame properties");
+
+	close(peer);
+	amqp_destroy_connection(conn);
+}
+
+static void check_body(amqp_frame_t *frame, uint16_t channel,
+		       const char *body)
+{
+	if (frame->frame_type != AMQP_FRAME_BODY
+	    || frame->channel != channel
+	    || frame->payload.body_fragment.len != strlen(body)
+	    || memcmp(frame->payload.body_fragment.bytes, body,
+		      strlen(body)))
+		die("expected body %s on channel %d", body, channel);
+}
+
+static void test_channel_queues(void)
+{
+	amqp_connection_state_t conn;
+	amqp_frame_t frame;
+	int peer;
+
+	conn = fake_connection(&peer);
+
+	send_body(peer, 3, "a");
+	send_body(peer, 300, "b");
+	send_body(peer, 3, "c");
+	send_body(peer, 300, "d");
+	send_body(peer, 7, "e");
+
+	if (amqp_simple_wait_frame_on_channel(conn, 300, &frame) < 0)
+		die("waiting on channel 300 failed");
+	check_body(&frame, 300, "b");
+
+	if (amqp_simple_wait_frame_on_channel(conn, 7, &frame) < 0)
+		die("waiting on channel 7 failed");
+	check_body(&frame, 7, "e");
+
+	if (amqp_simple_wait_frame_on_channel(conn, 3, &frame) < 0)
+		die("waiting on channel 3 failed");
+	check_body(&frame, 3, "a");
+
+	/* What's left comes back in the order it arrived */
+	if (amqp_simple_wait_frame(conn, &frame) < 0)
+		die("amqp_simple_wait_frame failed");
+	check_body(&frame, 3, "c");
+
+	if (amqp_simple_wait_frame(conn, &frame) < 0)
+		die("amqp_simple_wait_frame failed");
+	check_body(&frame, 300, "d");
+
+	if (amqp_frames_enqueued(conn))
+		die("frames left in the queue");
+
+	close(peer);
+	amqp_destroy_connection(conn);
+}
+
+int main(void)
+{
+	test_consume_message();
+	test_lazy_properties();
+	test_channel_queues();
+
+	return 0;
+}
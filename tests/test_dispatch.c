@@ -0,0 +1,253 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+/* basic.return(reply_code = 312, reply_text = "NO_ROUTE",
+   exchange = "ex", routing_key = "rk") */
+static void send_return(int fd, uint16_t channel)
+{
+	uint8_t payload[64];
+	uint8_t *p = payload;
+
+	p = put_u32(p, AMQP_BASIC_RETURN_METHOD);
+	p = put_u16(p, 312);
+	p = put_shortstr(p, "NO_ROUTE");
+	p = put_shortstr(p, "ex");
+	p = put_shortstr(p, "rk");
+	send_frame(fd, AMQP_FRAME_METHOD, channel, payload, p - payload);
+}
+
+struct received {
+	char log[256];
+};
+
+static void record(struct received *r, const char *fmt, ...)
+{
+	size_t len = strlen(r->log);
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(r->log + len, sizeof(r->log) - len, fmt, ap);
+	va_end(ap);
+}
+
+static void AMQP_CALL on_message(amqp_connection_state_t state,
+				 amqp_envelope_t const *envelope,
+				 void *data)
+{
+	(void)state;
+	record(data, "msg %d/%d %.*s %.*s;", envelope->channel,
+	       (int)envelope->delivery_tag,
+	       (int)envelope->consumer_tag.len,
+	       (char *)envelope->consumer_tag.bytes,
+	       (int)envelope->body.len, (char *)envelope->body.bytes);
+}
+
+static void AMQP_CALL on_consumer_message(amqp_connection_state_t state,
+					  amqp_envelope_t const *envelope,
+					  void *data)
+{
+	record(data, "consumer ");
+	on_message(state, envelope, data);
+}
+
+static void AMQP_CALL on_method(amqp_connection_state_t state,
+				amqp_channel_t channel,
+				amqp_method_t const *method,
+				void *data)
+{
+	(void)state;
+	record(data, "method %d/%08X;", channel, (unsigned)method->id);
+}
+
+static void test_dispatch(void)
+{
+	amqp_connection_state_t conn;
+	amqp_dispatcher_t d;
+	struct received r;
+	int peer;
+	int i, res;
+
+	conn = fake_connection(&peer);
+	d = amqp_new_dispatcher(conn);
+	memset(&r, 0, sizeof(r));
+
+	if (amqp_dispatcher_on_channel(d, 1, on_message, on_method, &r) < 0
+	    || amqp_dispatcher_on_channel(d, 2, on_message, on_method, &r) < 0
+	    || amqp_dispatcher_on_consumer(d, 2, amqp_cstring_bytes("c2"),
+					   on_consumer_message, &r) < 0)
+		die("setting handlers failed");
+
+	/* Deliveries on two channels, interleaved frame by frame, with a
+	   returned message in the middle of one */
+	send_deliver(peer, 1, "c1", 1);
+	send_deliver(peer, 2, "c2", 2);
+	send_header(peer, 1, 6);
+	send_header(peer, 2, 3);
+	send_body(peer, 1, "abc");
+	send_body(peer, 2, "xyz");
+	send_body(peer, 1, "def");
+	send_return(peer, 2);
+	send_header(peer, 2, 2);
+	send_body(peer, 2, "no");
+
+	/* each call returns once a handler has run */
+	for (i = 0; i < 3; i++) {
+		res = amqp_dispatch(d, NULL);
+		if (res < 0)
+			die("amqp_dispatch returned %d", res);
+	}
+
+	if (strcmp(r.log, "consumer msg 2/2 c2 xyz;msg 1/1 c1 abcdef;"
+		   "method 2/003C0032;"))
+		die("unexpected dispatch order: %s", r.log);
+
+	/* A body frame with no delivery before it */
+	send_body(peer, 1, "abc");
+	if (amqp_dispatch(d, NULL) >= 0)
+		die("expected a stray body frame to be rejected");
+
+	close(peer);
+	amqp_destroy_dispatcher(d);
+	amqp_destroy_connection(conn);
+}
+
+static void AMQP_CALL on_loop_message(amqp_connection_state_t state,
+				      amqp_envelope_t const *envelope,
+				      void *data)
+{
+	if (envelope->exchange.len != 2
+	    || memcmp(envelope->exchange.bytes, "ex", 2)
+	    || envelope->routing_key.len != 2
+	    || memcmp(envelope->routing_key.bytes, "rk", 2)
+	    || envelope->properties == NULL
+	    || envelope->properties->_flags != 0)
+		die("delivery overwritten before it was complete");
+
+	on_message(state, envelope, data);
+}
+
+static void AMQP_CALL on_loop_frame(amqp_connection_state_t state,
+				    amqp_frame_t const *frame,
+				    int status,
+				    void *data)
+{
+	int res;
+	(void)state;
+
+	if (frame == NULL)
+		die("event loop reported %d", status);
+
+	res = amqp_dispatch_frame(data, frame);
+	if (res < 0)
+		die("amqp_dispatch_frame returned %d", res);
+}
+
+/* Runs the loop until it has nothing more to read */
+static void run_loop(amqp_event_loop_t loop)
+{
+	while (amqp_event_loop_run_once(loop, 100) > 0)
+		;
+}
+
+/* Frames fed to a dispatcher from an event loop callback, one at a
+   time, so that the loop tries to release the connection's buffers
+   between each frame of a delivery */
+static void test_event_loop_dispatch(void)
+{
+	amqp_connection_state_t conn;
+	amqp_event_loop_t loop;
+	amqp_dispatcher_t d;
+	struct received r;
+	int peer;
+
+	conn = fake_connection(&peer);
+	d = amqp_new_dispatcher(conn);
+	loop = amqp_new_event_loop();
+	memset(&r, 0, sizeof(r));
+
+	if (d == NULL || loop == NULL
+	    || amqp_dispatcher_on_channel(d, 1, on_loop_message, on_method,
+					  &r) < 0
+	    || amqp_event_loop_add(loop, conn, on_loop_frame, d) < 0)
+		die("setup failed");
+
+	send_deliver(peer, 1, "a-long-consumer-tag", 1);
+	run_loop(loop);
+	send_header(peer, 1, 12);
+	run_loop(loop);
+	send_body(peer, 1, "abcdef");
+	run_loop(loop);
+	/* a heartbeat in between doesn't change anything */
+	send_frame(peer, AMQP_FRAME_HEARTBEAT, 0, "", 0);
+	run_loop(loop);
+	send_body(peer, 1, "ghijkl");
+	run_loop(loop);
+
+	send_deliver(peer, 1, "tag2", 2);
+	send_header(peer, 1, 3);
+	run_loop(loop);
+	send_body(peer, 1, "xyz");
+	run_loop(loop);
+
+	if (strcmp(r.log, "msg 1/1 a-long-consumer-tag abcdefghijkl;"
+		   "msg 1/2 tag2 xyz;"))
+		die("unexpected deliveries: %s", r.log);
+
+	/* Once nothing is being assembled the buffers can be released */
+	if (!amqp_release_buffers_ok(conn))
+		die("buffers still held");
+
+	amqp_event_loop_remove(loop, conn);
+	amqp_destroy_event_loop(loop);
+	close(peer);
+	amqp_destroy_dispatcher(d);
+	amqp_destroy_connection(conn);
+}
+
+int main(void)
+{
+	test_dispatch();
+	test_event_loop_dispatch();
+
+	return 0;
+}
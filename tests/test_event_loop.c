@@ -0,0 +1,240 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+#define NUM_CONNECTIONS 3
+
+/* basic.ack(delivery_tag = 0x0102030405060708, multiple = 1) on
+   channel 5 */
+static const uint8_t method_frame[] = {
+	0x01, 0x00, 0x05, 0x00, 0x00, 0x00, 0x0d,
+	0x00, 0x3c, 0x00, 0x50,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x01,
+	0xce
+};
+
+struct connection {
+	amqp_connection_state_t state;
+	int peer;
+	int frames;
+	int status;
+	amqp_boolean_t failed;
+	amqp_boolean_t destroy_on_frame;
+	amqp_event_loop_t loop;
+};
+
+static void AMQP_CALL on_frame(amqp_connection_state_t state,
+			       amqp_frame_t const *frame,
+			       int status,
+			       void *data)
+{
+	struct connection *c = data;
+
+	if (state != c->state)
+		die("callback for the wrong connection");
+
+	if (frame == NULL) {
+		if (status >= 0)
+			die("error callback with status %d", status);
+
+		c->failed = 1;
+		c->status = status;
+		return;
+	}
+
+	if (frame->frame_type != AMQP_FRAME_METHOD
+	    || frame->channel != 5
+	    || frame->payload.method.id != AMQP_BASIC_ACK_METHOD)
+		die("bad frame: type %d channel %d",
+		    frame->frame_type, frame->channel);
+
+	c->frames++;
+
+	if (c->destroy_on_frame) {
+		amqp_event_loop_remove(c->loop, c->state);
+		amqp_destroy_connection(c->state);
+		c->state = NULL;
+	}
+}
+
+static void send_to(struct connection *c, const void *buf, size_t len)
+{
+	if (write(c->peer, buf, len) != (ssize_t)len)
+		die("write to peer failed");
+}
+
+static int run_until(amqp_event_loop_t loop, int frames)
+{
+	int total = 0;
+
+	while (total < frames) {
+		int res = amqp_event_loop_run_once(loop, 1000);
+		if (res <= 0)
+			die("amqp_event_loop_run_once returned %d", res);
+
+		total += res;
+	}
+
+	return total;
+}
+
+int main(void)
+{
+	struct connection conns[NUM_CONNECTIONS];
+	amqp_event_loop_t loop = amqp_new_event_loop();
+	int i;
+
+	if (loop == NULL)
+		die("amqp_new_event_loop failed");
+
+	for (i = 0; i < NUM_CONNECTIONS; i++) {
+		memset(&conns[i], 0, sizeof(conns[i]));
+		conns[i].state = fake_connection(&conns[i].peer);
+		conns[i].loop = loop;
+
+		if (amqp_event_loop_add(loop, conns[i].state, on_frame,
+					&conns[i]) < 0)
+			die("amqp_event_loop_add failed");
+	}
+
+	/* The protocol header goes out whole on a non-blocking connection,
+	   and the byte count is reported as it always was */
+	{
+		uint8_t header[8];
+
+		if (amqp_send_header(conns[0].state) != 8)
+			die("amqp_send_header didn't return 8");
+		if (read(conns[0].peer, header, sizeof(header))
+		    != sizeof(header)
+		    || memcmp(header, "AMQP", 4) != 0)
+			die("protocol header not sent");
+	}
+
+	/* Nothing to read yet */
+	if (amqp_event_loop_run_once(loop, 0) != 0)
+		die("expected no frames");
+
+	/* One whole frame on each connection, and two on the last */
+	for (i = 0; i < NUM_CONNECTIONS; i++)
+		send_to(&conns[i], method_frame, sizeof(method_frame));
+	send_to(&conns[NUM_CONNECTIONS - 1], method_frame, sizeof(method_frame));
+
+	run_until(loop, NUM_CONNECTIONS + 1);
+	for (i = 0; i < NUM_CONNECTIONS; i++)
+		if (conns[i].frames != (i == NUM_CONNECTIONS - 1 ? 2 : 1))
+			die("connection %d saw %d frames", i, conns[i].frames);
+
+	/* A frame split across two writes */
+	send_to(&conns[0], method_frame, 10);
+	if (amqp_event_loop_run_once(loop, 1000) != 0)
+		die("expected no frames from a partial frame");
+	send_to(&conns[0], method_frame + 10, sizeof(method_frame) - 10);
+	run_until(loop, 1);
+	if (conns[0].frames != 2)
+		die("split frame not dispatched");
+
+	/* A callback that removes and destroys its own connection */
+	conns[1].destroy_on_frame = 1;
+	send_to(&conns[1], method_frame, sizeof(method_frame));
+	run_until(loop, 1);
+	if (conns[1].state != NULL)
+		die("connection 1 not destroyed");
+
+	/* The peer going away is reported, and the connection dropped */
+	close(conns[2].peer);
+	conns[2].peer = -1;
+	amqp_event_loop_run_once(loop, 1000);
+	if (!conns[2].failed || conns[2].status >= 0)
+		die("closed connection not reported");
+
+	send_to(&conns[0], method_frame, sizeof(method_frame));
+	run_until(loop, 1);
+	if (conns[0].frames != 3 || conns[2].frames != 2)
+		die("frames dispatched to the wrong connection");
+
+	/* A connection whose socket was closed under the loop fails on
+	   its own when it has to be registered for writing, and the rest
+	   are still served */
+	{
+		struct connection closed;
+
+		memset(&closed, 0, sizeof(closed));
+		closed.state = fake_connection(&closed.peer);
+		closed.loop = loop;
+		if (amqp_event_loop_add(loop, closed.state, on_frame,
+					&closed) < 0)
+			die("amqp_event_loop_add failed");
+
+		if (amqp_basic_publish_batch(closed.state, 1,
+					     amqp_cstring_bytes("ex"),
+					     amqp_cstring_bytes("rk"), 0, 0,
+					     NULL, amqp_cstring_bytes("x")) < 0)
+			die("amqp_basic_publish_batch failed");
+		close(amqp_get_sockfd(closed.state));
+
+		send_to(&conns[0], method_frame, sizeof(method_frame));
+		run_until(loop, 1);
+		if (!closed.failed || closed.status >= 0)
+			die("connection with a closed socket not reported");
+		if (conns[0].frames != 4)
+			die("other connections not served");
+
+		amqp_destroy_connection(closed.state);
+		close(closed.peer);
+	}
+
+	amqp_event_loop_remove(loop, conns[0].state);
+	if (amqp_event_loop_run(loop) != 0)
+		die("amqp_event_loop_run with no connections failed");
+
+	amqp_destroy_event_loop(loop);
+
+	for (i = 0; i < NUM_CONNECTIONS; i++) {
+		if (conns[i].state != NULL)
+			amqp_destroy_connection(conns[i].state);
+		if (conns[i].peer >= 0)
+			close(conns[i].peer);
+	}
+
+	return 0;
+}
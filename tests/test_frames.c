@@ -0,0 +1,241 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <inttypes.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "fake_broker.h"
+
+/* basic.ack(delivery_tag = 0x0102030405060708, multiple = 1) on
+   channel 5 */
+static const uint8_t method_frame[] = {
+	0x01, 0x00, 0x05, 0x00, 0x00, 0x00, 0x0d,
+	0x00, 0x3c, 0x00, 0x50,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x01,
+	0xce
+};
+
+/* a 5-byte body fragment on channel 5 */
+static const uint8_t body_frame[] = {
+	0x03, 0x00, 0x05, 0x00, 0x00, 0x00, 0x05,
+	'h', 'e', 'l', 'l', 'o',
+	0xce
+};
+
+static const uint8_t heartbeat_frame[] = {
+	0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xce
+};
+
+static void check_method(amqp_frame_t *frame)
+{
+	amqp_basic_ack_t *ack;
+
+	if (frame->frame_type != AMQP_FRAME_METHOD
+	    || frame->channel != 5
+	    || frame->payload.method.id != AMQP_BASIC_ACK_METHOD)
+		die("bad method frame: type %d channel %d",
+		    frame->frame_type, frame->channel);
+
+	ack = frame->payload.method.decoded;
+	if (ack->delivery_tag != 0x0102030405060708ULL || !ack->multiple)
+		die("bad basic.ack contents");
+}
+
+static void check_body(amqp_frame_t *frame)
+{
+	if (frame->frame_type != AMQP_FRAME_BODY
+	    || frame->channel != 5
+	    || frame->payload.body_fragment.len != 5
+	    || memcmp(frame->payload.body_fragment.bytes, "hello", 5))
+		die("bad body frame");
+}
+
+static void check_heartbeat(amqp_frame_t *frame)
+{
+	if (frame->frame_type != AMQP_FRAME_HEARTBEAT || frame->channel != 0)
+		die("bad heartbeat frame");
+}
+
+/* Feeds the frames to a fresh connection chunk_size bytes at a time,
+   so that frames straddle the chunk boundaries in every possible
+   way. */
+static void test_chunked_input(size_t chunk_size)
+{
+	uint8_t stream[sizeof(method_frame) + sizeof(body_frame)
+		       + sizeof(heartbeat_frame)];
+	void (*checks[3])(amqp_frame_t *);
+	amqp_connection_state_t conn = amqp_new_connection();
+	size_t offset = 0;
+	int seen = 0;
+
+	memcpy(stream, method_frame, sizeof(method_frame));
+	memcpy(stream + sizeof(method_frame), body_frame, sizeof(body_frame));
+	memcpy(stream + sizeof(method_frame) + sizeof(body_frame),
+	       heartbeat_frame, sizeof(heartbeat_frame));
+
+	checks[0] = check_method;
+	checks[1] = check_body;
+	checks[2] = check_heartbeat;
+
+	while (offset < sizeof(stream)) {
+		amqp_bytes_t chunk;
+		amqp_frame_t frame;
+		int res;
+
+		chunk.bytes = stream + offset;
+		chunk.len = sizeof(stream) - offset;
+		if (chunk.len > chunk_size)
+			chunk.len = chunk_size;
+
+		res = amqp_handle_input(conn, chunk, &frame);
+		if (res <= 0)
+			die("amqp_handle_input returned %d", res);
+
+		offset += res;
+
+		if (frame.frame_type != 0) {
+			if (seen == 3)
+				die("too many frames");
+
+			checks[seen++](&frame);
+		}
+	}
+
+	if (seen != 3)
+		die("expected 3 frames with chunk size %d, got %d",
+		    (int)chunk_size, seen);
+
+	amqp_destroy_connection(conn);
+}
+
+static void test_bad_frame_end(void)
+{
+	uint8_t bad[sizeof(heartbeat_frame)];
+	amqp_connection_state_t conn = amqp_new_connection();
+	amqp_bytes_t input;
+	amqp_frame_t frame;
+
+	memcpy(bad, heartbeat_frame, sizeof(bad));
+	bad[sizeof(bad) - 1] = 0;
+
+	input.bytes = bad;
+	input.len = sizeof(bad);
+	if (amqp_handle_input(conn, input, &frame) >= 0)
+		die("expected a bad frame end to be rejected");
+
+	amqp_destroy_connection(conn);
+}
+
+/* Feeds a frame header announcing a payload of the given size, and
+   returns what amqp_handle_input made of it */
+static int handle_frame_header(uint8_t frame_type, uint32_t payload_size)
+{
+	uint8_t header[8] = { 0, 0x00, 0x01 };
+	amqp_connection_state_t conn = amqp_new_connection();
+	amqp_bytes_t input;
+	amqp_frame_t frame;
+	int res;
+
+	header[0] = frame_type;
+	header[3] = (uint8_t)(payload_size >> 24);
+	header[4] = (uint8_t)(payload_size >> 16);
+	header[5] = (uint8_t)(payload_size >> 8);
+	header[6] = (uint8_t)payload_size;
+	/* The frame end, or the first byte of the payload. A new
+	   connection looks at eight bytes before deciding whether it has
+	   been sent a protocol header or a frame. */
+	header[7] = AMQP_FRAME_END;
+
+	input.bytes = header;
+	input.len = sizeof(header);
+	res = amqp_handle_input(conn, input, &frame);
+
+	amqp_destroy_connection(conn);
+	return res;
+}
+
+/* A frame's size comes off the wire, and has to be checked before
+   anything is allocated for it or decoded from it */
+static void test_bad_frame_size(void)
+{
+	/* New connections accept frames of up to 64KB */
+	uint32_t frame_max = 65536;
+
+	if (handle_frame_header(AMQP_FRAME_BODY, frame_max - 8) != 8)
+		die("a frame of frame_max bytes was rejected");
+	if (handle_frame_header(AMQP_FRAME_BODY, frame_max - 7)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("a frame over frame_max was accepted");
+	if (handle_frame_header(AMQP_FRAME_METHOD, 0xffffffff)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("a frame whose size wraps around was accepted");
+	if (handle_frame_header(AMQP_FRAME_METHOD, 0xfffffff8)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("a frame whose size wraps to zero was accepted");
+
+	/* Too short to hold what the frame type needs */
+	if (handle_frame_header(AMQP_FRAME_METHOD, 0)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("an empty method frame was accepted");
+	if (handle_frame_header(AMQP_FRAME_METHOD, 3)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("a method frame without a method id was accepted");
+	if (handle_frame_header(AMQP_FRAME_HEADER, 11)
+	    != -AMQP_ERROR_BAD_AMQP_DATA)
+		die("a content header without a body size was accepted");
+	if (handle_frame_header(AMQP_FRAME_HEARTBEAT, 0) != 8)
+		die("a heartbeat was rejected");
+}
+
+int main(void)
+{
+	size_t chunk_size;
+
+	for (chunk_size = 1; chunk_size <= 64; chunk_size++)
+		test_chunked_input(chunk_size);
+
+	test_bad_frame_end();
+	test_bad_frame_size();
+
+	return 0;
+}
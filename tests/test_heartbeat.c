@@ -0,0 +1,135 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+/* Heartbeats are negotiated in whole seconds, so this test takes a few
+   of them to run */
+#define HEARTBEAT 1
+
+static void heartbeat_frame(amqp_frame_t *frame)
+{
+	frame->frame_type = AMQP_FRAME_HEARTBEAT;
+	frame->channel = 0;
+}
+
+static void expect_heartbeat(amqp_connection_state_t state)
+{
+	amqp_frame_t frame;
+	int res = amqp_simple_wait_frame(state, &frame);
+
+	if (res < 0)
+		die("amqp_simple_wait_frame returned %d", res);
+	if (frame.frame_type != AMQP_FRAME_HEARTBEAT)
+		die("expected a heartbeat, got frame type %d",
+		    frame.frame_type);
+}
+
+static void sleep_ms(int ms)
+{
+	usleep((useconds_t)ms * 1000);
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn, peer;
+	amqp_frame_t frame;
+	int peer_fd;
+	int timeout;
+	int res;
+
+	connection_pair(&conn, &peer);
+	peer_fd = amqp_get_sockfd(peer);
+
+	/* A connection can only be tuned once it has read a frame */
+	heartbeat_frame(&frame);
+	if (amqp_send_frame(peer, &frame) < 0)
+		die("amqp_send_frame failed");
+	expect_heartbeat(conn);
+	if (amqp_tune_connection(conn, 0, 131072, HEARTBEAT) < 0)
+		die("amqp_tune_connection failed");
+
+	/* Nothing is due straight away */
+	timeout = amqp_heartbeat_timeout(conn);
+	if (timeout <= 0 || timeout > HEARTBEAT * 1000)
+		die("amqp_heartbeat_timeout returned %d", timeout);
+	if (amqp_heartbeat_tick(conn) != 0)
+		die("early amqp_heartbeat_tick failed");
+	expect_nothing(peer_fd);
+
+	/* Once the connection has been idle for an interval, the tick
+	   sends a heartbeat */
+	sleep_ms(timeout + 10);
+	res = amqp_heartbeat_tick(conn);
+	if (res != 0)
+		die("amqp_heartbeat_tick returned %d", res);
+	expect_heartbeat(peer);
+
+	/* The broker has now missed two heartbeats */
+	timeout = amqp_heartbeat_timeout(conn);
+	if (timeout < 0 || timeout > HEARTBEAT * 1000)
+		die("amqp_heartbeat_timeout returned %d", timeout);
+	sleep_ms(timeout + 10);
+	if (amqp_heartbeat_tick(conn) != -AMQP_ERROR_HEARTBEAT_TIMEOUT)
+		die("silent broker not reported");
+
+	/* A blocking wait does the same by itself. Hearing from the
+	   broker restarts the clock; the wait then keeps sending
+	   heartbeats, one per interval, and gives up once the broker has
+	   been silent for two. */
+	heartbeat_frame(&frame);
+	if (amqp_send_frame(peer, &frame) < 0)
+		die("amqp_send_frame failed");
+	expect_heartbeat(conn);
+
+	res = amqp_simple_wait_frame(conn, &frame);
+	if (res != -AMQP_ERROR_HEARTBEAT_TIMEOUT)
+		die("amqp_simple_wait_frame returned %d", res);
+	expect_heartbeat(peer);
+	expect_heartbeat(peer);
+	if (amqp_data_in_buffer(peer))
+		die("too many heartbeats");
+	expect_nothing(peer_fd);
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+	return 0;
+}
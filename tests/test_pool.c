@@ -0,0 +1,181 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "fake_broker.h"
+
+static void *alloc(amqp_pool_t *pool, size_t amount)
+{
+	void *p = amqp_pool_alloc(pool, amount);
+	if (p == NULL)
+		die("amqp_pool_alloc(%lu) failed", (unsigned long)amount);
+
+	/* All of it must be usable */
+	memset(p, 0xa5, amount);
+	return p;
+}
+
+/* Pages are handed out again, in the same order, once recycled */
+static void test_pages(void)
+{
+	amqp_pool_t pool;
+	void *first[100];
+	int i;
+
+	init_amqp_pool(&pool, 4096);
+
+	for (i = 0; i < 100; i++)
+		first[i] = alloc(&pool, 3000);
+
+	recycle_amqp_pool(&pool);
+	for (i = 0; i < 100; i++)
+		if (alloc(&pool, 3000) != first[i])
+			die("page %d was not reused", i);
+
+	empty_amqp_pool(&pool);
+}
+
+/* A recycled large block serves the next allocation it is big enough
+   for, the smallest such block first */
+static void test_large_blocks(void)
+{
+	amqp_pool_t pool;
+	void *big, *small, *p;
+
+	init_amqp_pool(&pool, 4096);
+
+	big = alloc(&pool, 200000);
+	small = alloc(&pool, 20000);
+	recycle_amqp_pool(&pool);
+
+	if (alloc(&pool, 10000) != small)
+		die("the smaller spare block was not used");
+	if (alloc(&pool, 150000) != big)
+		die("the bigger spare block was not used");
+	p = alloc(&pool, 150000);
+	if (p == big || p == small)
+		die("a block was handed out twice");
+
+	/* Over many cycles, blocks keep being reused */
+	recycle_amqp_pool(&pool);
+	p = alloc(&pool, 200000);
+	if (p != big)
+		die("the spare block was not reused on the next cycle");
+
+	empty_amqp_pool(&pool);
+}
+
+/* A block too big to keep is freed, without displacing the spares
+   that fit */
+static void test_spare_limit(void)
+{
+	amqp_pool_t pool;
+	void *blocks[4];
+	int i, j;
+
+	init_amqp_pool(&pool, 4096);
+
+	for (i = 0; i < 4; i++)
+		blocks[i] = alloc(&pool, 512 * 1024);
+	alloc(&pool, 16 * 1024 * 1024);
+	recycle_amqp_pool(&pool);
+
+	for (i = 0; i < 4; i++) {
+		void *p = alloc(&pool, 512 * 1024);
+		for (j = 0; j < 4; j++)
+			if (p == blocks[j])
+				break;
+		if (j == 4)
+			die("spare block %d was dropped", i);
+		blocks[j] = NULL;
+	}
+
+	empty_amqp_pool(&pool);
+}
+
+/* Pool memory isn't zeroed, so decoders have to initialise all they
+   allocate: a content header with no properties, decoded into pages
+   full of junk, must still read as empty */
+static void test_decode_dirty(void)
+{
+	uint8_t no_flags[2] = { 0, 0 };
+	amqp_basic_properties_t *props;
+	amqp_bytes_t encoded;
+	amqp_pool_t pool;
+	void *decoded;
+	int i, res;
+
+	init_amqp_pool(&pool, 4096);
+	for (i = 0; i < 4; i++)
+		memset(alloc(&pool, 4000), 0xaa, 4000);
+	recycle_amqp_pool(&pool);
+
+	encoded.bytes = no_flags;
+	encoded.len = sizeof(no_flags);
+	res = amqp_decode_properties(AMQP_BASIC_CLASS, &pool, encoded,
+				     &decoded);
+	if (res < 0)
+		die("amqp_decode_properties returned %d", res);
+
+	props = decoded;
+	if (props->_flags != 0
+	    || props->content_type.len != 0
+	    || props->content_type.bytes != NULL
+	    || props->headers.num_entries != 0
+	    || props->delivery_mode != 0
+	    || props->priority != 0
+	    || props->timestamp != 0
+	    || props->reply_to.len != 0
+	    || props->cluster_id.len != 0)
+		die("properties decoded into a dirty pool aren't zero");
+
+	empty_amqp_pool(&pool);
+}
+
+int main(void)
+{
+	test_pages();
+	test_large_blocks();
+	test_spare_limit();
+	test_decode_dirty();
+	return 0;
+}
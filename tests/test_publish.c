@@ -0,0 +1,311 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+static void expect_bytes(amqp_bytes_t got, const char *want, const char *what)
+{
+	if (got.len != strlen(want) || memcmp(got.bytes, want, got.len) != 0)
+		die("%s doesn't match", what);
+}
+
+/* Publishes a message with most properties set, headers included, and
+   checks that the generic decoder reads back what was sent. */
+static void test_publish_properties(amqp_connection_state_t conn,
+				    amqp_connection_state_t peer)
+{
+	amqp_basic_properties_t props;
+	amqp_basic_properties_t *got;
+	amqp_basic_publish_t *m;
+	amqp_table_entry_t entries[2];
+	amqp_frame_t frame;
+	int res;
+
+	entries[0].key = amqp_cstring_bytes("a");
+	entries[0].value.kind = AMQP_FIELD_KIND_I32;
+	entries[0].value.value.i32 = 42;
+	entries[1].key = amqp_cstring_bytes("b");
+	entries[1].value.kind = AMQP_FIELD_KIND_UTF8;
+	entries[1].value.value.bytes = amqp_cstring_bytes("value");
+
+	memset(&props, 0, sizeof(props));
+	props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG
+		| AMQP_BASIC_HEADERS_FLAG
+		| AMQP_BASIC_DELIVERY_MODE_FLAG
+		| AMQP_BASIC_CORRELATION_ID_FLAG
+		| AMQP_BASIC_TIMESTAMP_FLAG
+		| AMQP_BASIC_APP_ID_FLAG;
+	props.content_type = amqp_cstring_bytes("text/plain");
+	props.headers.num_entries = 2;
+	props.headers.entries = entries;
+	props.delivery_mode = 2;
+	props.correlation_id = amqp_cstring_bytes("corr");
+	props.timestamp = 1234567890123ULL;
+	props.app_id = amqp_cstring_bytes("app");
+
+	res = amqp_basic_publish(conn, 3, amqp_cstring_bytes("exchange"),
+				 amqp_cstring_bytes("key"), 1, 0, &props,
+				 amqp_cstring_bytes("body"));
+	if (res < 0)
+		die("amqp_basic_publish returned %d", res);
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 3);
+	if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+		die("expected basic.publish");
+	m = frame.payload.method.decoded;
+	expect_bytes(m->exchange, "exchange", "exchange");
+	expect_bytes(m->routing_key, "key", "routing key");
+	if (!m->mandatory || m->immediate)
+		die("flags don't match");
+
+	expect_frame(peer, &frame, AMQP_FRAME_HEADER, 3);
+	if (frame.payload.properties.class_id != AMQP_BASIC_CLASS
+	    || frame.payload.properties.body_size != 4)
+		die("bad content header");
+	got = frame.payload.properties.decoded;
+	if (got->_flags != props._flags)
+		die("property flags don't match");
+	expect_bytes(got->content_type, "text/plain", "content type");
+	expect_bytes(got->correlation_id, "corr", "correlation id");
+	expect_bytes(got->app_id, "app", "app id");
+	if (got->delivery_mode != 2 || got->timestamp != props.timestamp)
+		die("properties don't match");
+	if (got->headers.num_entries != 2
+	    || got->headers.entries[0].value.value.i32 != 42)
+		die("headers don't match");
+	expect_bytes(got->headers.entries[1].value.value.bytes, "value",
+		     "header value");
+
+	expect_frame(peer, &frame, AMQP_FRAME_BODY, 3);
+	expect_bytes(frame.payload.body_fragment, "body", "body");
+
+	amqp_maybe_release_buffers(peer);
+}
+
+/* A short string longer than 255 bytes can't be encoded, and nothing
+   of a message that can't be encoded is sent */
+static void test_publish_too_long(amqp_connection_state_t conn,
+				  amqp_connection_state_t peer)
+{
+	amqp_basic_properties_t props;
+	char name[300];
+	amqp_bytes_t long_name;
+	int res;
+
+	memset(name, 'x', sizeof(name));
+	long_name.bytes = name;
+	long_name.len = sizeof(name);
+
+	res = amqp_basic_publish(conn, 3, long_name, amqp_cstring_bytes("key"),
+				 0, 0, NULL, amqp_cstring_bytes("body"));
+	if (res >= 0)
+		die("publish with a long exchange name succeeded");
+
+	props._flags = AMQP_BASIC_TYPE_FLAG;
+	props.type = long_name;
+	res = amqp_basic_publish(conn, 3, amqp_cstring_bytes("exchange"),
+				 amqp_cstring_bytes("key"), 0, 0, &props,
+				 amqp_cstring_bytes("body"));
+	if (res >= 0)
+		die("publish with a long type property succeeded");
+
+	if (amqp_data_in_buffer(peer))
+		die("unexpected output");
+	expect_nothing(amqp_get_sockfd(peer));
+}
+
+/* Publishes through a template with bodies of different sizes, and
+   checks that each content header carries the right body size */
+static void test_publish_template(amqp_connection_state_t conn,
+				  amqp_connection_state_t peer)
+{
+	static const char *bodies[] = { "first", "", "the third body" };
+	amqp_basic_properties_t props;
+	amqp_basic_properties_t *got;
+	amqp_basic_publish_t *m;
+	amqp_publish_template_t t;
+	amqp_frame_t frame;
+	char name[300];
+	size_t i;
+	int res;
+
+	props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+	props.content_type = amqp_cstring_bytes("text/plain");
+
+	t = amqp_new_publish_template(conn, 3, amqp_cstring_bytes("exchange"),
+				      amqp_cstring_bytes("key"), 0, 0, &props);
+	if (t == NULL)
+		die("amqp_new_publish_template failed");
+
+	for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+		res = amqp_basic_publish_template(conn, t,
+						  amqp_cstring_bytes(bodies[i]));
+		if (res < 0)
+			die("amqp_basic_publish_template returned %d", res);
+
+		expect_frame(peer, &frame, AMQP_FRAME_METHOD, 3);
+		if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+			die("expected basic.publish");
+		m = frame.payload.method.decoded;
+		expect_bytes(m->exchange, "exchange", "exchange");
+		expect_bytes(m->routing_key, "key", "routing key");
+
+		expect_frame(peer, &frame, AMQP_FRAME_HEADER, 3);
+		if (frame.payload.properties.body_size != strlen(bodies[i]))
+			die("body size doesn't match");
+		got = frame.payload.properties.decoded;
+		expect_bytes(got->content_type, "text/plain", "content type");
+
+		if (strlen(bodies[i]) > 0) {
+			expect_frame(peer, &frame, AMQP_FRAME_BODY, 3);
+			expect_bytes(frame.payload.body_fragment, bodies[i],
+				     "body");
+		}
+
+		amqp_maybe_release_buffers(peer);
+	}
+
+	amqp_destroy_publish_template(t);
+
+	memset(name, 'x', sizeof(name));
+	props.content_type.bytes = name;
+	props.content_type.len = sizeof(name);
+	t = amqp_new_publish_template(conn, 3, amqp_cstring_bytes("exchange"),
+				      amqp_cstring_bytes("key"), 0, 0, &props);
+	if (t != NULL)
+		die("template with a long content type was created");
+}
+
+/* A body spread over more frames than fit in one writev, with a small
+   frame_max so that it stays within the socket buffer. The frames must
+   arrive whole, in order, and ahead of the next message. */
+#define SMALL_FRAME_MAX 512
+#define MULTI_FRAME_BODY (100 * (SMALL_FRAME_MAX - 8) + 17)
+
+static void test_publish_multi_frame(amqp_connection_state_t conn,
+				     amqp_connection_state_t peer)
+{
+	amqp_bytes_t body;
+	amqp_frame_t frame;
+	size_t received = 0;
+	size_t i;
+	int res;
+
+	body.len = MULTI_FRAME_BODY;
+	body.bytes = malloc(body.len);
+	if (body.bytes == NULL)
+		die("out of memory");
+	for (i = 0; i < body.len; i++)
+		((uint8_t *)body.bytes)[i] = (uint8_t)(i % 251);
+
+	/* A connection can only be tuned once it has read a frame */
+	frame.frame_type = AMQP_FRAME_HEARTBEAT;
+	frame.channel = 0;
+	if (amqp_send_frame(peer, &frame) < 0)
+		die("amqp_send_frame failed");
+	if (amqp_simple_wait_frame(conn, &frame) < 0
+	    || frame.frame_type != AMQP_FRAME_HEARTBEAT)
+		die("expected a heartbeat");
+
+	if (amqp_tune_connection(conn, 0, SMALL_FRAME_MAX, 0) < 0)
+		die("amqp_tune_connection failed");
+
+	res = amqp_basic_publish(conn, 3, amqp_cstring_bytes("exchange"),
+				 amqp_cstring_bytes("key"), 0, 0, NULL, body);
+	if (res < 0)
+		die("amqp_basic_publish returned %d", res);
+	res = amqp_basic_publish(conn, 3, amqp_cstring_bytes("exchange"),
+				 amqp_cstring_bytes("next"), 0, 0, NULL,
+				 amqp_cstring_bytes("after"));
+	if (res < 0)
+		die("amqp_basic_publish returned %d", res);
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 3);
+	if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+		die("expected basic.publish");
+	expect_frame(peer, &frame, AMQP_FRAME_HEADER, 3);
+	if (frame.payload.properties.body_size != body.len)
+		die("body size doesn't match");
+
+	while (received < body.len) {
+		amqp_bytes_t fragment;
+
+		expect_frame(peer, &frame, AMQP_FRAME_BODY, 3);
+		fragment = frame.payload.body_fragment;
+		if (fragment.len > SMALL_FRAME_MAX - 8
+		    || fragment.len > body.len - received
+		    || memcmp(fragment.bytes,
+			      (uint8_t *)body.bytes + received,
+			      fragment.len) != 0)
+			die("body fragment at %lu doesn't match",
+			    (unsigned long)received);
+		received += fragment.len;
+		amqp_maybe_release_buffers(peer);
+	}
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 3);
+	if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+		die("expected the second basic.publish");
+	expect_bytes(((amqp_basic_publish_t *)frame.payload.method.decoded)
+		     ->routing_key, "next", "routing key");
+	expect_frame(peer, &frame, AMQP_FRAME_HEADER, 3);
+	expect_frame(peer, &frame, AMQP_FRAME_BODY, 3);
+	expect_bytes(frame.payload.body_fragment, "after", "body");
+
+	amqp_maybe_release_buffers(peer);
+	free(body.bytes);
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn, peer;
+
+	connection_pair(&conn, &peer);
+
+	test_publish_properties(conn, peer);
+	test_publish_template(conn, peer);
+	test_publish_too_long(conn, peer);
+	test_publish_multi_frame(conn, peer);
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+	return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+#define PRODUCERS 8
+#define MESSAGES 500
+#define LARGE_BODY 200000
+
+static amqp_publisher_t publisher;
+
+/* Every tenth message is large enough to be split into several body
+   frames; the rest are short. The body starts with the sequence
+   number, and is otherwise filled with the channel number. */
+static size_t body_size(int seq)
+{
+	return (seq % 10 == 9) ? LARGE_BODY : 16;
+}
+
+static void *producer(void *arg)
+{
+	amqp_channel_t channel = (amqp_channel_t)(size_t)arg;
+	char *buf = malloc(LARGE_BODY);
+	amqp_bytes_t body;
+	int seq, res;
+
+	if (buf == NULL)
+		die("out of memory");
+
+	memset(buf, channel, LARGE_BODY);
+
+	for (seq = 0; seq < MESSAGES; seq++) {
+		memcpy(buf, &seq, sizeof(seq));
+		body.bytes = buf;
+		body.len = body_size(seq);
+
+		res = amqp_publisher_publish(publisher, channel,
+					     amqp_cstring_bytes("ex"),
+					     amqp_cstring_bytes("rk"),
+					     0, 0, NULL, body);
+		if (res < 0)
+			die("amqp_publisher_publish returned %d", res);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Reads back everything the producers published, checking that each
+   message arrives whole, with its frames contiguous, and that each
+   channel's messages arrive in the order they were published. */
+static void read_messages(amqp_connection_state_t peer)
+{
+	int next_seq[PRODUCERS + 1];
+	amqp_frame_t frame;
+	int i;
+
+	memset(next_seq, 0, sizeof(next_seq));
+
+	for (i = 0; i < PRODUCERS * MESSAGES; i++) {
+		amqp_channel_t channel;
+		amqp_basic_publish_t *m;
+		size_t expected, received = 0;
+		int seq;
+
+		expect_frame(peer, &frame, AMQP_FRAME_METHOD, ANY_CHANNEL);
+		if (frame.payload.method.id != AMQP_BASIC_PUBLISH_METHOD)
+			die("expected basic.publish");
+		m = frame.payload.method.decoded;
+		if (m->routing_key.len != 2
+		    || memcmp(m->routing_key.bytes, "rk", 2) != 0)
+			die("wrong routing key");
+
+		channel = frame.channel;
+		if (channel < 1 || channel > PRODUCERS)
+			die("unexpected channel %d", channel);
+
+		seq = next_seq[channel]++;
+		expected = body_size(seq);
+
+		expect_frame(peer, &frame, AMQP_FRAME_HEADER, channel);
+		if (frame.payload.properties.body_size != expected)
+			die("bad content header on channel %d", channel);
+
+		while (received < expected) {
+			amqp_bytes_t fragment;
+			size_t j;
+
+			/* on the same channel: body frames aren't interleaved */
+			expect_frame(peer, &frame, AMQP_FRAME_BODY, channel);
+
+			fragment = frame.payload.body_fragment;
+			for (j = 0; j < fragment.len; j++) {
+				uint8_t want = (uint8_t)channel;
+				size_t pos = received + j;
+
+				if (pos < sizeof(seq))
+					want = ((uint8_t *)&seq)[pos];
+				if (((uint8_t *)fragment.bytes)[j] != want)
+					die("channel %d message %d corrupt at %d",
+					    channel, seq, (int)pos);
+			}
+			received += fragment.len;
+		}
+
+		if (received != expected)
+			die("body too long");
+
+		amqp_maybe_release_buffers(peer);
+	}
+}
+
+/* A broker that stops reading leaves the I/O thread with output it
+   can't write; a stop with a timeout gives up on it */
+static void test_stop_timeout(void)
+{
+	amqp_connection_state_t conn, peer;
+	amqp_publisher_t p;
+	struct timeval timeout;
+	amqp_bytes_t body;
+	int i, res;
+
+	connection_pair(&conn, &peer);
+
+	p = amqp_start_publisher(conn);
+	if (p == NULL)
+		die("amqp_start_publisher failed");
+
+	body.len = LARGE_BODY;
+	body.bytes = calloc(1, body.len);
+	if (body.bytes == NULL)
+		die("out of memory");
+
+	/* Far more than the socket buffers hold */
+	for (i = 0; i < 50; i++) {
+		res = amqp_publisher_publish(p, 1, amqp_cstring_bytes("ex"),
+					     amqp_cstring_bytes("rk"), 0, 0,
+					     NULL, body);
+		if (res < 0)
+			die("amqp_publisher_publish returned %d", res);
+	}
+
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 100 * 1000;
+	res = amqp_stop_publisher_timeout(p, &timeout);
+	if (res != -AMQP_ERROR_TIMEOUT)
+		die("amqp_stop_publisher_timeout returned %d", res);
+
+	free(body.bytes);
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn, peer;
+	pthread_t threads[PRODUCERS];
+	int i, res;
+
+	connection_pair(&conn, &peer);
+
+	publisher = amqp_start_publisher(conn);
+	if (publisher == NULL)
+		die("amqp_start_publisher failed");
+
+	for (i = 0; i < PRODUCERS; i++)
+		if (pthread_create(&threads[i], NULL, producer,
+				   (void *)(size_t)(i + 1)) != 0)
+			die("pthread_create failed");
+
+	read_messages(peer);
+
+	for (i = 0; i < PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+
+	res = amqp_stop_publisher(publisher);
+	if (res < 0)
+		die("amqp_stop_publisher returned %d", res);
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+
+	test_stop_timeout();
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+static void send_qos(amqp_connection_state_t conn, amqp_channel_t channel)
+{
+	amqp_method_number_t replies[] = { AMQP_BASIC_QOS_OK_METHOD, 0 };
+	amqp_basic_qos_t req;
+
+	memset(&req, 0, sizeof(req));
+	req.prefetch_count = 10;
+	if (amqp_simple_rpc_send(conn, channel, AMQP_BASIC_QOS_METHOD,
+				 replies, &req) < 0)
+		die("amqp_simple_rpc_send failed");
+}
+
+static void send_exchange_declare(amqp_connection_state_t conn,
+				  amqp_channel_t channel)
+{
+	amqp_method_number_t replies[] = {
+		AMQP_EXCHANGE_DECLARE_OK_METHOD, 0 };
+	amqp_exchange_declare_t req;
+
+	memset(&req, 0, sizeof(req));
+	req.exchange = amqp_cstring_bytes("ex");
+	req.type = amqp_cstring_bytes("direct");
+	if (amqp_simple_rpc_send(conn, channel, AMQP_EXCHANGE_DECLARE_METHOD,
+				 replies, &req) < 0)
+		die("amqp_simple_rpc_send failed");
+}
+
+static void send_queue_declare(amqp_connection_state_t conn,
+			       amqp_channel_t channel)
+{
+	amqp_method_number_t replies[] = { AMQP_QUEUE_DECLARE_OK_METHOD, 0 };
+	amqp_queue_declare_t req;
+
+	memset(&req, 0, sizeof(req));
+	if (amqp_simple_rpc_send(conn, channel, AMQP_QUEUE_DECLARE_METHOD,
+				 replies, &req) < 0)
+		die("amqp_simple_rpc_send failed");
+}
+
+static void reply_queue_declare(int fd, uint16_t channel, const char *queue)
+{
+	uint8_t args[264];
+	uint8_t *p = args;
+
+	p = put_shortstr(p, queue);
+	p = put_u32(p, 0);
+	p = put_u32(p, 0);
+	send_method(fd, channel, AMQP_QUEUE_DECLARE_OK_METHOD, args, p - args);
+}
+
+/* channel.close or connection.close, as the broker sends them */
+static void send_close(int fd, uint16_t channel, amqp_method_number_t method)
+{
+	uint8_t args[64];
+	uint8_t *p = args;
+
+	p = put_u16(p, 406);
+	p = put_shortstr(p, "PRECONDITION_FAILED");
+	p = put_u16(p, 40);
+	p = put_u16(p, 10);
+	send_method(fd, channel, method, args, p - args);
+}
+
+static void expect_reply(amqp_connection_state_t conn,
+			 amqp_response_type_enum type,
+			 amqp_method_number_t id)
+{
+	amqp_rpc_reply_t r = amqp_simple_rpc_collect(conn);
+
+	if (r.reply_type != type)
+		die("expected reply type %d, got %d (error %d)", type,
+		    r.reply_type, r.library_error);
+	if (type != AMQP_RESPONSE_LIBRARY_EXCEPTION && r.reply.id != id)
+		die("expected method %08x, got %08x", id, r.reply.id);
+}
+
+static void expect_failed(amqp_connection_state_t conn, int error)
+{
+	amqp_rpc_reply_t r = amqp_simple_rpc_collect(conn);
+
+	if (r.reply_type != AMQP_RESPONSE_LIBRARY_EXCEPTION
+	    || r.library_error != error)
+		die("expected error %d, got reply type %d error %d", error,
+		    r.reply_type, r.library_error);
+}
+
+/* Replies are handed back in the order the requests were sent, however
+   the broker interleaves them across channels */
+static void test_in_order(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+	amqp_rpc_reply_t r;
+
+	send_qos(conn, 1);
+	send_exchange_declare(conn, 1);
+	send_queue_declare(conn, 2);
+	if (amqp_simple_rpc_outstanding(conn) != 3)
+		die("expected 3 outstanding requests");
+
+	reply_queue_declare(fd, 2, "q2");
+	send_method(fd, 1, AMQP_BASIC_QOS_OK_METHOD, NULL, 0);
+	send_method(fd, 1, AMQP_EXCHANGE_DECLARE_OK_METHOD, NULL, 0);
+
+	expect_reply(conn, AMQP_RESPONSE_NORMAL, AMQP_BASIC_QOS_OK_METHOD);
+	expect_reply(conn, AMQP_RESPONSE_NORMAL,
+		     AMQP_EXCHANGE_DECLARE_OK_METHOD);
+
+	r = amqp_simple_rpc_collect(conn);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL
+	    || r.reply.id != AMQP_QUEUE_DECLARE_OK_METHOD)
+		die("expected queue.declare-ok");
+	{
+		amqp_queue_declare_ok_t *ok = r.reply.decoded;
+		if (ok->queue.len != 2 || memcmp(ok->queue.bytes, "q2", 2))
+			die("queue.declare-ok has the wrong queue name");
+	}
+
+	if (amqp_simple_rpc_outstanding(conn) != 0)
+		die("expected no outstanding requests");
+	expect_failed(conn, AMQP_ERROR_NOT_SUPPORTED);
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* The broker closes a channel in reply to the first of several
+   requests on it; the rest are failed, not waited for */
+static void test_channel_close(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+
+	send_qos(conn, 1);
+	send_exchange_declare(conn, 1);
+	send_queue_declare(conn, 2);
+	send_qos(conn, 1);
+
+	send_close(fd, 1, AMQP_CHANNEL_CLOSE_METHOD);
+	reply_queue_declare(fd, 2, "q2");
+
+	expect_reply(conn, AMQP_RESPONSE_SERVER_EXCEPTION,
+		     AMQP_CHANNEL_CLOSE_METHOD);
+	expect_failed(conn, AMQP_ERROR_CHANNEL_CLOSED);
+	expect_reply(conn, AMQP_RESPONSE_NORMAL, AMQP_QUEUE_DECLARE_OK_METHOD);
+	expect_failed(conn, AMQP_ERROR_CHANNEL_CLOSED);
+
+	/* Requests sent afterwards, e.g. on the reopened channel, are
+	   waited for as usual */
+	send_qos(conn, 1);
+	send_method(fd, 1, AMQP_BASIC_QOS_OK_METHOD, NULL, 0);
+	expect_reply(conn, AMQP_RESPONSE_NORMAL, AMQP_BASIC_QOS_OK_METHOD);
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* A channel.close that arrives while an earlier request on another
+   channel is awaited is still matched to the right request */
+static void test_channel_close_queued(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+
+	send_qos(conn, 2);
+	send_qos(conn, 1);
+	send_exchange_declare(conn, 1);
+
+	send_close(fd, 1, AMQP_CHANNEL_CLOSE_METHOD);
+	send_method(fd, 2, AMQP_BASIC_QOS_OK_METHOD, NULL, 0);
+
+	expect_reply(conn, AMQP_RESPONSE_NORMAL, AMQP_BASIC_QOS_OK_METHOD);
+	expect_reply(conn, AMQP_RESPONSE_SERVER_EXCEPTION,
+		     AMQP_CHANNEL_CLOSE_METHOD);
+	expect_failed(conn, AMQP_ERROR_CHANNEL_CLOSED);
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* connection.close fails everything after it, on every channel */
+static void test_connection_close(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+
+	send_qos(conn, 1);
+	send_qos(conn, 2);
+	send_queue_declare(conn, 3);
+
+	send_close(fd, 0, AMQP_CONNECTION_CLOSE_METHOD);
+
+	expect_reply(conn, AMQP_RESPONSE_SERVER_EXCEPTION,
+		     AMQP_CONNECTION_CLOSE_METHOD);
+	expect_failed(conn, AMQP_ERROR_CONNECTION_CLOSED);
+	expect_failed(conn, AMQP_ERROR_CONNECTION_CLOSED);
+	if (amqp_simple_rpc_outstanding(conn) != 0)
+		die("expected no outstanding requests");
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+int main(void)
+{
+	test_in_order();
+	test_channel_close();
+	test_channel_close_queued();
+	test_connection_close();
+	return 0;
+}
@@ -402,6 +402,170 @@ static void test_table_codec(FILE *out)
 
 #define CHUNK_SIZE 4096
 
+static void test_table_lookup(void)
+{
+  amqp_pool_t pool;
+  amqp_table_entry_t entries[64];
+  char keys[64][8];
+  amqp_table_t table;
+  amqp_table_index_t *index;
+  amqp_field_value_t *v;
+  int i;
+
+  init_amqp_pool(&pool, 4096);
+
+  for (i = 0; i < 64; i++) {
+    sprintf(keys[i], "key%d", i % 60);
+    entries[i].key = amqp_cstring_bytes(keys[i]);
+    entries[i].value.kind = AMQP_FIELD_KIND_I32;
+    entries[i].value.value.i32 = i;
+  }
+
+  table.num_entries = 64;
+  table.entries = entries;
+
+  index = amqp_index_table(&pool, &table);
+  if (index == NULL)
+    die("amqp_index_table failed");
+
+  for (i = 0; i < 60; i++) {
+    /* keys 0 to 3 appear twice; the first entry wins */
+    v = amqp_table_get(&table, entries[i].key);
+    if (v == NULL || v->value.i32 != i)
+      die("amqp_table_get found the wrong entry for %s", keys[i]);
+
+    v = amqp_table_index_get(index, entries[i].key);
+    if (v == NULL || v->value.i32 != i)
+      die("amqp_table_index_get found the wrong entry for %s", keys[i]);
+  }
+
+  if (amqp_table_get(&table, amqp_cstring_bytes("key60")) != NULL
+      || amqp_table_index_get(index, amqp_cstring_bytes("key60")) != NULL
+      || amqp_table_index_get(index, amqp_cstring_bytes("")) != NULL)
+    die("found a key that isn't there");
+
+  table.num_entries = 0;
+  index = amqp_index_table(&pool, &table);
+  if (index == NULL
+      || amqp_table_index_get(index, amqp_cstring_bytes("key0")) != NULL)
+    die("lookup in an empty table failed");
+
+  empty_amqp_pool(&pool);
+}
+
+/* Builds the same table with a table writer and by hand, and checks
+   that they encode to the same bytes */
+static void test_table_writer(void)
+{
+  amqp_table_writer_t w;
+  amqp_table_t written, table, inner;
+  amqp_table_entry_t entries[4], inner_entries[1];
+  amqp_field_value_t list_values[2];
+  uint8_t write_buf[256], expect_buf[256], encode_buf[256];
+  amqp_bytes_t buf;
+  size_t expected_len, encoded_len;
+  amqp_pool_t pool;
+  int res;
+
+  buf.bytes = write_buf;
+  buf.len = sizeof(write_buf);
+  amqp_table_writer_init(&w, buf);
+  amqp_table_add_utf8(&w, amqp_cstring_bytes("name"),
+                      amqp_cstring_bytes("value"));
+  amqp_table_add_i32(&w, amqp_cstring_bytes("count"), 7);
+  amqp_table_begin_table(&w, amqp_cstring_bytes("nested"));
+  amqp_table_add_boolean(&w, amqp_cstring_bytes("flag"), 1);
+  amqp_table_end(&w);
+  amqp_table_begin_array(&w, amqp_cstring_bytes("list"));
+  amqp_table_add_i64(&w, amqp_empty_bytes, 1);
+  amqp_table_add_utf8(&w, amqp_empty_bytes, amqp_cstring_bytes("two"));
+  amqp_table_end(&w);
+  res = amqp_table_writer_finish(&w, &written);
+  if (res < 0)
+    die("amqp_table_writer_finish returned %d", res);
+
+  inner_entries[0].key = amqp_cstring_bytes("flag");
+  inner_entries[0].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  inner_entries[0].value.value.boolean = 1;
+  inner.num_entries = 1;
+  inner.entries = inner_entries;
+
+  list_values[0].kind = AMQP_FIELD_KIND_I64;
+  list_values[0].value.i64 = 1;
+  list_values[1].kind = AMQP_FIELD_KIND_UTF8;
+  list_values[1].value.bytes = amqp_cstring_bytes("two");
+
+  entries[0].key = amqp_cstring_bytes("name");
+  entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[0].value.value.bytes = amqp_cstring_bytes("value");
+  entries[1].key = amqp_cstring_bytes("count");
+  entries[1].value.kind = AMQP_FIELD_KIND_I32;
+  entries[1].value.value.i32 = 7;
+  entries[2].key = amqp_cstring_bytes("nested");
+  entries[2].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[2].value.value.table = inner;
+  entries[3].key = amqp_cstring_bytes("list");
+  entries[3].value.kind = AMQP_FIELD_KIND_ARRAY;
+  entries[3].value.value.array.num_entries = 2;
+  entries[3].value.value.array.entries = list_values;
+  table.num_entries = 4;
+  table.entries = entries;
+
+  buf.bytes = expect_buf;
+  buf.len = sizeof(expect_buf);
+  expected_len = 0;
+  if (amqp_encode_table(buf, &table, &expected_len) < 0)
+    die("encoding the table failed");
+
+  /* The written table goes through amqp_encode_table unchanged */
+  buf.bytes = encode_buf;
+  buf.len = sizeof(encode_buf);
+  encoded_len = 0;
+  if (amqp_encode_table(buf, &written, &encoded_len) < 0)
+    die("encoding the written table failed");
+
+  if (w.offset != expected_len
+      || memcmp(write_buf, expect_buf, expected_len) != 0
+      || encoded_len != expected_len
+      || memcmp(encode_buf, expect_buf, expected_len) != 0)
+    die("written table doesn't match");
+
+  /* A finished writer takes nothing more, and its table is only good
+     for encoding */
+  if (amqp_table_add_i32(&w, amqp_cstring_bytes("late"), 1)
+      != -AMQP_ERROR_BAD_AMQP_DATA)
+    die("table writer took an entry once finished");
+  amqp_table_writer_init(&w, buf);
+  if (amqp_table_writer_finish(&w, &written) < 0)
+    die("finishing an empty table failed");
+  if (amqp_table_begin_table(&w, amqp_cstring_bytes("late"))
+      != -AMQP_ERROR_BAD_AMQP_DATA)
+    die("table writer began a table once finished");
+
+  init_amqp_pool(&pool, 4096);
+  if (amqp_table_get(&written, amqp_cstring_bytes("late")) != NULL
+      || amqp_index_table(&pool, &written) != NULL)
+    die("looked up a written table");
+  empty_amqp_pool(&pool);
+
+  /* Running out of room is reported at the end */
+  buf.bytes = write_buf;
+  buf.len = 16;
+  amqp_table_writer_init(&w, buf);
+  amqp_table_add_utf8(&w, amqp_cstring_bytes("name"),
+                      amqp_cstring_bytes("a value that does not fit"));
+  amqp_table_add_i32(&w, amqp_cstring_bytes("n"), 1);
+  if (amqp_table_writer_finish(&w, &written) >= 0)
+    die("overflowing table writer succeeded");
+
+  /* So is an unclosed nested table */
+  buf.len = sizeof(write_buf);
+  amqp_table_writer_init(&w, buf);
+  amqp_table_begin_table(&w, amqp_cstring_bytes("nested"));
+  if (amqp_table_writer_finish(&w, &written) >= 0)
+    die("unbalanced table writer succeeded");
+}
+
 static int compare_files(FILE *f1_in, FILE *f2_in)
 {
   char f1_buf[CHUNK_SIZE];
@@ -444,6 +608,8 @@ int main(void)
   test_table_codec(out);
   fprintf(out, "----------\n");
   test_dump_value(out);
+  test_table_lookup();
+  test_table_writer();
 
   if (srcdir == NULL)
     srcdir = ".";
@@ -0,0 +1,182 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+static struct timeval timeout_ms(int ms)
+{
+	struct timeval tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return tv;
+}
+
+static long now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+/* Checks that a wait given up after 100ms took about that long */
+static void check_elapsed(long start, const char *what)
+{
+	long elapsed = now_ms() - start;
+	if (elapsed < 90 || elapsed > 5000)
+		die("%s gave up after %ldms", what, elapsed);
+}
+
+/* A broker that never sends anything */
+static void test_wait_frame(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+	struct timeval tv = timeout_ms(100);
+	amqp_frame_t frame;
+	long start = now_ms();
+	int res;
+
+	res = amqp_simple_wait_frame_timeout(conn, &frame, &tv);
+	if (res != -AMQP_ERROR_TIMEOUT)
+		die("amqp_simple_wait_frame_timeout returned %d", res);
+	check_elapsed(start, "amqp_simple_wait_frame_timeout");
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* A broker that never replies */
+static void test_rpc(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+	struct timeval tv = timeout_ms(100);
+	amqp_rpc_reply_t reply;
+	long start = now_ms();
+
+	amqp_set_rpc_timeout(conn, &tv);
+	if (amqp_channel_open(conn, 1) != NULL)
+		die("amqp_channel_open succeeded without a reply");
+	check_elapsed(start, "amqp_channel_open");
+
+	reply = amqp_get_rpc_reply(conn);
+	if (reply.reply_type != AMQP_RESPONSE_LIBRARY_EXCEPTION
+	    || reply.library_error != AMQP_ERROR_TIMEOUT)
+		die("expected a timeout, got reply type %d error %d",
+		    reply.reply_type, reply.library_error);
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* A broker that stops reading: once the socket's buffers fill up, a
+   publish must not block forever, even with a timeout of less than a
+   millisecond */
+static void test_send(struct timeval tv)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+	amqp_bytes_t body;
+	int i, res = 0;
+	long start = 0;
+
+	body.len = 32768;
+	body.bytes = calloc(1, body.len);
+	if (body.bytes == NULL)
+		die("out of memory");
+
+	amqp_set_rpc_timeout(conn, &tv);
+	for (i = 0; i < 1000 && res == 0; i++) {
+		start = now_ms();
+		res = amqp_basic_publish(conn, 1, amqp_cstring_bytes("ex"),
+					 amqp_cstring_bytes("rk"), 0, 0, NULL,
+					 body);
+	}
+
+	if (res != -AMQP_ERROR_TIMEOUT)
+		die("amqp_basic_publish returned %d after %d publishes", res, i);
+	if (tv.tv_sec != 0 || tv.tv_usec >= 1000)
+		check_elapsed(start, "amqp_basic_publish");
+
+	free(body.bytes);
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+/* A timeout too long for an int of milliseconds is capped rather than
+   wrapped around */
+static void test_long_timeout(void)
+{
+	int fd;
+	amqp_connection_state_t conn = fake_connection(&fd);
+	struct timeval tv;
+	socklen_t len = sizeof(tv);
+
+	tv.tv_sec = 30 * 24 * 3600;
+	tv.tv_usec = 0;
+	amqp_set_rpc_timeout(conn, &tv);
+
+	memset(&tv, 0, sizeof(tv));
+	if (getsockopt(amqp_get_sockfd(conn), SOL_SOCKET, SO_SNDTIMEO, &tv,
+		       &len) < 0)
+		die("getsockopt failed");
+	if (tv.tv_sec < INT_MAX / 1000 - 1 || tv.tv_sec > INT_MAX / 1000)
+		die("send timeout of %lds", (long)tv.tv_sec);
+
+	amqp_destroy_connection(conn);
+	close(fd);
+}
+
+int main(void)
+{
+	struct timeval sub_ms = { 0, 500 };
+
+	test_wait_frame();
+	test_rpc();
+	test_send(timeout_ms(100));
+	test_send(sub_ms);
+	test_long_timeout();
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fake_broker.h"
+
+#ifdef HAVE_IO_URING
+
+/* More than a socketpair's buffers hold, so sending it has to wait
+   for the peer to read */
+#define LARGE_BODY (4 * 1024 * 1024)
+
+static void expect_method(amqp_connection_state_t peer,
+			  amqp_method_number_t id)
+{
+	amqp_frame_t frame;
+
+	expect_frame(peer, &frame, AMQP_FRAME_METHOD, 1);
+
+	if (frame.payload.method.id != id)
+		die("expected method %08x, got %08x", id,
+		    frame.payload.method.id);
+}
+
+/* Reads a published message, checking that its body is size bytes of
+   fill */
+static void expect_message(amqp_connection_state_t peer, size_t size,
+			   char fill)
+{
+	amqp_frame_t frame;
+	size_t got = 0;
+
+	expect_method(peer, AMQP_BASIC_PUBLISH_METHOD);
+	expect_frame(peer, &frame, AMQP_FRAME_HEADER, 1);
+	if (frame.payload.properties.body_size != size)
+		die("expected a body of %lu bytes", (unsigned long)size);
+
+	while (got < size) {
+		size_t i;
+
+		expect_frame(peer, &frame, AMQP_FRAME_BODY, 1);
+		for (i = 0; i < frame.payload.body_fragment.len; i++)
+			if (((char *)frame.payload.body_fragment.bytes)[i]
+			    != fill)
+				die("body corrupted at byte %lu",
+				    (unsigned long)(got + i));
+		got += frame.payload.body_fragment.len;
+		amqp_maybe_release_buffers(peer);
+	}
+
+	if (got != size)
+		die("body too long");
+}
+
+static void reply_qos_ok(amqp_connection_state_t peer)
+{
+	amqp_basic_qos_ok_t ok;
+
+	if (amqp_send_method(peer, 1, AMQP_BASIC_QOS_OK_METHOD, &ok) < 0)
+		die("amqp_send_method failed");
+}
+
+static amqp_bytes_t body_of(size_t size, char fill)
+{
+	amqp_bytes_t body;
+
+	body.len = size;
+	body.bytes = malloc(size);
+	if (body.bytes == NULL)
+		die("out of memory");
+	memset(body.bytes, fill, size);
+	return body;
+}
+
+static void publish(amqp_connection_state_t conn, amqp_bytes_t body,
+		    amqp_boolean_t batch)
+{
+	int res;
+
+	if (batch)
+		res = amqp_basic_publish_batch(conn, 1,
+					       amqp_cstring_bytes("ex"),
+					       amqp_cstring_bytes("rk"),
+					       0, 0, NULL, body);
+	else
+		res = amqp_basic_publish(conn, 1, amqp_cstring_bytes("ex"),
+					 amqp_cstring_bytes("rk"), 0, 0, NULL,
+					 body);
+	if (res < 0)
+		die("publishing returned %d", res);
+}
+
+/* basic.qos, sent along with the batch already pending, and answered
+   before the peer reads any of it */
+static void pipelined_qos(amqp_connection_state_t conn,
+			  amqp_connection_state_t peer)
+{
+	amqp_method_number_t replies[] = { AMQP_BASIC_QOS_OK_METHOD, 0 };
+	amqp_basic_qos_t qos;
+	amqp_rpc_reply_t reply;
+
+	memset(&qos, 0, sizeof(qos));
+	reply_qos_ok(peer);
+	if (amqp_simple_rpc_send(conn, 1, AMQP_BASIC_QOS_METHOD, replies,
+				 &qos) < 0)
+		die("amqp_simple_rpc_send failed");
+
+	reply = amqp_simple_rpc_collect(conn);
+	if (reply.reply_type != AMQP_RESPONSE_NORMAL)
+		die("pipelined basic.qos failed");
+}
+
+static void *drain(void *arg)
+{
+	amqp_connection_state_t peer = arg;
+
+	expect_message(peer, LARGE_BODY, 'L');
+	expect_method(peer, AMQP_BASIC_QOS_METHOD);
+	return NULL;
+}
+
+int main(void)
+{
+	amqp_connection_state_t conn, peer;
+	amqp_bytes_t body;
+	pthread_t thread;
+	int res;
+
+	connection_pair(&conn, &peer);
+
+	res = amqp_use_io_uring(conn);
+	if (res < 0) {
+		fprintf(stderr, "io_uring isn't available (%d), skipping\n",
+			res);
+		return 77;
+	}
+
+	/* A plain write */
+	body = body_of(1000, 'a');
+	publish(conn, body, 0);
+	free(body.bytes);
+	expect_message(peer, 1000, 'a');
+
+	/* The pending output goes with the read that waits for the reply */
+	reply_qos_ok(peer);
+	amqp_basic_qos(conn, 1, 0, 10, 0);
+	if (amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL)
+		die("basic.qos failed");
+	expect_method(peer, AMQP_BASIC_QOS_METHOD);
+
+	/* The reply is already there while the send still has far to go:
+	   the read returns without waiting for the send, which only
+	   completes once the peer reads */
+	amqp_set_batch_limits(conn, 0, 0);
+	body = body_of(LARGE_BODY, 'L');
+	publish(conn, body, 1);
+	free(body.bytes);
+	pipelined_qos(conn, peer);
+
+	if (pthread_create(&thread, NULL, drain, peer) != 0)
+		die("pthread_create failed");
+
+	res = amqp_flush(conn);
+	if (res < 0)
+		die("amqp_flush returned %d", res);
+	pthread_join(thread, NULL);
+
+	/* And a send left in flight is cancelled on destruction */
+	body = body_of(LARGE_BODY, 'L');
+	publish(conn, body, 1);
+	free(body.bytes);
+	pipelined_qos(conn, peer);
+
+	amqp_destroy_connection(conn);
+	amqp_destroy_connection(peer);
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "built without io_uring support, skipping\n");
+	return 77;
+}
+
+#endif
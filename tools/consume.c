@@ -127,25 +127,25 @@ static void do_consume(amqp_connection_state_t conn, amqp_bytes_t queue,
 		die_rpc(amqp_get_rpc_reply(conn), "basic.consume");
 
 	for (i = 0; count < 0 || i < count; i++) {
-		amqp_frame_t frame;
+		amqp_envelope_t envelope;
 		struct pipeline pl;
-		uint64_t delivery_tag;
-		int res = amqp_simple_wait_frame(conn, &frame);
-		die_amqp_error(res, "waiting for header frame");
-
-		if (frame.frame_type != AMQP_FRAME_METHOD
-		    || frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD)
+		int res = amqp_consume_message(conn, &envelope, NULL);
+		if (res < 0) {
+			/* Skip anything that isn't a delivery */
+			amqp_frame_t frame;
+			if (res != -AMQP_ERROR_UNEXPECTED_FRAME)
+				die_amqp_error(res, "waiting for message");
+			die_amqp_error(amqp_simple_wait_frame(conn, &frame),
+				       "waiting for frame");
 			continue;
-
-		amqp_basic_deliver_t *deliver
-			= (amqp_basic_deliver_t *)frame.payload.method.decoded;
-		delivery_tag = deliver->delivery_tag;
+		}
 
 		pipeline(argv, &pl);
-		copy_body(conn, pl.infd);
+		write_all(pl.infd, envelope.body);
 
 		if (finish_pipeline(&pl) && !no_ack)
-			die_amqp_error(amqp_basic_ack(conn, 1, delivery_tag,
+			die_amqp_error(amqp_basic_ack(conn, 1,
+						      envelope.delivery_tag,
 						      0),
 				       "basic.ack");
 